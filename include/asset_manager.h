@@ -18,6 +18,7 @@
 #define SYSTEM4_ASSET_MANAGER_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct archive_data;
 struct cg;
@@ -47,4 +48,30 @@ struct cg *asset_cg_load_by_name(const char *name, int *id_out);
 bool asset_cg_get_metrics(int no, struct cg_metrics *metrics);
 bool asset_cg_get_metrics_by_name(const char *name, struct cg_metrics *metrics);
 
+/*
+ * Decoded CG cache. asset_cg_get() returns a CG which must not be modified,
+ * and which must be given back with asset_cg_release() (instead of cg_free)
+ * once the caller is done with it.
+ */
+struct asset_cg_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	// CGs decoded by the prefetch threads
+	unsigned long prefetched;
+	size_t nr_entries;
+	size_t size;
+	size_t capacity;
+};
+
+struct cg *asset_cg_get(int no);
+void asset_cg_release(struct cg *cg);
+// Start decoding a CG in the background so that a later asset_cg_get() is fast.
+void asset_cg_prefetch(int no);
+// Set the cache size from a game's cg_cache_size parameter (or the config).
+void asset_cg_cache_init(int game_cache_size);
+void asset_cg_cache_set_size(size_t bytes);
+void asset_cg_cache_flush(void);
+void asset_cg_cache_get_stats(struct asset_cg_cache_stats *stats);
+
 #endif /* SYSTEM4_ASSET_MANAGER_H */
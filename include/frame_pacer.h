@@ -0,0 +1,55 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_FRAME_PACER_H
+#define SYSTEM4_FRAME_PACER_H
+
+#include <stdbool.h>
+
+/*
+ * Frame pacing.
+ *
+ * Loops that update the screen (sact_Update, effects) call
+ * frame_pacer_wait() before presenting and frame_pacer_end() after. Each
+ * present is given one frame slot at the configured target frame rate
+ * (--target-fps; off by default): a present that arrives early sleeps until
+ * its slot. Iterations that don't present return immediately while the
+ * current slot lasts, so game logic calling Update several times per frame
+ * isn't slowed down; only once a whole slot has passed without a present
+ * (i.e. the script is spinning idle) do they sleep until the next slot.
+ *
+ * When vsync is on, presenting iterations wake up slightly early and let
+ * the buffer swap do the final wait.
+ */
+
+struct frame_pacer_stats {
+	// frames presented
+	unsigned long presented;
+	// updates that didn't present anything
+	unsigned long coalesced;
+	// interval between presents over the recent sample window, in ms
+	unsigned nr_samples;
+	float min;
+	float avg;
+	float p99;
+	float max;
+};
+
+void frame_pacer_wait(bool will_present);
+void frame_pacer_end(bool presented);
+void frame_pacer_get_stats(struct frame_pacer_stats *stats);
+
+#endif /* SYSTEM4_FRAME_PACER_H */
@@ -22,6 +22,7 @@
 
 struct fnl;
 struct hash_table;
+struct glyph_atlas;
 
 // standard font weight values
 enum {
@@ -43,10 +44,19 @@ enum font_weight {
 };
 #define NR_FONT_WEIGHTS (FONT_WEIGHT_HEAVY+1)
 
+// Location of a rendered glyph bitmap in its font size's glyph atlas.
+struct glyph_slot {
+	int page;
+	// valid only while this matches the page's generation
+	unsigned gen;
+	int x, y, w, h;
+};
+
 struct glyph {
+	// glyph rectangle, relative to the origin of the glyph bitmap
 	Rectangle rect;
 	float advance;
-	Texture t[NR_FONT_WEIGHTS];
+	struct glyph_slot slot[NR_FONT_WEIGHTS];
 };
 
 struct font_size {
@@ -54,6 +64,7 @@ struct font_size {
 	int y_offset;
 	struct font *font;
 	struct hash_table *glyph_table;
+	struct glyph_atlas *atlas;
 };
 
 enum charmap {
@@ -110,6 +121,8 @@ static inline void text_style_set_edge_width(struct text_style *ts, float w)
 extern bool gfx_text_advance_edges;
 
 void gfx_font_init(void);
+bool font_glyph_store(struct font_size *size, struct glyph *glyph, enum font_weight weight,
+		int w, int h, uint8_t *pixels);
 void ft_font_init(void);
 struct font *ft_font_load(const char *path);
 struct font *fnl_font_load(struct fnl *lib, unsigned index);
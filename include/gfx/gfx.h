@@ -36,13 +36,36 @@ enum draw_method {
 
 typedef struct texture {
 	GLuint handle;
+	// 0 if the texture wasn't created by gfx_init_texture_*
+	GLenum internal_format;
 	mat4 world_transform;
 	int w, h;
 	bool has_alpha;
 	int alpha_mod;
 	enum draw_method draw_method;
+	// changes whenever the texture's contents may have changed
+	unsigned version;
 } Texture;
 
+/*
+ * CPU-side copy of a texture's alpha channel, for hit testing without
+ * reading back from the GPU on every query. When the texture has been drawn
+ * to since the copy was taken, queries read back single pixels; the copy is
+ * only refreshed (with a full readback) once the texture has stayed
+ * unchanged for several queries, so textures redrawn every frame never pay
+ * for full readbacks.
+ */
+struct alpha_shadow {
+	unsigned version;
+	int w, h;
+	// if non-negative, every pixel has this alpha value and ALPHA is NULL
+	int uniform;
+	uint8_t *alpha;
+	// queries made since the texture changed to STALE_VERSION
+	unsigned stale_version;
+	int stale_queries;
+};
+
 struct gfx_render_job;
 
 typedef struct shader {
@@ -71,6 +94,7 @@ Texture *gfx_main_surface(void);
 void gfx_set_window_logical_size(int w, int h);
 void gfx_update_screen_scale(void);
 void gfx_set_wait_vsync(bool wait);
+bool gfx_get_wait_vsync(void);
 
 void gfx_load_shader(struct shader *dst, const char *vertex_shader_path, const char *fragment_shader_path);
 GLuint gfx_load_shader_file(const char *path, GLenum type);
@@ -78,6 +102,7 @@ GLuint gfx_load_shader_file(const char *path, GLenum type);
 // rendering
 void gfx_set_clear_color(int r, int g, int b, int a);
 void gfx_clear(void);
+void gfx_set_scissor(Rectangle *r);
 void gfx_swap(void);
 void gfx_prepare_job(struct gfx_render_job *job);
 void gfx_run_job(struct gfx_render_job *job);
@@ -92,6 +117,7 @@ void gfx_init_texture_rgb(struct texture *t, int w, int h, SDL_Color color);
 void gfx_init_texture_with_pixels(struct texture *t, int w, int h, void *pixels);
 void gfx_init_texture_amap(struct texture *t, int w, int h, uint8_t *amap, SDL_Color color);
 void gfx_init_texture_rmap(struct texture *t, int w, int h, uint8_t *rmap);
+void gfx_update_texture_rmap(struct texture *t, int x, int y, int w, int h, uint8_t *rmap);
 void gfx_copy_main_surface(struct texture *dst);
 void gfx_delete_texture(struct texture *t);
 GLuint gfx_set_framebuffer(GLenum target, Texture *t, int x, int y, int w, int h);
@@ -99,9 +125,17 @@ void gfx_reset_framebuffer(GLenum target, GLuint fbo);
 SDL_Color gfx_get_pixel(Texture *t, int x, int y);
 void *gfx_get_pixels(Texture *t);
 int gfx_save_texture(Texture *t, const char *path, enum cg_type);
+void gfx_texture_modified(Texture *t);
+
+// alpha shadows
+void gfx_alpha_shadow_set_cg(struct alpha_shadow *s, Texture *t, struct cg *cg);
+void gfx_alpha_shadow_set_uniform(struct alpha_shadow *s, Texture *t, int alpha);
+int gfx_alpha_shadow_get(struct alpha_shadow *s, Texture *t, int x, int y);
+void gfx_alpha_shadow_free(struct alpha_shadow *s);
 
 // drawing
 void gfx_draw_init(void);
+void gfx_draw_flush(void);
 void gfx_copy(struct texture *dst, int dx, int dy, struct texture *src, int sx, int sy, int w, int h);
 void gfx_copy_bright(struct texture *dst, int dx, int dy, struct texture *src, int sx, int sy, int w, int h, int rate);
 void gfx_copy_amap(struct texture *dst, int dx, int dy, struct texture *src, int sx, int sy, int w, int h);
@@ -161,7 +195,8 @@ void gfx_copy_amap_height_blur(Texture *dst, int dx, int dy, Texture *src, int s
 void gfx_copy_with_alpha_map(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h);
 void gfx_fill_with_alpha(Texture *dst, int x, int y, int w, int h, int r, int g, int b, int a);
 void gfx_copy_stretch_with_alpha_map(Texture *dst, int dx, int dy, int dw, int dh, Texture *src, int sx, int sy, int sw, int sh);
-void gfx_draw_glyph(Texture *dst, float dx, int dy, Texture *glyph, SDL_Color color, float scale_x, float bold_width);
+void gfx_draw_glyph_background(Texture *dst, int x, int y, int w, int h, SDL_Color color);
+void gfx_draw_glyph(Texture *dst, float dx, int dy, Texture *glyph, Rectangle glyph_pos, SDL_Color color, float scale_x, float bold_width);
 void gfx_draw_glyph_to_pmap(Texture *dst, float dx, int dy, Texture *glyph, Rectangle glyph_pos, SDL_Color color, float scale_x);
 void gfx_draw_glyph_to_amap(Texture *dst, float dx, int dy, Texture *glyph, Rectangle glyph_pos, float scale_x);
 
@@ -0,0 +1,102 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_JSON_STREAM_H
+#define SYSTEM4_JSON_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Streaming JSON writer and pull parser.
+ *
+ * The writer produces exactly the same bytes as cJSON_Print() would for the
+ * equivalent tree, without building the tree. The reader returns one token
+ * at a time from a FILE, so neither needs more than O(depth) memory beyond
+ * the output buffer / the current string.
+ */
+
+struct json_writer {
+	char *buf;
+	size_t len;
+	size_t cap;
+	// one entry per open container: JSON_LEVEL_* flags
+	uint8_t *levels;
+	int depth;
+	int levels_cap;
+};
+
+void json_writer_init(struct json_writer *w);
+// Returns the rendered JSON (NUL-terminated); the caller must free it.
+char *json_writer_finish(struct json_writer *w, size_t *len);
+
+void json_begin_object(struct json_writer *w);
+void json_end_object(struct json_writer *w);
+void json_begin_array(struct json_writer *w);
+void json_end_array(struct json_writer *w);
+void json_write_key(struct json_writer *w, const char *key);
+void json_write_string(struct json_writer *w, const char *s);
+void json_write_int(struct json_writer *w, int32_t i);
+void json_write_number(struct json_writer *w, double d);
+void json_write_null(struct json_writer *w);
+
+enum json_token {
+	JSON_ERROR,
+	JSON_END,
+	JSON_OBJECT_BEGIN,
+	JSON_OBJECT_END,
+	JSON_ARRAY_BEGIN,
+	JSON_ARRAY_END,
+	JSON_KEY,
+	JSON_STRING,
+	JSON_NUMBER,
+	JSON_TRUE,
+	JSON_FALSE,
+	JSON_NULL,
+};
+
+struct json_reader {
+	FILE *f;
+	uint8_t buf[4096];
+	size_t pos;
+	size_t len;
+	int state;
+	// one entry per open container: true for objects, false for arrays
+	bool *containers;
+	int depth;
+	int containers_cap;
+	// value of the last JSON_KEY/JSON_STRING token
+	char *str;
+	size_t str_len;
+	size_t str_cap;
+	// value of the last JSON_NUMBER token
+	double number;
+	const char *error;
+};
+
+void json_reader_init(struct json_reader *r, FILE *f);
+void json_reader_fini(struct json_reader *r);
+// Restart from the beginning of the file.
+void json_reader_rewind(struct json_reader *r);
+enum json_token json_read(struct json_reader *r);
+// Skip the rest of the value that began with TOKEN.
+bool json_skip(struct json_reader *r, enum json_token token);
+// The last JSON_NUMBER token as an int, clamped like cJSON's valueint.
+int json_reader_int(struct json_reader *r);
+
+#endif /* SYSTEM4_JSON_STREAM_H */
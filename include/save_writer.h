@@ -0,0 +1,62 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_SAVE_WRITER_H
+#define SYSTEM4_SAVE_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "cJSON.h"
+
+/*
+ * Background writer for save files.
+ *
+ * The caller snapshots the data to be saved on the VM thread (a cJSON tree
+ * or a serialized buffer) and hands it off; rendering and I/O happen on a
+ * worker thread. Files are written in the order they were queued.
+ *
+ * Whole-file writes go to a temporary file which is synced and then renamed
+ * over the target, so a crash never leaves a partially written save behind.
+ * Appends are synced before the next write begins.
+ *
+ * Anything that reads, copies or deletes save files must call
+ * save_writer_flush() first. Since a queued write can fail after the save
+ * call has returned, this is where the failure is reported.
+ */
+
+/*
+ * Queue JSON to be written to FULL_PATH. Takes ownership of JSON. Returns
+ * false if the write failed (only known immediately when there is no worker
+ * thread).
+ */
+bool save_writer_write_json(const char *full_path, cJSON *json);
+
+/*
+ * Queue SIZE bytes of DATA to be written (or appended) to FULL_PATH. Takes
+ * ownership of DATA, which must have been allocated with malloc. Returns
+ * false if the write failed (only known immediately when there is no worker
+ * thread), or if appending to a file whose last write failed.
+ */
+bool save_writer_write(const char *full_path, void *data, size_t size, bool append);
+
+/*
+ * Wait until all queued writes have completed. Returns false if the most
+ * recent write to FULL_PATH failed, i.e. the file doesn't hold what was last
+ * saved to it.
+ */
+bool save_writer_flush(const char *full_path);
+
+#endif /* SYSTEM4_SAVE_WRITER_H */
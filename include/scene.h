@@ -18,12 +18,23 @@
 #define SYSTEM4_SCENE_H
 
 #include <stdbool.h>
-#include "queue.h"
+#include <stdint.h>
+#include "gfx/types.h"
 
 struct texture;
 
+#define SCENE_MAX_LEVEL 16
+
 struct sprite {
-	TAILQ_ENTRY(sprite) entry;
+	// The sprite's node in the scene's skiplist (managed by scene.c).
+	// The key is copied here so that the sprite can be found again even if
+	// z/z2 are changed without re-registering it.
+	struct {
+		int z, z2;
+		uint64_t seq;
+		int level;
+		struct sprite *next[SCENE_MAX_LEVEL];
+	} scene_node;
 	// The Z-layer of the sprite within the scene
 	int z;
 	// The secondary Z-layer (for GoatGUIEngine)
@@ -37,13 +48,26 @@ struct sprite {
 	// the current scene. A sprite should be in the scene if there is pixel
 	// or text data attached to it and it is not hidden.
 	bool in_scene;
+	// Set when the sprite has changed since the scene was last rendered.
+	bool damaged;
+	// Set when the sprite was drawn the last time the scene was rendered.
+	bool drawn;
+	// The screen area covered by the sprite when it was last drawn.
+	Rectangle drawn_rect;
 	// The rendering function.
 	void (*render)(struct sprite*);
+	// (optional) Get the screen area covered by the sprite. Sprites without
+	// this function are assumed to cover the whole screen.
+	void (*get_bounds)(struct sprite*, Rectangle*);
+	// (optional) Returns true if the sprite's contents changed since it
+	// was last drawn, whether or not it was marked damaged.
+	bool (*contents_changed)(struct sprite*);
 	// Debug printing function
 	void (*debug_print)(struct sprite*);
 };
 
 extern bool scene_is_dirty;
+extern bool scene_damage_all;
 
 void scene_register_sprite(struct sprite *sp);
 void scene_unregister_sprite(struct sprite *sp);
@@ -61,6 +85,7 @@ static inline void scene_sprite_dirty(struct sprite *sp)
 	if (!sp)
 		return;
 	scene_is_dirty = true;
+	sp->damaged = true;
 	if (sp->hidden) {
 		scene_unregister_sprite(sp);
 	} else if (sp->has_pixel) {
@@ -68,9 +93,11 @@ static inline void scene_sprite_dirty(struct sprite *sp)
 	}
 }
 
+// Mark the whole scene for redrawing.
 static inline void scene_dirty(void)
 {
 	scene_is_dirty = true;
+	scene_damage_all = true;
 }
 
 static inline void scene_set_sprite_show(struct sprite *sp, bool show)
@@ -33,6 +33,11 @@ struct sact_sprite {
 	LIST_ENTRY(sact_sprite) entry;
 	// The sprite's texture (CG or solid color). Initialized lazily.
 	struct texture texture;
+	// CPU copy of the texture's alpha channel, for hit testing.
+	struct alpha_shadow amap;
+	// Texture versions at the time the sprite was last drawn.
+	unsigned drawn_version;
+	unsigned drawn_text_version;
 	// If no CG is attached to the sprite, the solid color to fill with.
 	SDL_Color color;
 	// The position and dimensions of the sprite.
@@ -105,6 +105,7 @@ union vm_value vm_copy(union vm_value v, enum ain_data_type type);
 
 int vm_execute_ain(struct ain *program);
 void vm_call(int fno, int struct_page);
+int vm_call_compare(int fno, union vm_value a, union vm_value b);
 int vm_time(void);
 
 void hll_call(int libno, int fno);
@@ -130,13 +131,24 @@ struct function_call {
 	int32_t fno;
 	uint32_t call_address;
 	uint32_t return_address;
+	// heap slot of the local page (-1 if not allocated yet)
 	int32_t page_slot;
 	int32_t struct_page;
+	// the local page
+	struct page *page;
+	// offset of the local page in the frame arena
+	uint32_t arena_ptr;
 };
 
+// Value of function_call.arena_ptr for local pages allocated on the heap
+#define FRAME_NOT_IN_ARENA UINT32_MAX
+
 extern struct function_call call_stack[4096];
 extern int32_t call_stack_ptr;
 
+int32_t call_frame_page_slot(struct function_call *call);
+void call_frames_detach(void);
+
 extern size_t instr_ptr;
 
 // Read argument N for the current instruction.
@@ -156,6 +168,11 @@ static inline float get_argument_float(int n)
 uint32_t get_switch_address(int no, int val);
 uint32_t get_strswitch_address(int no, struct string *str);
 
+void vm_execute_instruction(void);
+
+// Must be called after modifying the instruction at ADDR in ain->code.
+void vm_code_patched(uint32_t addr);
+
 int vm_save_image(const char *key, const char *path);
 void vm_load_image(const char *key, const char *path);
 struct page *vm_load_image_comments(const char *key, const char *path, int *success);
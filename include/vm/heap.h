@@ -30,10 +30,14 @@ enum vm_pointer_type {
 };
 #define NR_VM_POINTER_TYPES (VM_STRING+1)
 
-// Heap-backed objects. Reference counted.
+/*
+ * Heap-backed objects. Reference counted.
+ *
+ * The reference count and type of slot N are stored separately, in
+ * heap_refs[N] and heap_types[N]. Heap storage never moves, so pointers
+ * into the heap remain valid when new slots are allocated.
+ */
 struct vm_pointer {
-	int ref;
-	enum vm_pointer_type type;
 	union {
 		struct string *s;
 		struct page *page;
@@ -49,6 +53,8 @@ struct vm_pointer {
 };
 
 extern struct vm_pointer *heap;
+extern int32_t *heap_refs;
+extern uint8_t *heap_types; // enum vm_pointer_type
 extern size_t heap_size;
 
 void heap_init(void);
@@ -75,19 +81,13 @@ int32_t heap_alloc_string(struct string *s);
 
 void heap_describe_slot(int slot);
 
-/*
- * Guarantee `headroom` free slots are available on the heap.
- *
- * XXX: this is a hack to fix an issue with HLL calls where a pointer into the
- *      heap can be made invalid by a heap reallocation triggered within the
- *      body of the HLL function.
- */
-void heap_guarantee(unsigned headroom);
-
 #ifdef VM_PRIVATE
 
-extern int32_t *heap_free_stack;
-extern size_t heap_free_ptr;
+/*
+ * Rebuild the free lists from heap_refs. Used after slots have been
+ * allocated directly (e.g. when loading a resume image).
+ */
+void heap_rebuild_free_lists(void);
 
 #endif /* VM_PRIVATE */
 #endif /* SYSTEM4_HEAP_H */
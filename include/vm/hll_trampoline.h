@@ -0,0 +1,37 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_VM_HLL_TRAMPOLINE_H
+#define SYSTEM4_VM_HLL_TRAMPOLINE_H
+
+union vm_value;
+
+/*
+ * Call the HLL function FUN with arguments ARGS, storing the return value
+ * (if any) in R. Trampolines are generated at build time for each supported
+ * signature (see src/gen_hll_trampolines.py).
+ */
+typedef void (*hll_trampoline)(void *fun, union vm_value *args, union vm_value *r);
+
+struct hll_trampoline_entry {
+	const char *signature;
+	hll_trampoline fun;
+};
+
+extern const struct hll_trampoline_entry hll_trampolines[];
+extern const unsigned hll_nr_trampolines;
+
+#endif /* SYSTEM4_VM_HLL_TRAMPOLINE_H */
@@ -0,0 +1,82 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_VM_INTERN_H
+#define SYSTEM4_VM_INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ain;
+struct string;
+
+/*
+ * Open-addressed hash table mapping strings to integer values. The table
+ * does not own the keys; they must outlive it.
+ */
+struct intern_table {
+	uint32_t mask; // table size - 1
+	uint32_t nr_entries;
+	struct intern_entry {
+		const char *text; // NULL if the slot is empty
+		uint32_t len;
+		uint32_t hash;
+		int32_t value;
+	} *entries;
+};
+
+// FNV-1a
+uint32_t intern_hash(const char *text, size_t len);
+
+void intern_table_init(struct intern_table *t, uint32_t nr_expected);
+void intern_table_fini(struct intern_table *t);
+
+/*
+ * Insert TEXT into the table with the given value. If TEXT is already
+ * present the existing value is kept and returned; otherwise VALUE is
+ * returned.
+ */
+int32_t intern_table_insert(struct intern_table *t, const char *text, size_t len, int32_t value);
+
+/*
+ * Find the entry for TEXT, whose hash is HASH, adding it with the value -1
+ * if it is not present. The pointer is only valid until the next insertion.
+ */
+struct intern_entry *intern_table_put(struct intern_table *t, const char *text, size_t len, uint32_t hash);
+
+/*
+ * Look up TEXT in the table. Returns -1 if it is not present.
+ */
+int32_t intern_table_lookup(struct intern_table *t, const char *text, size_t len);
+
+/*
+ * Intern the names and constant strings of an ain file. Must be called
+ * before any of the functions below.
+ */
+void intern_ain(struct ain *ain);
+void intern_fini(void);
+
+// Look up a function by name. Returns -1 if there is no such function.
+int intern_get_function(const char *name);
+
+/*
+ * Get the hash of a string. The hash is cached for the ain file's constant
+ * strings and messages, so the common case of hashing a string literal
+ * doesn't touch the string's text.
+ */
+uint32_t intern_string_hash(const struct string *s);
+
+#endif /* SYSTEM4_VM_INTERN_H */
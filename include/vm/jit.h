@@ -0,0 +1,55 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_VM_JIT_H
+#define SYSTEM4_VM_JIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The JIT emits x86-64 code for the System V calling convention
+#if defined(__x86_64__) && !defined(_WIN32)
+#define VM_JIT
+#endif
+
+// Number of calls after which a function is compiled to native code
+#define JIT_HOT_THRESHOLD 100
+
+extern bool jit_enabled;
+
+void jit_init(void);
+
+/*
+ * Notify the JIT that function FNO was called. Hot functions are compiled
+ * here.
+ */
+void jit_function_called(int fno);
+
+/*
+ * Execute native code starting at instr_ptr, if the instruction at instr_ptr
+ * belongs to a compiled function. Returns false if there is no native code
+ * for that address (in which case the instruction should be interpreted).
+ * On return, instr_ptr points at the next instruction to execute.
+ */
+bool jit_execute(void);
+
+/*
+ * Discard native code for the function containing ADDR (e.g. because the
+ * debugger patched the bytecode there).
+ */
+void jit_invalidate(uint32_t addr);
+
+#endif /* SYSTEM4_VM_JIT_H */
@@ -72,6 +72,8 @@ struct page {
 		int rank;
 	} array;
 	int nr_vars;
+	// number of values allocated (>= nr_vars)
+	int capacity;
 	union vm_value values[];
 };
 
@@ -104,6 +106,7 @@ void variable_set(struct page *page, int varno, enum ain_data_type type, union v
 // pages
 struct page *alloc_page(enum page_type type, int type_index, int nr_vars);
 void free_page(struct page *page);
+struct page *page_reserve(struct page *page, int nr_vars);
 struct page *copy_page(struct page *page);
 void delete_page_vars(struct page *page);
 void delete_page(int slot);
@@ -125,7 +128,7 @@ struct page *array_pushback(struct page *dst, union vm_value v, enum ain_data_ty
 struct page *array_popback(struct page *dst);
 struct page *array_erase(struct page *page, int i, bool *success);
 struct page *array_insert(struct page *page, int i, union vm_value v, enum ain_data_type data_type, int struct_type);
-void array_sort(struct page *page, int compare_fno);
+void array_sort(int slot, int compare_fno);
 void array_sort_mem(struct page *page, int member_no);
 int array_find(struct page *page, int start, int end, union vm_value v, int compare_fno);
 void array_reverse(struct page *page);
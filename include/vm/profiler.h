@@ -0,0 +1,62 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_VM_PROFILER_H
+#define SYSTEM4_VM_PROFILER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "system4/instructions.h"
+
+/*
+ * Instrumenting profiler for script code.
+ *
+ * When enabled (--profile), every function call, HLL call and executed
+ * instruction is recorded. The profile is written on exit (or by the
+ * debugger's "profile" command) as PREFIX.folded (one line per call stack,
+ * weighted by exclusive time in microseconds, for flamegraph.pl) and
+ * PREFIX.json (per-function, per-opcode and per-HLL-function totals).
+ */
+
+extern bool profiler_enabled;
+extern uint64_t profiler_opcode_counts[NR_OPCODES];
+
+void profiler_init(const char *prefix);
+
+void profiler_function_enter(int fno);
+void profiler_function_leave(void);
+void profiler_hll_enter(int libno, int fno);
+void profiler_hll_leave(void);
+
+/*
+ * Close all open frames, e.g. because the call stack was discarded.
+ */
+void profiler_unwind(void);
+
+/*
+ * Write the profile collected so far. If PREFIX is NULL, the prefix given
+ * to profiler_init() is used.
+ */
+void profiler_write(const char *prefix);
+
+static inline void profiler_count_opcode(uint16_t opcode)
+{
+	// NOTE: breakpoints have bits set outside of the opcode range
+	if (opcode < NR_OPCODES)
+		profiler_opcode_counts[opcode]++;
+}
+
+#endif /* SYSTEM4_VM_PROFILER_H */
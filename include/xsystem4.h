@@ -20,6 +20,23 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+enum resume_format {
+	RESUME_FORMAT_JSON,
+	RESUME_FORMAT_BINARY,
+	// binary, appending only changed heap slots when saving to the same file
+	RESUME_FORMAT_INCREMENTAL,
+};
+
+enum vsync_mode {
+	// vsync is controlled by the game (off unless it turns it on)
+	VSYNC_GAME,
+	VSYNC_OFF,
+	VSYNC_ON,
+	// vsync, but allow tearing instead of waiting a whole frame when a
+	// swap is late (where supported)
+	VSYNC_ADAPTIVE,
+};
+
 struct config {
 	char *game_name;
 	char *ain_filename;
@@ -43,6 +60,22 @@ struct config {
 	bool echo;
 	float text_x_scale;
 	bool manual_text_x_scale;
+	bool threaded_dispatch;
+	bool jit;
+	char *profile; // output prefix, or NULL if profiling is disabled
+	enum resume_format resume_format;
+	// directory for cached AFA name indices (relative to the save folder),
+	// or NULL if disabled
+	char *asset_index_cache;
+	// decoded CG cache size in MB, or -1 to use the game's setting
+	int cg_cache_size;
+	// number of CG prefetch threads, or -1 to choose based on the CPU count
+	int cg_prefetch_threads;
+	// maximum number of heap slots, or 0 to use the default for the host
+	int max_heap_slots;
+	// frame rate limit for screen updates, or 0 for no limit
+	int target_fps;
+	enum vsync_mode vsync;
 };
 
 extern struct config config;
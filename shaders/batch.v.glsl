@@ -0,0 +1,28 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+// Vertex shader for batched draws: each vertex carries its position in the
+// destination texture (xy) and its texture coordinate (zw).
+
+uniform mat4 view_transform;
+
+in vec4 vertex_pos;
+out vec2 tex_coord;
+
+void main() {
+        gl_Position = view_transform * vec4(vertex_pos.xy, 0.0, 1.0);
+        tex_coord = vertex_pos.zw;
+}
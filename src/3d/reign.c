@@ -1018,13 +1018,13 @@ bool RE_back_cg_set(struct RE_back_cg *bcg, int no)
 	if (!no)  // unload only.
 		return true;
 
-	struct cg *cg = asset_cg_load(no);
+	struct cg *cg = asset_cg_get(no);
 	if (!cg) {
 		WARNING("cannot load back CG: %d", no);
 		return false;
 	}
 	gfx_init_texture_with_cg(&bcg->texture, cg);
-	cg_free(cg);
+	asset_cg_release(cg);
 	return true;
 }
 
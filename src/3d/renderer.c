@@ -232,7 +232,7 @@ bool RE_renderer_load_billboard_texture(struct RE_renderer *r, int cg_no)
 	if (ht_get_int(r->billboard_textures, cg_no, NULL))
 		return true;
 
-	struct cg *cg = asset_cg_load(cg_no);
+	struct cg *cg = asset_cg_get(cg_no);
 	if (!cg)
 		return false;
 
@@ -248,7 +248,7 @@ bool RE_renderer_load_billboard_texture(struct RE_renderer *r, int cg_no)
 	glBindTexture(GL_TEXTURE_2D, 0);
 	bt->has_alpha = cg->metrics.has_alpha;
 
-	cg_free(cg);
+	asset_cg_release(cg);
 	ht_put_int(r->billboard_textures, cg_no, bt);
 	return true;
 }
@@ -672,6 +672,7 @@ static void render_shadow_map(struct RE_plugin *plugin, mat4 light_space_transfo
 	}
 
 	struct RE_renderer *r = plugin->renderer;
+	gfx_draw_flush();
 	GLint orig_fbo, orig_viewport[4];
 	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &orig_fbo);
 	glGetIntegerv(GL_VIEWPORT, orig_viewport);
@@ -818,7 +819,10 @@ void RE_render(struct sact_sprite *sp)
 	glDisable(GL_DEPTH_TEST);
 	for (int i = 0; i < RE_NR_BACK_CGS; i++)
 		render_back_cg(texture, &plugin->back_cg[i], r);
+	// the background CGs are batched; draw them before the scene
+	gfx_draw_flush();
 	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+	glViewport(0, 0, texture->w, texture->h);
 
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
@@ -915,6 +919,7 @@ struct height_detector *RE_renderer_create_height_detector(struct RE_renderer *r
 	glm_aabb_transform(aabb, view_matrix, aabb);
 	glm_ortho_aabb(aabb, proj_matrix);
 
+	gfx_draw_flush();
 	GLint orig_fbo, orig_viewport[4];
 	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &orig_fbo);
 	glGetIntegerv(GL_VIEWPORT, orig_viewport);
@@ -22,19 +22,20 @@
 #include <dirent.h>
 #include <limits.h>
 #include <assert.h>
+#include <SDL.h>
 
 #include "system4.h"
 #include "system4/ald.h"
 #include "system4/afa.h"
 #include "system4/cg.h"
 #include "system4/file.h"
-#include "system4/hashtable.h"
 #include "system4/string.h"
 #include "system4/utfsjis.h"
 
 #include "xsystem4.h"
 #include "asset_manager.h"
 #include "gfx/font.h"
+#include "vm/intern.h"
 
 enum archive_type {
 	AR_TYPE_ALD,
@@ -72,21 +73,55 @@ struct asset_manager_ald {
 	struct archive *archive;
 };
 
+/*
+ * Normalized file names of an AFA archive (upper case, without extension),
+ * NUL-separated and in file order, along with their hashes.
+ */
+struct afa_names {
+	char *text;
+	uint32_t *hashes;
+};
+
+// index values are (load order << AFA_NO_BITS) | file number
+#define AFA_NO_BITS 28
+#define AFA_NO_MASK ((1u << AFA_NO_BITS) - 1)
+
 struct asset_manager_afa {
 	struct asset_manager manager;
+	// newest archive first; IDs are assigned in this order
 	struct afa_archive *archives[MAX_ARCHIVES];
-	struct hash_table *index;
+	int nr_archives;
+	// archives[i] holds IDs bases[i]+1 through bases[i+1]
+	uint32_t bases[MAX_ARCHIVES + 1];
+	// per-archive data, in load order (oldest first)
+	char *paths[MAX_ARCHIVES];
+	struct afa_names names[MAX_ARCHIVES];
+	// name index; built on the first lookup by name, then updated
+	// incrementally as archives are loaded
+	struct intern_table index;
 };
 
 static struct asset_manager *assets[ASSET_TYPE_MAX] = {0};
 
+// Archive reads may happen on the CG prefetch threads; the archives share
+// file handles, so all reads (and archive loads) are serialized.
+static SDL_mutex *assets_mutex;
+
 bool asset_manager_load_archive(enum asset_type type, const char *archive_name)
 {
 	if (!assets[type])
 		return false;
 	if (!assets[type]->load_archive)
 		ERROR("load_archive not supported on this archive type");
-	return assets[type]->load_archive(assets[type], archive_name);
+	SDL_LockMutex(assets_mutex);
+	bool r = assets[type]->load_archive(assets[type], archive_name);
+	SDL_UnlockMutex(assets_mutex);
+	if (!r)
+		return false;
+	// CG numbers have shifted
+	if (type == ASSET_CG)
+		asset_cg_cache_flush();
+	return true;
 }
 
 bool asset_exists(enum asset_type type, int id)
@@ -109,7 +144,10 @@ struct archive_data *asset_get(enum asset_type type, int id)
 {
 	if (!assets[type])
 		return NULL;
-	return assets[type]->get_by_id(assets[type], id);
+	SDL_LockMutex(assets_mutex);
+	struct archive_data *data = assets[type]->get_by_id(assets[type], id);
+	SDL_UnlockMutex(assets_mutex);
+	return data;
 }
 
 struct archive_data *asset_get_by_name(enum asset_type type, const char *name, int *id_out)
@@ -118,7 +156,10 @@ struct archive_data *asset_get_by_name(enum asset_type type, const char *name, i
 		return NULL;
 	if (!assets[type]->get_by_name)
 		ERROR("get_by_name not supported on this archive type");
-	return assets[type]->get_by_name(assets[type], name, id_out);
+	SDL_LockMutex(assets_mutex);
+	struct archive_data *data = assets[type]->get_by_name(assets[type], name, id_out);
+	SDL_UnlockMutex(assets_mutex);
+	return data;
 }
 
 struct cg *asset_cg_load(int id)
@@ -173,10 +214,254 @@ static struct archive_data *ald_get_by_id(struct asset_manager *_manager, int id
 	return archive_get(manager->archive, id - 1);
 }
 
+static struct afa_archive *afa_by_load_order(struct asset_manager_afa *manager, int n)
+{
+	return manager->archives[manager->nr_archives - 1 - n];
+}
+
+static void afa_add_archive(struct asset_manager_afa *manager, struct afa_archive *ar, const char *path)
+{
+	if (ar->nr_files > AFA_NO_MASK)
+		ERROR("Too many files in archive: %s", display_utf0(path));
+
+	for (int i = manager->nr_archives; i > 0; i--) {
+		manager->archives[i] = manager->archives[i-1];
+	}
+	manager->archives[0] = ar;
+	manager->paths[manager->nr_archives] = xstrdup(path);
+	manager->nr_archives++;
+
+	manager->bases[0] = 0;
+	for (int i = 0; i < manager->nr_archives; i++) {
+		manager->bases[i+1] = manager->bases[i] + manager->archives[i]->nr_files;
+	}
+}
+
+/*
+ * On-disk cache of normalized names (--asset-index-cache), keyed by the
+ * archive's size and modification time.
+ */
+
+#define AFA_INDEX_MAGIC "XAIX"
+#define AFA_INDEX_VERSION 1
+
+struct afa_index_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t archive_size;
+	int64_t archive_mtime;
+	uint32_t nr_files;
+	uint32_t names_size;
+};
+
+static char *afa_index_cache_dir(void)
+{
+	return savedir_path(config.asset_index_cache);
+}
+
+static char *afa_index_cache_path(const char *archive_path)
+{
+	const char *base = strrchr(archive_path, '/');
+	base = base ? base + 1 : archive_path;
+
+	char name[PATH_MAX];
+	snprintf(name, PATH_MAX, "%s-%08x.idx", base,
+			(unsigned)intern_hash(archive_path, strlen(archive_path)));
+
+	char *dir = afa_index_cache_dir();
+	char *path = path_join(dir, name);
+	free(dir);
+	return path;
+}
+
+static bool afa_index_header_init(struct afa_index_header *h, const char *archive_path,
+		uint32_t nr_files, uint32_t names_size)
+{
+	ustat s;
+	if (stat_utf8(archive_path, &s) < 0)
+		return false;
+	memset(h, 0, sizeof(struct afa_index_header));
+	memcpy(h->magic, AFA_INDEX_MAGIC, 4);
+	h->version = AFA_INDEX_VERSION;
+	h->archive_size = s.st_size;
+	h->archive_mtime = s.st_mtime;
+	h->nr_files = nr_files;
+	h->names_size = names_size;
+	return true;
+}
+
+static bool afa_load_cached_names(const char *archive_path, struct afa_archive *ar, struct afa_names *names)
+{
+	struct afa_index_header expected, h;
+	if (!afa_index_header_init(&expected, archive_path, ar->nr_files, 0))
+		return false;
+
+	char *cache_path = afa_index_cache_path(archive_path);
+	size_t size;
+	uint8_t *data = file_read(cache_path, &size);
+	free(cache_path);
+	if (!data)
+		return false;
+	if (size < sizeof(h))
+		goto invalid;
+
+	memcpy(&h, data, sizeof(h));
+	expected.names_size = h.names_size;
+	if (memcmp(&h, &expected, sizeof(h)))
+		goto invalid;
+
+	size_t hashes_size = (size_t)h.nr_files * sizeof(uint32_t);
+	if (size != sizeof(h) + hashes_size + h.names_size)
+		goto invalid;
+
+	// names must be NUL-terminated, one per file
+	const char *text = (const char*)data + sizeof(h) + hashes_size;
+	uint32_t nr_names = 0;
+	for (uint32_t i = 0; i < h.names_size; i++) {
+		if (!text[i])
+			nr_names++;
+	}
+	if (nr_names != h.nr_files || (h.names_size && text[h.names_size-1]))
+		goto invalid;
+
+	names->hashes = xmalloc(max(hashes_size, 1));
+	memcpy(names->hashes, data + sizeof(h), hashes_size);
+	names->text = xmalloc(max(h.names_size, 1));
+	memcpy(names->text, text, h.names_size);
+	free(data);
+	return true;
+invalid:
+	free(data);
+	return false;
+}
+
+static void afa_write_cached_names(const char *archive_path, struct afa_archive *ar, struct afa_names *names)
+{
+	const char *p = names->text;
+	for (unsigned i = 0; i < ar->nr_files; i++) {
+		p += strlen(p) + 1;
+	}
+	uint32_t names_size = p - names->text;
+
+	struct afa_index_header h;
+	if (!afa_index_header_init(&h, archive_path, ar->nr_files, names_size))
+		return;
+
+	size_t hashes_size = (size_t)ar->nr_files * sizeof(uint32_t);
+	size_t size = sizeof(h) + hashes_size + names_size;
+	uint8_t *data = xmalloc(size);
+	memcpy(data, &h, sizeof(h));
+	memcpy(data + sizeof(h), names->hashes, hashes_size);
+	memcpy(data + sizeof(h) + hashes_size, names->text, names_size);
+
+	char *dir = afa_index_cache_dir();
+	char *cache_path = afa_index_cache_path(archive_path);
+	mkdir_p(dir);
+	if (!file_write(cache_path, data, size))
+		WARNING("Failed to write asset index cache: %s", display_utf0(cache_path));
+	free(cache_path);
+	free(dir);
+	free(data);
+}
+
+static void afa_normalize_names(struct afa_archive *ar, struct afa_names *names)
+{
+	size_t size = 0;
+	for (unsigned i = 0; i < ar->nr_files; i++) {
+		size += strlen(ar->files[i].name->text) + 1;
+	}
+
+	names->text = xmalloc(max(size, 1));
+	names->hashes = xmalloc(max(ar->nr_files * sizeof(uint32_t), 1));
+	char *p = names->text;
+	for (unsigned i = 0; i < ar->nr_files; i++) {
+		// normalize case and remove file extension from file name
+		strcpy(p, ar->files[i].name->text);
+		char *dot = strrchr(p, '.');
+		if (dot)
+			*dot = '\0';
+		sjis_toupper(p);
+		size_t len = strlen(p);
+		names->hashes[i] = intern_hash(p, len);
+		p += len + 1;
+	}
+}
+
+struct afa_index_job {
+	const char *path;
+	struct afa_archive *ar;
+	struct afa_names *names;
+	bool cached;
+};
+
+static int afa_index_job_run(void *data)
+{
+	struct afa_index_job *job = data;
+	job->cached = config.asset_index_cache
+		&& afa_load_cached_names(job->path, job->ar, job->names);
+	if (!job->cached)
+		afa_normalize_names(job->ar, job->names);
+	return 0;
+}
+
+static void afa_index_job_finish(struct afa_index_job *job)
+{
+	if (config.asset_index_cache && !job->cached)
+		afa_write_cached_names(job->path, job->ar, job->names);
+}
+
+// Merge the names of the Nth loaded archive into the index.
+static void afa_merge_names(struct asset_manager_afa *manager, int n)
+{
+	struct afa_archive *ar = afa_by_load_order(manager, n);
+	struct afa_names *names = &manager->names[n];
+	const char *name = names->text;
+	for (unsigned i = 0; i < ar->nr_files; i++) {
+		size_t len = strlen(name);
+		struct intern_entry *e = intern_table_put(&manager->index, name, len, names->hashes[i]);
+		// newer archives take precedence; within an archive the first
+		// file with a given name does
+		if (e->value < 0 || (e->value >> AFA_NO_BITS) != n)
+			e->value = (n << AFA_NO_BITS) | i;
+		name += len + 1;
+	}
+}
+
+static void afa_build_index(struct asset_manager_afa *manager)
+{
+	// normalize the names of each archive in parallel
+	struct afa_index_job jobs[MAX_ARCHIVES];
+	SDL_Thread *threads[MAX_ARCHIVES] = {0};
+	uint32_t nr_files = 0;
+	for (int i = 0; i < manager->nr_archives; i++) {
+		jobs[i] = (struct afa_index_job) {
+			.path = manager->paths[i],
+			.ar = afa_by_load_order(manager, i),
+			.names = &manager->names[i],
+		};
+		nr_files += jobs[i].ar->nr_files;
+		if (i > 0)
+			threads[i] = SDL_CreateThread(afa_index_job_run, "asset index", &jobs[i]);
+	}
+	afa_index_job_run(&jobs[0]);
+	for (int i = 1; i < manager->nr_archives; i++) {
+		if (threads[i])
+			SDL_WaitThread(threads[i], NULL);
+		else
+			afa_index_job_run(&jobs[i]);
+	}
+
+	intern_table_init(&manager->index, nr_files);
+	for (int i = 0; i < manager->nr_archives; i++) {
+		afa_index_job_finish(&jobs[i]);
+		afa_merge_names(manager, i);
+	}
+}
+
 static bool afa_load_archive(struct asset_manager *_manager, const char *name)
 {
 	struct asset_manager_afa *manager = (struct asset_manager_afa*)_manager;
-	if (manager->archives[MAX_ARCHIVES-1])
+	if (manager->nr_archives == MAX_ARCHIVES)
 		ERROR("Archive limit exceeded");
 
 	char path[PATH_MAX];
@@ -193,15 +478,19 @@ static bool afa_load_archive(struct asset_manager *_manager, const char *name)
 		}
 	}
 
-	for (int i = MAX_ARCHIVES - 1; i > 0; i--) {
-		manager->archives[i] = manager->archives[i-1];
-	}
-	manager->archives[0] = ar;
-
-	// index needs to be rebuilt
-	if (manager->index) {
-		ht_free(manager->index);
-		manager->index = NULL;
+	afa_add_archive(manager, ar, path);
+
+	// add the new names to the index, if it has been built
+	if (manager->index.entries) {
+		int n = manager->nr_archives - 1;
+		struct afa_index_job job = {
+			.path = manager->paths[n],
+			.ar = ar,
+			.names = &manager->names[n],
+		};
+		afa_index_job_run(&job);
+		afa_index_job_finish(&job);
+		afa_merge_names(manager, n);
 	}
 	return true;
 }
@@ -210,15 +499,21 @@ static bool _afa_get_by_id(struct asset_manager *_manager, int id, struct afa_ar
 {
 	struct asset_manager_afa *manager = (struct asset_manager_afa*)_manager;
 	uint32_t no = id - 1;
-	for (int i = 0; i < MAX_ARCHIVES && manager->archives[i]; i++) {
-		if (no < manager->archives[i]->nr_files) {
-			*ar_out = manager->archives[i];
-			*no_out = no;
-			return true;
-		}
-		no -= manager->archives[i]->nr_files;
+	if (id < 1 || no >= manager->bases[manager->nr_archives])
+		return false;
+
+	// find the last archive starting at or before NO
+	int lo = 0, hi = manager->nr_archives - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (manager->bases[mid] <= no)
+			lo = mid;
+		else
+			hi = mid - 1;
 	}
-	return false;
+	*ar_out = manager->archives[lo];
+	*no_out = no - manager->bases[lo];
+	return true;
 }
 
 static bool afa_exists_by_id(struct asset_manager *manager, int id)
@@ -242,34 +537,13 @@ static struct archive_data *afa_get_by_id(struct asset_manager *manager, int id)
 	return data;
 }
 
-static void afa_index_archive(struct hash_table *index, struct afa_archive *ar, unsigned base)
-{
-	for (unsigned i = 0; i < ar->nr_files; i++) {
-		// normalize case and remove file extension from file name
-		char *name = strdup(ar->files[i].name->text);
-		char *dot = strrchr(name, '.');
-		if (dot)
-			*dot = '\0';
-		sjis_toupper(name);
-		// add file to index
-		ht_put(index, name, (void*)((uintptr_t)base + i + 1));
-		free(name);
-	}
-}
-
 static bool _afa_get_by_name(struct asset_manager *_manager, const char *_name,
 		struct afa_archive **ar_out, int *no_out, int *id_out)
 {
 	struct asset_manager_afa *manager = (struct asset_manager_afa*)_manager;
 	// initialize index lazily
-	if (!manager->index) {
-		manager->index = ht_create(4096);
-		unsigned base = 0;
-		for (unsigned i = 0; i < MAX_ARCHIVES && manager->archives[i]; i++) {
-			afa_index_archive(manager->index, manager->archives[i], base);
-			base += manager->archives[i]->nr_files;
-		}
-	}
+	if (!manager->index.entries)
+		afa_build_index(manager);
 
 	// normalize name and get id from index
 	char *name = strdup(_name);
@@ -277,15 +551,20 @@ static bool _afa_get_by_name(struct asset_manager *_manager, const char *_name,
 	char *dot = strrchr(name, '.');
 	if (dot)
 		*dot = '\0';
-	uintptr_t id = (uintptr_t)ht_get(manager->index, name, NULL);
+	int32_t value = intern_table_lookup(&manager->index, name, strlen(name));
 	free(name);
 
-	if (!id)
+	if (value < 0)
 		return false;
 
+	int n = value >> AFA_NO_BITS;
+	int pos = manager->nr_archives - 1 - n;
+	int id = manager->bases[pos] + (value & AFA_NO_MASK) + 1;
 	if (id_out)
 		*id_out = id;
-	return _afa_get_by_id(_manager, id, ar_out, no_out);
+	*ar_out = manager->archives[pos];
+	*no_out = value & AFA_NO_MASK;
+	return true;
 }
 
 static bool afa_exists_by_name(struct asset_manager *manager, const char *name, int *id_out)
@@ -356,7 +635,7 @@ static void afa_init(enum asset_type type, char *file)
 		manager->manager.exists_by_name = afa_exists_by_name;
 		manager->manager.get_by_id = afa_get_by_id;
 		manager->manager.get_by_name = afa_get_by_name;
-		manager->archives[0] = ar;
+		afa_add_archive(manager, ar, file);
 		assets[type] = &manager->manager;
 	}
 
@@ -381,6 +660,9 @@ void asset_manager_init(void)
 	UDIR *dir;
 	char *d_name;
 
+	if (!(assets_mutex = SDL_CreateMutex()))
+		ERROR("SDL_CreateMutex failed: %s", SDL_GetError());
+
 	if (!(dir = opendir_utf8(config.game_dir))) {
 		ERROR("Failed to open directory: %s", display_utf0(config.game_dir));
 	}
@@ -0,0 +1,497 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <SDL.h>
+
+#include "system4.h"
+#include "system4/archive.h"
+#include "system4/cg.h"
+
+#include "asset_manager.h"
+#include "xsystem4.h"
+
+/*
+ * LRU cache of decoded CGs, keyed by CG number.
+ *
+ * Entries that are in use (between asset_cg_get() and asset_cg_release())
+ * are never evicted. CGs that don't fit in the budget at all are returned
+ * uncached and freed on release.
+ *
+ * CGs can also be prefetched: a pool of worker threads decodes queued CG
+ * numbers in the background, and the results are moved into the cache the
+ * next time the VM thread touches it. Only archive reads are serialized
+ * (see asset_get); decoding runs in parallel.
+ */
+
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+#define NR_BUCKETS 1024
+#define MAX_PREFETCH_THREADS 8
+// number of CGs to prefetch when sequential loads are detected
+#define PREFETCH_AHEAD 4
+
+struct cg_cache_entry {
+	int no;
+	int refs;
+	size_t size;
+	struct cg *cg;
+	// LRU list, most recently used first
+	struct cg_cache_entry *prev;
+	struct cg_cache_entry *next;
+	// hash bucket chain
+	struct cg_cache_entry *chain;
+};
+
+static struct cg_cache_entry *buckets[NR_BUCKETS];
+static struct cg_cache_entry *lru_head;
+static struct cg_cache_entry *lru_tail;
+static size_t cache_capacity = DEFAULT_CACHE_SIZE;
+static struct asset_cg_cache_stats stats;
+
+enum prefetch_state {
+	PREFETCH_QUEUED,
+	PREFETCH_RUNNING,
+	PREFETCH_DONE,
+};
+
+struct prefetch_job {
+	struct prefetch_job *next;
+	int no;
+	enum prefetch_state state;
+	// the cache was flushed while the job was running
+	bool stale;
+	struct cg *cg;
+};
+
+// all jobs that haven't been collected yet, in queue order
+static struct prefetch_job *jobs;
+static struct prefetch_job **jobs_tail = &jobs;
+static SDL_mutex *prefetch_mutex;
+static SDL_cond *prefetch_cond;
+static SDL_cond *prefetch_done_cond;
+static SDL_Thread *prefetch_threads[MAX_PREFETCH_THREADS];
+static int nr_prefetch_threads;
+static bool prefetch_initialized;
+static bool prefetch_quit;
+
+static struct cg_cache_entry **bucket(int no)
+{
+	return &buckets[(uint32_t)no % NR_BUCKETS];
+}
+
+static void lru_unlink(struct cg_cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		lru_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct cg_cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = lru_head;
+	if (lru_head)
+		lru_head->prev = e;
+	else
+		lru_tail = e;
+	lru_head = e;
+}
+
+// Remove E from the cache without freeing its CG.
+static void entry_remove(struct cg_cache_entry *e)
+{
+	struct cg_cache_entry **p = bucket(e->no);
+	while (*p != e)
+		p = &(*p)->chain;
+	*p = e->chain;
+	lru_unlink(e);
+	stats.size -= e->size;
+	stats.nr_entries--;
+	free(e);
+}
+
+static void entry_free(struct cg_cache_entry *e)
+{
+	struct cg *cg = e->cg;
+	entry_remove(e);
+	cg_free(cg);
+}
+
+// Evict unused entries until NEEDED more bytes fit in the budget.
+static void evict(size_t needed)
+{
+	struct cg_cache_entry *e = lru_tail;
+	while (e && stats.size + needed > cache_capacity) {
+		struct cg_cache_entry *prev = e->prev;
+		if (!e->refs) {
+			entry_free(e);
+			stats.evictions++;
+		}
+		e = prev;
+	}
+}
+
+static size_t cg_size(struct cg *cg)
+{
+	return (size_t)cg->metrics.w * cg->metrics.h * 4;
+}
+
+static struct cg_cache_entry *cache_lookup(int no)
+{
+	for (struct cg_cache_entry *e = *bucket(no); e; e = e->chain) {
+		if (e->no == no)
+			return e;
+	}
+	return NULL;
+}
+
+// Add CG to the cache. Returns false if it doesn't fit in the budget.
+static bool cache_insert(int no, struct cg *cg, int refs)
+{
+	size_t size = cg_size(cg);
+	if (size > cache_capacity)
+		return false;
+	evict(size);
+
+	struct cg_cache_entry *e = xcalloc(1, sizeof(struct cg_cache_entry));
+	e->no = no;
+	e->refs = refs;
+	e->size = size;
+	e->cg = cg;
+	e->chain = *bucket(no);
+	*bucket(no) = e;
+	lru_push_front(e);
+	stats.size += size;
+	stats.nr_entries++;
+	return true;
+}
+
+static void job_unlink(struct prefetch_job **p)
+{
+	struct prefetch_job *job = *p;
+	*p = job->next;
+	if (jobs_tail == &job->next)
+		jobs_tail = p;
+}
+
+static struct prefetch_job **job_find(int no)
+{
+	for (struct prefetch_job **p = &jobs; *p; p = &(*p)->next) {
+		if ((*p)->no == no && !(*p)->stale)
+			return p;
+	}
+	return NULL;
+}
+
+static struct prefetch_job *next_queued_job(void)
+{
+	for (struct prefetch_job *job = jobs; job; job = job->next) {
+		if (job->state == PREFETCH_QUEUED)
+			return job;
+	}
+	return NULL;
+}
+
+static int prefetch_thread_main(void *_)
+{
+	SDL_LockMutex(prefetch_mutex);
+	while (true) {
+		struct prefetch_job *job = NULL;
+		while (!prefetch_quit && !(job = next_queued_job()))
+			SDL_CondWait(prefetch_cond, prefetch_mutex);
+		if (!job)
+			break;
+		job->state = PREFETCH_RUNNING;
+		SDL_UnlockMutex(prefetch_mutex);
+
+		struct cg *cg = NULL;
+		struct archive_data *data = asset_get(ASSET_CG, job->no);
+		if (data) {
+			cg = cg_load_data(data);
+			archive_free_data(data);
+		}
+
+		SDL_LockMutex(prefetch_mutex);
+		if (job->stale) {
+			struct prefetch_job **p = &jobs;
+			while (*p != job)
+				p = &(*p)->next;
+			job_unlink(p);
+			free(job);
+			if (cg)
+				cg_free(cg);
+		} else {
+			job->cg = cg;
+			job->state = PREFETCH_DONE;
+		}
+		SDL_CondBroadcast(prefetch_done_cond);
+	}
+	SDL_UnlockMutex(prefetch_mutex);
+	return 0;
+}
+
+static void prefetch_fini(void)
+{
+	SDL_LockMutex(prefetch_mutex);
+	prefetch_quit = true;
+	SDL_CondBroadcast(prefetch_cond);
+	SDL_UnlockMutex(prefetch_mutex);
+	for (int i = 0; i < nr_prefetch_threads; i++) {
+		SDL_WaitThread(prefetch_threads[i], NULL);
+	}
+	nr_prefetch_threads = 0;
+}
+
+// Start the worker threads on first use. Returns false if prefetching is disabled.
+static bool prefetch_init(void)
+{
+	if (prefetch_initialized)
+		return nr_prefetch_threads > 0;
+	prefetch_initialized = true;
+
+	int n = config.cg_prefetch_threads;
+	if (n < 0)
+		n = max(1, SDL_GetCPUCount() - 1);
+	n = min(n, MAX_PREFETCH_THREADS);
+	if (!n)
+		return false;
+
+	if (!(prefetch_mutex = SDL_CreateMutex())
+			|| !(prefetch_cond = SDL_CreateCond())
+			|| !(prefetch_done_cond = SDL_CreateCond())) {
+		WARNING("Failed to initialize CG prefetch: %s", SDL_GetError());
+		return false;
+	}
+	for (int i = 0; i < n; i++) {
+		SDL_Thread *t = SDL_CreateThread(prefetch_thread_main, "cg prefetch", NULL);
+		if (!t) {
+			WARNING("Failed to start CG prefetch thread: %s", SDL_GetError());
+			break;
+		}
+		prefetch_threads[nr_prefetch_threads++] = t;
+	}
+	if (nr_prefetch_threads)
+		atexit(prefetch_fini);
+	return nr_prefetch_threads > 0;
+}
+
+// Move finished prefetch jobs into the cache.
+static void prefetch_collect(void)
+{
+	if (!nr_prefetch_threads)
+		return;
+
+	struct prefetch_job *done = NULL;
+	SDL_LockMutex(prefetch_mutex);
+	struct prefetch_job **p = &jobs;
+	while (*p) {
+		struct prefetch_job *job = *p;
+		if (job->state != PREFETCH_DONE) {
+			p = &job->next;
+			continue;
+		}
+		job_unlink(p);
+		job->next = done;
+		done = job;
+	}
+	SDL_UnlockMutex(prefetch_mutex);
+
+	while (done) {
+		struct prefetch_job *job = done;
+		done = job->next;
+		if (job->cg) {
+			stats.prefetched++;
+			if (cache_lookup(job->no) || !cache_insert(job->no, job->cg, 0))
+				cg_free(job->cg);
+		}
+		free(job);
+	}
+}
+
+/*
+ * Take the result of the prefetch job for NO, waiting for it to finish if
+ * it's running. Returns false if there is no such job (or it hadn't been
+ * started yet, in which case it's cancelled).
+ */
+static bool prefetch_take(int no, struct cg **cg_out)
+{
+	if (!nr_prefetch_threads)
+		return false;
+
+	SDL_LockMutex(prefetch_mutex);
+	struct prefetch_job **p = job_find(no);
+	if (!p) {
+		SDL_UnlockMutex(prefetch_mutex);
+		return false;
+	}
+	// decoding on this thread is no slower than waiting for a worker
+	if ((*p)->state == PREFETCH_QUEUED) {
+		struct prefetch_job *job = *p;
+		job_unlink(p);
+		SDL_UnlockMutex(prefetch_mutex);
+		free(job);
+		return false;
+	}
+	struct prefetch_job *job = *p;
+	while (job->state == PREFETCH_RUNNING)
+		SDL_CondWait(prefetch_done_cond, prefetch_mutex);
+	// the job list may have changed while waiting
+	p = &jobs;
+	while (*p != job)
+		p = &(*p)->next;
+	job_unlink(p);
+	SDL_UnlockMutex(prefetch_mutex);
+
+	*cg_out = job->cg;
+	if (job->cg)
+		stats.prefetched++;
+	free(job);
+	return true;
+}
+
+void asset_cg_prefetch(int no)
+{
+	if (!cache_capacity || !prefetch_init())
+		return;
+	if (cache_lookup(no) || !asset_exists(ASSET_CG, no))
+		return;
+
+	SDL_LockMutex(prefetch_mutex);
+	if (!job_find(no)) {
+		struct prefetch_job *job = xcalloc(1, sizeof(struct prefetch_job));
+		job->no = no;
+		job->state = PREFETCH_QUEUED;
+		*jobs_tail = job;
+		jobs_tail = &job->next;
+		SDL_CondSignal(prefetch_cond);
+	}
+	SDL_UnlockMutex(prefetch_mutex);
+}
+
+struct cg *asset_cg_get(int no)
+{
+	static int last_no = -1;
+
+	prefetch_collect();
+
+	// CGs are often loaded in sequence (e.g. animation frames); if so,
+	// start decoding the next few in the background
+	if (no == last_no + 1) {
+		for (int i = 1; i <= PREFETCH_AHEAD; i++) {
+			asset_cg_prefetch(no + i);
+		}
+	}
+	last_no = no;
+
+	struct cg_cache_entry *e = cache_lookup(no);
+	if (e) {
+		stats.hits++;
+		e->refs++;
+		lru_unlink(e);
+		lru_push_front(e);
+		return e->cg;
+	}
+
+	struct cg *cg;
+	if (prefetch_take(no, &cg)) {
+		stats.hits++;
+	} else {
+		stats.misses++;
+		cg = asset_cg_load(no);
+	}
+	if (!cg)
+		return NULL;
+	cache_insert(no, cg, 1);
+	return cg;
+}
+
+void asset_cg_release(struct cg *cg)
+{
+	if (!cg)
+		return;
+	// the CG being released is almost always the most recently used one
+	for (struct cg_cache_entry *e = lru_head; e; e = e->next) {
+		if (e->cg == cg) {
+			e->refs--;
+			// the budget may have shrunk while the entry was in use
+			if (!e->refs && stats.size > cache_capacity)
+				evict(0);
+			return;
+		}
+	}
+	cg_free(cg);
+}
+
+void asset_cg_cache_init(int game_cache_size)
+{
+	// NOTE: the game's cache size is taken to be in megabytes
+	if (config.cg_cache_size >= 0)
+		asset_cg_cache_set_size((size_t)config.cg_cache_size * 1024 * 1024);
+	else if (game_cache_size > 0)
+		asset_cg_cache_set_size((size_t)game_cache_size * 1024 * 1024);
+}
+
+void asset_cg_cache_set_size(size_t bytes)
+{
+	cache_capacity = bytes;
+	evict(0);
+}
+
+void asset_cg_cache_flush(void)
+{
+	if (nr_prefetch_threads) {
+		SDL_LockMutex(prefetch_mutex);
+		struct prefetch_job **p = &jobs;
+		while (*p) {
+			struct prefetch_job *job = *p;
+			// running jobs are freed by the worker when they finish
+			if (job->state == PREFETCH_RUNNING) {
+				job->stale = true;
+				p = &job->next;
+				continue;
+			}
+			job_unlink(p);
+			if (job->cg)
+				cg_free(job->cg);
+			free(job);
+		}
+		SDL_UnlockMutex(prefetch_mutex);
+	}
+
+	struct cg_cache_entry *e = lru_head;
+	while (e) {
+		struct cg_cache_entry *next = e->next;
+		// CGs still in use are freed by asset_cg_release()
+		if (e->refs)
+			entry_remove(e);
+		else
+			entry_free(e);
+		e = next;
+	}
+}
+
+void asset_cg_cache_get_stats(struct asset_cg_cache_stats *out)
+{
+	*out = stats;
+	out->capacity = cache_capacity;
+}
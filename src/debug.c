@@ -118,6 +118,7 @@ static void delete_breakpoint(uint32_t addr, struct breakpoint *bp)
 {
 	// restore opcode
 	LittleEndian_putW(ain->code, addr, bp->restore_op);
+	vm_code_patched(addr);
 
 	// remove from hash table
 	struct ht_slot *slot = ht_put_int(bp_table, addr, NULL);
@@ -155,6 +156,7 @@ bool dbg_set_function_breakpoint(const char *_name, void(*cb)(struct breakpoint*
 	snprintf(bp->message, 511, "Hit breakpoint at function '%s' (0x%08x)",
 			display_utf0(_name), f->address);
 	LittleEndian_putW(ain->code, f->address, BREAKPOINT | bp->restore_op);
+	vm_code_patched(f->address);
 	add_breakpoint(f->address, bp);
 
 	printf("Set breakpoint at function '%s' (0x%08x)\n", display_utf0(_name), f->address);
@@ -183,6 +185,7 @@ bool dbg_set_address_breakpoint(uint32_t address, void(*cb)(struct breakpoint*),
 	bp->message = xmalloc(512);
 	snprintf(bp->message, 511, "Hit breakpoint at 0x%08x", address);
 	LittleEndian_putW(ain->code, address, BREAKPOINT | bp->restore_op);
+	vm_code_patched(address);
 	add_breakpoint(address, bp);
 
 	printf("Set breakpoint at 0x%08x\n", address);
@@ -213,6 +216,7 @@ static void dbg_set_step_breakpoint(int32_t address, int call_index)
 	bp->data = (void*)(intptr_t)call_index;
 	bp->message = NULL;
 	LittleEndian_putW(ain->code, address, BREAKPOINT | bp->restore_op);
+	vm_code_patched(address);
 	add_breakpoint(address, bp);
 }
 
@@ -32,7 +32,10 @@
 #include "vm.h"
 #include "vm/heap.h"
 #include "vm/page.h"
+#include "vm/profiler.h"
 
+#include "asset_manager.h"
+#include "frame_pacer.h"
 #include "scene.h"
 #include "debugger.h"
 #include "little_endian.h"
@@ -99,7 +102,7 @@ static void dbg_cmd_locals(unsigned nr_args, char **args)
 		return;
 	}
 
-	struct page *page = heap_get_page(call_stack[call_stack_ptr - (frame_no+1)].page_slot);
+	struct page *page = get_local_page(frame_no);
 	struct ain_function *f = &ain->functions[page->index];
 	for (int i = 0; i < f->nr_vars; i++) {
 		struct string *value = dbg_value_to_string(&f->vars[i].type, page->values[i], 1);
@@ -171,6 +174,43 @@ static void dbg_cmd_print(unsigned nr_args, char **args)
 	free_string(str);
 }
 
+static void dbg_cmd_profile(unsigned nr_args, char **args)
+{
+	if (!profiler_enabled) {
+		DBG_ERROR("Profiler is not enabled (run with --profile)");
+		return;
+	}
+	profiler_write(nr_args > 0 ? args[0] : NULL);
+}
+
+static void dbg_cmd_cg_cache(unsigned nr_args, char **args)
+{
+	struct asset_cg_cache_stats stats;
+	asset_cg_cache_get_stats(&stats);
+	unsigned long lookups = stats.hits + stats.misses;
+	printf("entries:   %zu\n", stats.nr_entries);
+	printf("size:      %zu / %zu KB\n", stats.size / 1024, stats.capacity / 1024);
+	printf("hits:      %lu (%.1f%%)\n", stats.hits, lookups ? stats.hits * 100.0 / lookups : 0.0);
+	printf("misses:    %lu\n", stats.misses);
+	printf("evictions: %lu\n", stats.evictions);
+	printf("prefetch:  %lu\n", stats.prefetched);
+}
+
+static void dbg_cmd_frame_stats(unsigned nr_args, char **args)
+{
+	struct frame_pacer_stats stats;
+	frame_pacer_get_stats(&stats);
+	printf("presented: %lu\n", stats.presented);
+	printf("coalesced: %lu\n", stats.coalesced);
+	if (!stats.nr_samples)
+		return;
+	printf("frame time (last %u frames):\n", stats.nr_samples);
+	printf("  min: %.2f ms\n", stats.min);
+	printf("  avg: %.2f ms (%.1f fps)\n", stats.avg, stats.avg > 0 ? 1000.0 / stats.avg : 0.0);
+	printf("  p99: %.2f ms\n", stats.p99);
+	printf("  max: %.2f ms\n", stats.max);
+}
+
 static void dbg_cmd_quit(unsigned nr_args, char **args)
 {
 	dbg_quit();
@@ -226,15 +266,18 @@ static void dbg_cmd_vm_state(unsigned nr_args, char **args)
 static struct dbg_cmd dbg_default_commands[] = {
 	{ "backtrace", "bt", NULL, "Display stack trace", 0, 0, dbg_cmd_backtrace },
 	{ "breakpoint", "bp", "<function-or-address>", "Set breakpoint at a function or address", 1, 1, dbg_cmd_breakpoint },
+	{ "cg-cache", NULL, NULL, "Display decoded CG cache statistics", 0, 0, dbg_cmd_cg_cache },
 	{ "continue", "c", NULL, "Resume execution", 0, 0, dbg_cmd_continue },
 	{ "finish", "fin", NULL, "Execute until the current function returns", 0, 0, dbg_cmd_finish },
 	{ "frame", "f", "<frame-number>", "Set the current frame", 1, 1, dbg_cmd_frame },
+	{ "frame-stats", NULL, NULL, "Display frame pacing statistics", 0, 0, dbg_cmd_frame_stats },
 	{ "help", "h", "[command-name]", "Get help about a command", 0, 2, dbg_cmd_help },
 	{ "locals", "l", "[frame-number]", "Print local variables", 0, 1, dbg_cmd_locals },
 	{ "log", NULL, "<function-name>", "Log function calls", 1, 1, dbg_cmd_log },
 	{ "members", "m", "[frame-number]", "Print struct members", 0, 1, dbg_cmd_members },
 	{ "next", "n", NULL, "Step to the next instruction within the current function", 0, 0, dbg_cmd_next },
 	{ "print", "p", "<variable-name> [recursion-depth]", "Print a variable", 1, 2, dbg_cmd_print },
+	{ "profile", NULL, "[output-prefix]", "Write the profile collected so far", 0, 1, dbg_cmd_profile },
 	{ "quit", "q", NULL, "Quit xsystem4", 0, 0, dbg_cmd_quit },
 	{ "scene", NULL, NULL, "Display scene graph", 0, 0, dbg_cmd_scene },
 	{ "step", "s", NULL, "Step to the next instruction", 0, 0, dbg_cmd_step },
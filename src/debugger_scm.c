@@ -180,9 +180,7 @@ static void set_address_breakpoint(uint32_t address, sexp handler)
 
 static struct page *frame_page(int i)
 {
-	if (i < 0 || i >= call_stack_ptr)
-		return NULL;
-	return get_page(call_stack[call_stack_ptr - (i+1)].page_slot);
+	return get_local_page(i);
 }
 
 // XXX: chibi-ffi doesn't support anonymous structs
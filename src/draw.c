@@ -15,6 +15,7 @@
  */
 
 #include <math.h>
+#include <string.h>
 #include <SDL.h>
 #include "gfx/gl.h"
 #include <cglm/cglm.h>
@@ -35,6 +36,13 @@ struct copy_shader {
 	GLint color;
 	GLint threshold;
 	GLint threshold2;
+	// program for batched draws, or 0 if the shader can't be batched
+	struct {
+		Shader s;
+		GLint color;
+		GLint threshold;
+		GLint threshold2;
+	} batch;
 };
 
 struct copy_data {
@@ -77,6 +85,62 @@ static struct copy_shader amap_saturate_shader;
 static struct copy_shader blend_rmap_color_shader;
 static struct copy_shader dilate_shader;
 
+static GLuint batch_vao;
+static GLuint batch_vbo;
+
+/*
+ * Blend state for the next draw. Operations record their blend mode here
+ * rather than setting it directly, so that it can be compared and applied
+ * when (possibly batched) draws are actually issued. GL's blend state is
+ * always left at the default in between draws.
+ */
+struct blend_state {
+	GLenum eq_rgb, eq_alpha;
+	GLenum src_rgb, dst_rgb, src_alpha, dst_alpha;
+	GLfloat color[4];
+};
+
+#define DEFAULT_BLEND_STATE {					\
+	.eq_rgb = GL_FUNC_ADD, .eq_alpha = GL_FUNC_ADD,		\
+	.src_rgb = GL_SRC_ALPHA, .dst_rgb = GL_ONE_MINUS_SRC_ALPHA,	\
+	.src_alpha = GL_ONE, .dst_alpha = GL_ZERO,		\
+	.color = { 0, 0, 0, 0 }					\
+}
+
+static const struct blend_state default_blend = DEFAULT_BLEND_STATE;
+static struct blend_state blend = DEFAULT_BLEND_STATE;
+
+static void blend_func(GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha)
+{
+	blend.src_rgb = src_rgb;
+	blend.dst_rgb = dst_rgb;
+	blend.src_alpha = src_alpha;
+	blend.dst_alpha = dst_alpha;
+}
+
+static void blend_equation(GLenum rgb, GLenum alpha)
+{
+	blend.eq_rgb = rgb;
+	blend.eq_alpha = alpha;
+}
+
+static void blend_color(GLfloat r, GLfloat g, GLfloat b, GLfloat a)
+{
+	blend.color[0] = r;
+	blend.color[1] = g;
+	blend.color[2] = b;
+	blend.color[3] = a;
+}
+
+static void apply_blend_state(const struct blend_state *b)
+{
+	glBlendEquationSeparate(b->eq_rgb, b->eq_alpha);
+	glBlendFuncSeparate(b->src_rgb, b->dst_rgb, b->src_alpha, b->dst_alpha);
+	glBlendColor(b->color[0], b->color[1], b->color[2], b->color[3]);
+}
+
+static void prepare_batch_shader(struct gfx_render_job *job, void *data);
+
 static void prepare_copy_shader(struct gfx_render_job *job, void *data)
 {
 	struct copy_shader *s = (struct copy_shader*)job->shader;
@@ -98,6 +162,15 @@ static void load_copy_shader(struct copy_shader *s, const char *v_path, const ch
 	s->threshold = glGetUniformLocation(s->s.program, "threshold");
 	s->threshold2 = glGetUniformLocation(s->s.program, "threshold2");
 	s->s.prepare = prepare_copy_shader;
+
+	// shaders which clip to the source rectangle need the full quad
+	if (s->bot_left >= 0 || s->top_right >= 0)
+		return;
+	gfx_load_shader(&s->batch.s, "shaders/batch.v.glsl", f_path);
+	s->batch.color = glGetUniformLocation(s->batch.s.program, "color");
+	s->batch.threshold = glGetUniformLocation(s->batch.s.program, "threshold");
+	s->batch.threshold2 = glGetUniformLocation(s->batch.s.program, "threshold2");
+	s->batch.s.prepare = prepare_batch_shader;
 }
 
 // load shaders
@@ -155,11 +228,149 @@ void gfx_draw_init(void)
 
 	// shader that dilates every pixel (for bold/outline text rendering)
 	load_copy_shader(&dilate_shader, "shaders/render.v.glsl", "shaders/dilate.f.glsl");
+
+	glGenVertexArrays(1, &batch_vao);
+	glGenBuffers(1, &batch_vbo);
+}
+
+/*
+ * Draw batching.
+ *
+ * Copy/fill operations are recorded as quads instead of being drawn
+ * immediately. Consecutive operations with the same destination, source,
+ * shader, uniforms and blend state are drawn together with a single draw
+ * call. The batch is flushed when an operation doesn't match it, when an
+ * operation samples its own destination, and (via gfx_draw_flush) before
+ * anything else renders, reads back or deletes a texture.
+ */
+#define MAX_BATCH_QUADS 512
+// two triangles of (x, y, u, v) vertices per quad
+#define BATCH_QUAD_FLOATS (6 * 4)
+
+static struct {
+	struct copy_shader *shader;
+	GLuint dst;
+	int dst_w, dst_h;
+	GLuint src;
+	struct blend_state blend;
+	float r, g, b, a;
+	float threshold, threshold2;
+	int nr_quads;
+	GLfloat vertices[MAX_BATCH_QUADS * BATCH_QUAD_FLOATS];
+} batch;
+
+static void prepare_batch_shader(struct gfx_render_job *job, void *data)
+{
+	struct copy_shader *s = batch.shader;
+	glUniform4f(s->batch.color, batch.r, batch.g, batch.b, batch.a);
+	glUniform1f(s->batch.threshold, batch.threshold);
+	glUniform1f(s->batch.threshold2, batch.threshold2);
+}
+
+void gfx_draw_flush(void)
+{
+	int nr_quads = batch.nr_quads;
+	if (!nr_quads)
+		return;
+	// gfx_set_framebuffer and gfx_prepare_job call back into this function
+	batch.nr_quads = 0;
+
+	Texture dst = { .handle = batch.dst, .w = batch.dst_w, .h = batch.dst_h };
+	GLuint fbo = gfx_set_framebuffer(GL_DRAW_FRAMEBUFFER, &dst, 0, 0, dst.w, dst.h);
+	apply_blend_state(&batch.blend);
+
+	mat4 identity = GLM_MAT4_IDENTITY_INIT;
+	mat4 wv_transform = WV_TRANSFORM(dst.w, dst.h);
+	struct gfx_render_job job = {
+		.shader = &batch.shader->batch.s,
+		.texture = batch.src,
+		.world_transform = identity[0],
+		.view_transform = wv_transform[0],
+		.data = NULL
+	};
+	gfx_prepare_job(&job);
+
+	glBindVertexArray(batch_vao);
+	glBindBuffer(GL_ARRAY_BUFFER, batch_vbo);
+	glBufferData(GL_ARRAY_BUFFER, nr_quads * BATCH_QUAD_FLOATS * sizeof(GLfloat),
+			batch.vertices, GL_STREAM_DRAW);
+	glEnableVertexAttribArray(job.shader->vertex);
+	glVertexAttribPointer(job.shader->vertex, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), NULL);
+	glDrawArrays(GL_TRIANGLES, 0, nr_quads * 6);
+	glDisableVertexAttribArray(job.shader->vertex);
+	glBindVertexArray(0);
+	glUseProgram(0);
+
+	apply_blend_state(&default_blend);
+	gfx_reset_framebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+}
+
+static bool batch_matches(struct copy_shader *s, Texture *dst, GLuint src, struct copy_data *data)
+{
+	return batch.nr_quads
+		&& batch.shader == s
+		&& batch.dst == dst->handle
+		&& batch.src == src
+		&& !memcmp(&batch.blend, &blend, sizeof(struct blend_state))
+		&& batch.r == data->r && batch.g == data->g
+		&& batch.b == data->b && batch.a == data->a
+		&& batch.threshold == data->threshold
+		&& batch.threshold2 == data->threshold2;
+}
+
+/*
+ * Record a copy as a quad. The quad (x0,y0)-(x1,y1) with texture coordinates
+ * (0,0)-(1,1) is given in viewport coordinates, exactly as it would be drawn
+ * by _run_copy_shader; it's clipped to the viewport here, which is what
+ * glViewport would otherwise do.
+ */
+static void batch_quad(struct copy_shader *s, Texture *dst, GLuint src, struct copy_data *data,
+		GLfloat x0, GLfloat y0, GLfloat x1, GLfloat y1)
+{
+	GLfloat cx0 = max(x0, 0), cy0 = max(y0, 0);
+	GLfloat cx1 = min(x1, data->vpw), cy1 = min(y1, data->vph);
+	if (cx0 >= cx1 || cy0 >= cy1)
+		return;
+	// the draw is deferred, but the contents are stale as of now
+	gfx_texture_modified(dst);
+	GLfloat u0 = (cx0 - x0) / (x1 - x0), v0 = (cy0 - y0) / (y1 - y0);
+	GLfloat u1 = (cx1 - x0) / (x1 - x0), v1 = (cy1 - y0) / (y1 - y0);
+	cx0 += data->vpx; cx1 += data->vpx;
+	cy0 += data->vpy; cy1 += data->vpy;
+
+	if (!batch_matches(s, dst, src, data) || batch.nr_quads == MAX_BATCH_QUADS) {
+		gfx_draw_flush();
+		batch.shader = s;
+		batch.dst = dst->handle;
+		batch.dst_w = dst->w;
+		batch.dst_h = dst->h;
+		batch.src = src;
+		batch.blend = blend;
+		batch.r = data->r;
+		batch.g = data->g;
+		batch.b = data->b;
+		batch.a = data->a;
+		batch.threshold = data->threshold;
+		batch.threshold2 = data->threshold2;
+	}
+
+	GLfloat *v = batch.vertices + batch.nr_quads++ * BATCH_QUAD_FLOATS;
+	const GLfloat quad[BATCH_QUAD_FLOATS] = {
+		cx0, cy0, u0, v0,
+		cx1, cy0, u1, v0,
+		cx1, cy1, u1, v1,
+		cx0, cy0, u0, v0,
+		cx1, cy1, u1, v1,
+		cx0, cy1, u0, v1,
+	};
+	memcpy(v, quad, sizeof(quad));
 }
 
 static void run_draw_shader(Shader *s, Texture *dst, Texture *src, mat4 mw_transform, mat4 wv_transform, struct copy_data *data)
 {
+	gfx_draw_flush();
 	GLuint fbo = gfx_set_framebuffer(GL_DRAW_FRAMEBUFFER, dst, data->vpx, data->vpy, data->vpw, data->vph);
+	apply_blend_state(&blend);
 
 	struct gfx_render_job job = {
 		.shader = s,
@@ -170,6 +381,7 @@ static void run_draw_shader(Shader *s, Texture *dst, Texture *src, mat4 mw_trans
 	};
 	gfx_render(&job);
 
+	apply_blend_state(&default_blend);
 	gfx_reset_framebuffer(GL_DRAW_FRAMEBUFFER, fbo);
 }
 
@@ -178,8 +390,19 @@ static void _run_copy_shader(Shader *s, Texture *dst, Texture *src, GLfloat src_
 	GLfloat scale_x = (GLfloat)data->w / data->sw;
 	GLfloat scale_y = (GLfloat)data->h / data->sh;
 
+	// operations that sample their destination can't be deferred
+	struct copy_shader *cs = (struct copy_shader*)s;
+	if (cs->batch.s.program && src != dst) {
+		// NOTE: same transform as mw_transform below
+		GLfloat x0 = -data->sx * scale_x;
+		GLfloat y0 = -data->sy * scale_y;
+		batch_quad(cs, dst, src ? src->handle : 0, data,
+				x0, y0, x0 + src_w * scale_x, y0 + src_h * scale_y);
+		return;
+	}
+
 	mat4 mw_transform = MAT4(
-	     src_w * scale_x, 0,               0, -data->sx * scale_y,
+	     src_w * scale_x, 0,               0, -data->sx * scale_x,
 	     0,               src_h * scale_y, 0, -data->sy * scale_y,
 	     0,               0,               1, 0,
 	     0,               0,               0, 1);
@@ -203,14 +426,12 @@ static void run_fill_shader(Shader *s, Texture *dst, struct copy_data *data)
 
 static void restore_blend_mode(void)
 {
-	glBlendEquationSeparate(GL_FUNC_ADD, GL_FUNC_ADD);
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO);
-	glBlendColor(0, 0, 0 ,0);
+	blend = default_blend;
 }
 
 void gfx_copy(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -220,7 +441,7 @@ void gfx_copy(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w,
 
 void gfx_copy_amap(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -231,8 +452,8 @@ void gfx_copy_amap(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, i
 void gfx_copy_bright(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int rate)
 {
 	GLfloat f_rate = rate / 255.0;
-	glBlendFuncSeparate(GL_CONSTANT_COLOR, GL_ZERO, GL_ZERO, GL_ONE);
-	glBlendColor(f_rate, f_rate, f_rate, f_rate);
+	blend_func(GL_CONSTANT_COLOR, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_color(f_rate, f_rate, f_rate, f_rate);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -242,7 +463,7 @@ void gfx_copy_bright(Texture *dst, int dx, int dy, Texture *src, int sx, int sy,
 
 void gfx_copy_sprite(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, SDL_Color color)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	data.r = color.r / 255.0;
@@ -255,7 +476,7 @@ void gfx_copy_sprite(Texture *dst, int dx, int dy, Texture *src, int sx, int sy,
 
 void gfx_sprite_copy_amap(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int alpha_key)
 {
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	data.a = alpha_key / 255.0;
@@ -266,7 +487,7 @@ void gfx_sprite_copy_amap(Texture *dst, int dx, int dy, Texture *src, int sx, in
 
 void gfx_copy_color_reverse(struct texture *dst, int dx, int dy, struct texture *src, int sx, int sy, int w, int h)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_color_reverse_shader.s, dst, src, &data);
@@ -276,7 +497,7 @@ void gfx_copy_color_reverse(struct texture *dst, int dx, int dy, struct texture
 
 void gfx_copy_use_amap_under(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int threshold)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	data.threshold = threshold / 255.0;
@@ -287,7 +508,7 @@ void gfx_copy_use_amap_under(Texture *dst, int dx, int dy, Texture *src, int sx,
 
 void gfx_copy_use_amap_border(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int threshold)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	data.threshold = threshold / 255.0;
@@ -298,8 +519,8 @@ void gfx_copy_use_amap_border(Texture *dst, int dx, int dy, Texture *src, int sx
 
 void gfx_copy_amap_max(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendEquationSeparate(GL_FUNC_ADD, GL_MAX);
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_equation(GL_FUNC_ADD, GL_MAX);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -309,8 +530,8 @@ void gfx_copy_amap_max(Texture *dst, int dx, int dy, Texture *src, int sx, int s
 
 void gfx_copy_amap_min(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendEquationSeparate(GL_FUNC_ADD, GL_MIN);
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_equation(GL_FUNC_ADD, GL_MIN);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -320,8 +541,8 @@ void gfx_copy_amap_min(Texture *dst, int dx, int dy, Texture *src, int sx, int s
 
 void gfx_blend(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int a)
 {
-	glBlendFuncSeparate(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA, GL_ZERO, GL_ONE);
-	glBlendColor(0, 0, 0, a / 255.0);
+	blend_func(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA, GL_ZERO, GL_ONE);
+	blend_color(0, 0, 0, a / 255.0);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -333,8 +554,8 @@ void gfx_blend_src_bright(Texture *dst, int dx, int dy, Texture *src, int sx, in
 {
 	GLfloat f_rate = rate / 255.0;
 	f_rate *= (a / 255.0);
-	glBlendFuncSeparate(GL_CONSTANT_COLOR, GL_ONE_MINUS_CONSTANT_ALPHA, GL_ZERO, GL_ONE);
-	glBlendColor(f_rate, f_rate, f_rate, a / 255.0);
+	blend_func(GL_CONSTANT_COLOR, GL_ONE_MINUS_CONSTANT_ALPHA, GL_ZERO, GL_ONE);
+	blend_color(f_rate, f_rate, f_rate, a / 255.0);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -344,7 +565,7 @@ void gfx_blend_src_bright(Texture *dst, int dx, int dy, Texture *src, int sx, in
 
 void gfx_blend_add_satur(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendFuncSeparate(GL_DST_ALPHA, GL_ONE, GL_ZERO, GL_ONE);
+	blend_func(GL_DST_ALPHA, GL_ONE, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -354,7 +575,7 @@ void gfx_blend_add_satur(Texture *dst, int dx, int dy, Texture *src, int sx, int
 
 void gfx_blend_amap(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -364,7 +585,7 @@ void gfx_blend_amap(Texture *dst, int dx, int dy, Texture *src, int sx, int sy,
 
 void gfx_blend_amap_src_only(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE, GL_ZERO, GL_ONE);
+	blend_func(GL_SRC_ALPHA, GL_ONE, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -376,7 +597,7 @@ void gfx_blend_amap_color(Texture *dst, int dx, int dy, Texture *src, int sx, in
 {
 	// color = (r,g,b) * src_alpha + dst_color * (1 - src_alpha)
 	// alpha = dst_alpha
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	data.r = r / 255.0;
@@ -390,7 +611,7 @@ void gfx_blend_amap_color(Texture *dst, int dx, int dy, Texture *src, int sx, in
 
 void gfx_blend_amap_color_alpha(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int r, int g, int b, int a)
 {
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	data.r = r / 255.0;
@@ -404,7 +625,7 @@ void gfx_blend_amap_color_alpha(Texture *dst, int dx, int dy, Texture *src, int
 
 void gfx_blend_amap_alpha(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int a)
 {
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	data.r = 1.0;
@@ -418,7 +639,7 @@ void gfx_blend_amap_alpha(Texture *dst, int dx, int dy, Texture *src, int sx, in
 
 void gfx_blend_amap_bright(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int rate)
 {
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	data.r = rate / 255.0;
@@ -432,7 +653,7 @@ void gfx_blend_amap_bright(Texture *dst, int dx, int dy, Texture *src, int sx, i
 
 void gfx_blend_amap_alpha_src_bright(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int alpha, int rate)
 {
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	data.r = rate / 255.0;
@@ -446,7 +667,7 @@ void gfx_blend_amap_alpha_src_bright(Texture *dst, int dx, int dy, Texture *src,
 
 void gfx_blend_use_amap_color(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int r, int g, int b, int rate)
 {
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	data.r = r / 255.0;
@@ -462,7 +683,7 @@ void gfx_blend_use_amap_color(Texture *dst, int dx, int dy, Texture *src, int sx
 
 void gfx_blend_screen(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ONE_MINUS_SRC_COLOR, GL_ZERO, GL_ONE);
+	blend_func(GL_ONE, GL_ONE_MINUS_SRC_COLOR, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -472,7 +693,7 @@ void gfx_blend_screen(Texture *dst, int dx, int dy, Texture *src, int sx, int sy
 
 void gfx_blend_multiply(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendFuncSeparate(GL_DST_COLOR, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_DST_COLOR, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -482,7 +703,7 @@ void gfx_blend_multiply(Texture *dst, int dx, int dy, Texture *src, int sx, int
 
 void gfx_blend_screen_alpha(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int a)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ONE_MINUS_SRC_COLOR, GL_ZERO, GL_ONE);
+	blend_func(GL_ONE, GL_ONE_MINUS_SRC_COLOR, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	data.r = a / 255.0;
@@ -496,7 +717,7 @@ void gfx_blend_screen_alpha(Texture *dst, int dx, int dy, Texture *src, int sx,
 
 void gfx_fill(Texture *dst, int x, int y, int w, int h, int r, int g, int b)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(x, y, 0, 0, w, h);
 	data.r = r / 255.0;
@@ -510,7 +731,7 @@ void gfx_fill(Texture *dst, int x, int y, int w, int h, int r, int g, int b)
 
 void gfx_fill_alpha_color(Texture *dst, int x, int y, int w, int h, int r, int g, int b, int a)
 {
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	struct copy_data data = COPY_DATA(x, y, 0, 0, w, h);
 	data.r = r / 255.0;
@@ -524,7 +745,7 @@ void gfx_fill_alpha_color(Texture *dst, int x, int y, int w, int h, int r, int g
 
 void gfx_fill_amap(Texture *dst, int x, int y, int w, int h, int a)
 {
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(x, y, 0, 0, w, h);
 	data.a = a / 255.0;
@@ -535,7 +756,7 @@ void gfx_fill_amap(Texture *dst, int x, int y, int w, int h, int a)
 
 void gfx_fill_amap_over_border(Texture *dst, int x, int y, int w, int h, int alpha, int border)
 {
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(x, y, 0, 0, w, h);
 	data.a = alpha / 255.0;
@@ -547,7 +768,7 @@ void gfx_fill_amap_over_border(Texture *dst, int x, int y, int w, int h, int alp
 
 void gfx_fill_amap_under_border(Texture *dst, int x, int y, int w, int h, int alpha, int border)
 {
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(x, y, 0, 0, w, h);
 	data.a = alpha / 255.0;
@@ -559,7 +780,7 @@ void gfx_fill_amap_under_border(Texture *dst, int x, int y, int w, int h, int al
 
 void gfx_fill_amap_gradation_ud(Texture *dst, int x, int y, int w, int h, int up_a, int down_a)
 {
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(x, y, 0, 0, w, h);
 	data.threshold = up_a / 255.0;
@@ -571,7 +792,7 @@ void gfx_fill_amap_gradation_ud(Texture *dst, int x, int y, int w, int h, int up
 
 void gfx_fill_screen(Texture *dst, int x, int y, int w, int h, int r, int g, int b)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ONE_MINUS_SRC_COLOR, GL_ZERO, GL_ONE);
+	blend_func(GL_ONE, GL_ONE_MINUS_SRC_COLOR, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(x, y, 0, 0, w, h);
 	data.r = r / 255.0;
@@ -585,7 +806,7 @@ void gfx_fill_screen(Texture *dst, int x, int y, int w, int h, int r, int g, int
 
 void gfx_fill_multiply(Texture *dst, int x, int y, int w, int h, int r, int g, int b)
 {
-	glBlendFuncSeparate(GL_DST_COLOR, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_DST_COLOR, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(x, y, 0, 0, w, h);
 	data.r = r / 255.0;
@@ -599,7 +820,7 @@ void gfx_fill_multiply(Texture *dst, int x, int y, int w, int h, int r, int g, i
 
 void gfx_satur_dp_dpxsa(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE, GL_ZERO, GL_ONE);
+	blend_func(GL_SRC_ALPHA, GL_ONE, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&amap_saturate_shader.s, dst, src, &data);
@@ -609,7 +830,7 @@ void gfx_satur_dp_dpxsa(Texture *dst, int dx, int dy, Texture *src, int sx, int
 
 void gfx_screen_da_daxsa(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ONE);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -621,7 +842,7 @@ void gfx_add_da_daxsa(Texture *dst, int dx, int dy, Texture *src, int sx, int sy
 {
 	// color = dst_color
 	// alpha = src_alpha + dst_alpha
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ONE);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -633,7 +854,7 @@ void gfx_blend_da_daxsa(Texture *dst, int dx, int dy, Texture *src, int sx, int
 {
 	// color = dst_color
 	// alpha = src_alpha * dst_alpha
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ZERO, GL_SRC_ALPHA);
+	blend_func(GL_ZERO, GL_ONE, GL_ZERO, GL_SRC_ALPHA);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -645,8 +866,8 @@ void gfx_sub_da_daxsa(struct texture *dst, int dx, int dy, struct texture *src,
 {
 	// color = dst_color
 	// alpha = dst_alpha - src_alpha
-	glBlendEquationSeparate(GL_FUNC_ADD, GL_FUNC_REVERSE_SUBTRACT);
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ONE);
+	blend_equation(GL_FUNC_ADD, GL_FUNC_REVERSE_SUBTRACT);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -657,8 +878,8 @@ void gfx_sub_da_daxsa(struct texture *dst, int dx, int dy, struct texture *src,
 void gfx_bright_dest_only(Texture *dst, int x, int y, int w, int h, int rate)
 {
 	GLfloat f_rate = rate / 255.0;
-	glBlendFuncSeparate(GL_ZERO, GL_CONSTANT_COLOR, GL_ZERO, GL_ONE);
-	glBlendColor(f_rate, f_rate, f_rate, 1.0);
+	blend_func(GL_ZERO, GL_CONSTANT_COLOR, GL_ZERO, GL_ONE);
+	blend_color(f_rate, f_rate, f_rate, 1.0);
 
 	struct copy_data data = COPY_DATA(x, y, 0, 0, w, h);
 	run_copy_shader(&copy_shader.s, dst, NULL, &data);
@@ -672,7 +893,7 @@ void gfx_bright_dest_only(Texture *dst, int x, int y, int w, int h, int rate)
 //        Probably no games depend on this behavior, but we'll see.
 void gfx_copy_stretch(Texture *dst, int dx, int dy, int dw, int dh, Texture *src, int sx, int sy, int sw, int sh)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = STRETCH_DATA(dx, dy, dw, dh, sx, sy, sw, sh);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -683,7 +904,7 @@ void gfx_copy_stretch(Texture *dst, int dx, int dy, int dw, int dh, Texture *src
 // FIXME: as above
 void gfx_copy_stretch_amap(Texture *dst, int dx, int dy, int dw, int dh, Texture *src, int sx, int sy, int sw, int sh)
 {
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 
 	struct copy_data data = STRETCH_DATA(dx, dy, dw, dh, sx, sy, sw, sh);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -693,8 +914,8 @@ void gfx_copy_stretch_amap(Texture *dst, int dx, int dy, int dw, int dh, Texture
 
 void gfx_copy_stretch_blend(struct texture *dst, int dx, int dy, int dw, int dh, struct texture *src, int sx, int sy, int sw, int sh, int a)
 {
-	glBlendFuncSeparate(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA, GL_ZERO, GL_ONE);
-	glBlendColor(0, 0, 0, a / 255.0);
+	blend_func(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA, GL_ZERO, GL_ONE);
+	blend_color(0, 0, 0, a / 255.0);
 
 	struct copy_data data = STRETCH_DATA(dx, dy, dw, dh, sx, sy, sw, sh);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -704,7 +925,7 @@ void gfx_copy_stretch_blend(struct texture *dst, int dx, int dy, int dw, int dh,
 
 void gfx_copy_stretch_blend_amap(struct texture *dst, int dx, int dy, int dw, int dh, struct texture *src, int sx, int sy, int sw, int sh)
 {
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	struct copy_data data = STRETCH_DATA(dx, dy, dw, dh, sx, sy, sw, sh);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -714,7 +935,7 @@ void gfx_copy_stretch_blend_amap(struct texture *dst, int dx, int dy, int dw, in
 
 void gfx_copy_stretch_blend_amap_alpha(struct texture *dst, int dx, int dy, int dw, int dh, struct texture *src, int sx, int sy, int sw, int sh, int a)
 {
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	struct copy_data data = STRETCH_DATA(dx, dy, dw, dh, sx, sy, sw, sh);
 	data.r = 1.0;
@@ -758,7 +979,7 @@ void gfx_copy_rot_zoom_amap(Texture *dst, Texture *src, int sx, int sy, int w, i
 {
 	gfx_fill_amap(dst, 0, 0, dst->w, dst->h, 0);
 
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 	copy_rot_zoom(dst, src, sx, sy, w, h, rotate, mag, &hitbox_shader.s);
 	restore_blend_mode();
 }
@@ -851,7 +1072,7 @@ void gfx_copy_reverse_LR(Texture *dst, int dx, int dy, Texture *src, int sx, int
 	     0,       0,      0, 1);
 	mat4 wv_transform = WV_TRANSFORM(w, h);
 
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_draw_shader(&copy_shader.s, dst, src, mw_transform, wv_transform, &data);
@@ -868,7 +1089,7 @@ void gfx_copy_reverse_amap_LR(Texture *dst, int dx, int dy, Texture *src, int sx
 	     0,       0,      0, 1);
 	mat4 wv_transform = WV_TRANSFORM(w, h);
 
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_draw_shader(&copy_shader.s, dst, src, mw_transform, wv_transform, &data);
@@ -879,14 +1100,14 @@ void gfx_copy_reverse_amap_LR(Texture *dst, int dx, int dy, Texture *src, int sx
 void gfx_copy_width_blur(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int blur)
 {
 	GLfloat f_rate = 1.0 / (blur * 2 + 1);
-	glBlendColor(f_rate, f_rate, f_rate, f_rate);
+	blend_color(f_rate, f_rate, f_rate, f_rate);
 
-	glBlendFuncSeparate(GL_CONSTANT_COLOR, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_CONSTANT_COLOR, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
 
-	glBlendFuncSeparate(GL_CONSTANT_COLOR, GL_ONE, GL_ZERO, GL_ONE);
+	blend_func(GL_CONSTANT_COLOR, GL_ONE, GL_ZERO, GL_ONE);
 
 	for (int i = 1; i <= blur; i++) {
 		struct copy_data data = COPY_DATA(dx, dy, sx + i, sy, w - i, h);
@@ -903,14 +1124,14 @@ void gfx_copy_width_blur(Texture *dst, int dx, int dy, Texture *src, int sx, int
 void gfx_copy_height_blur(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int blur)
 {
 	GLfloat f_rate = 1.0 / (blur * 2 + 1);
-	glBlendColor(f_rate, f_rate, f_rate, f_rate);
+	blend_color(f_rate, f_rate, f_rate, f_rate);
 
-	glBlendFuncSeparate(GL_CONSTANT_COLOR, GL_ZERO, GL_ZERO, GL_ONE);
+	blend_func(GL_CONSTANT_COLOR, GL_ZERO, GL_ZERO, GL_ONE);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
 
-	glBlendFuncSeparate(GL_CONSTANT_COLOR, GL_ONE, GL_ZERO, GL_ONE);
+	blend_func(GL_CONSTANT_COLOR, GL_ONE, GL_ZERO, GL_ONE);
 
 	for (int i = 1; i <= blur; i++) {
 		struct copy_data data = COPY_DATA(dx, dy, sx, sy + i, w, h - i);
@@ -927,14 +1148,14 @@ void gfx_copy_height_blur(Texture *dst, int dx, int dy, Texture *src, int sx, in
 void gfx_copy_amap_width_blur(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int blur)
 {
 	GLfloat f_rate = 1.0 / (blur * 2 + 1);
-	glBlendColor(f_rate, f_rate, f_rate, f_rate);
+	blend_color(f_rate, f_rate, f_rate, f_rate);
 
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_CONSTANT_COLOR, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_CONSTANT_COLOR, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
 
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_CONSTANT_COLOR, GL_ONE);
+	blend_func(GL_ZERO, GL_ONE, GL_CONSTANT_COLOR, GL_ONE);
 
 	for (int i = 1; i <= blur; i++) {
 		struct copy_data data = COPY_DATA(dx, dy, sx + i, sy, w - i, h);
@@ -951,14 +1172,14 @@ void gfx_copy_amap_width_blur(Texture *dst, int dx, int dy, Texture *src, int sx
 void gfx_copy_amap_height_blur(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h, int blur)
 {
 	GLfloat f_rate = 1.0 / (blur * 2 + 1);
-	glBlendColor(f_rate, f_rate, f_rate, f_rate);
+	blend_color(f_rate, f_rate, f_rate, f_rate);
 
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_CONSTANT_COLOR, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_CONSTANT_COLOR, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
 
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_CONSTANT_COLOR, GL_ONE);
+	blend_func(GL_ZERO, GL_ONE, GL_CONSTANT_COLOR, GL_ONE);
 
 	for (int i = 1; i <= blur; i++) {
 		struct copy_data data = COPY_DATA(dx, dy, sx, sy + i, w, h - i);
@@ -974,7 +1195,7 @@ void gfx_copy_amap_height_blur(Texture *dst, int dx, int dy, Texture *src, int s
 
 void gfx_copy_with_alpha_map(Texture *dst, int dx, int dy, Texture *src, int sx, int sy, int w, int h)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ONE, GL_ZERO);
+	blend_func(GL_ONE, GL_ZERO, GL_ONE, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(dx, dy, sx, sy, w, h);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -984,7 +1205,7 @@ void gfx_copy_with_alpha_map(Texture *dst, int dx, int dy, Texture *src, int sx,
 
 void gfx_fill_with_alpha(Texture *dst, int x, int y, int w, int h, int r, int g, int b, int a)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ONE, GL_ZERO);
+	blend_func(GL_ONE, GL_ZERO, GL_ONE, GL_ZERO);
 
 	struct copy_data data = COPY_DATA(x, y, 0, 0, w, h);
 	data.r = r / 255.0;
@@ -998,7 +1219,7 @@ void gfx_fill_with_alpha(Texture *dst, int x, int y, int w, int h, int r, int g,
 
 void gfx_copy_stretch_with_alpha_map(Texture *dst, int dx, int dy, int dw, int dh, Texture *src, int sx, int sy, int sw, int sh)
 {
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ONE, GL_ZERO);
+	blend_func(GL_ONE, GL_ZERO, GL_ONE, GL_ZERO);
 
 	struct copy_data data = STRETCH_DATA(dx, dy, dw, dh, sx, sy, sw, sh);
 	run_copy_shader(&copy_shader.s, dst, src, &data);
@@ -1007,25 +1228,32 @@ void gfx_copy_stretch_with_alpha_map(Texture *dst, int dx, int dy, int dw, int d
 }
 
 // XXX: Not an actual DrawGraph function; used for rendering text
-void gfx_draw_glyph(Texture *dst, float dx, int dy, Texture *glyph, SDL_Color color, float scale_x, float bold_width)
+//      Sets the color of fully transparent pixels under a run of glyphs so
+//      that their (blended) edges take on the glyph color.
+void gfx_draw_glyph_background(Texture *dst, int x, int y, int w, int h, SDL_Color color)
 {
-	dx = roundf(dx);
+	blend_func(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
+	struct copy_data data = COPY_DATA(x, y, x, y, w, h);
+	data.r = color.r / 255.0;
+	data.g = color.g / 255.0;
+	data.b = color.b / 255.0;
+	data.a = 0.0;
+	data.threshold = 0.001;
+	run_copy_shader(&fill_amap_under_border_shader.s, dst, dst, &data);
+	restore_blend_mode();
+}
 
-	glBlendFuncSeparate(GL_ONE, GL_ZERO, GL_ZERO, GL_ONE);
-	struct copy_data fill_data = COPY_DATA(dx, dy, dx, dy, glyph->w * scale_x, glyph->h);
-	fill_data.r = color.r / 255.0;
-	fill_data.g = color.g / 255.0;
-	fill_data.b = color.b / 255.0;
-	fill_data.a = 0.0;
-	fill_data.threshold = 0.001;
-	run_copy_shader(&fill_amap_under_border_shader.s, dst, dst, &fill_data);
+// XXX: Not an actual DrawGraph function; used for rendering text
+void gfx_draw_glyph(Texture *dst, float dx, int dy, Texture *glyph, Rectangle glyph_pos, SDL_Color color, float scale_x, float bold_width)
+{
+	dx = roundf(dx);
 
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	glBlendEquationSeparate(GL_FUNC_ADD, GL_MAX);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	blend_equation(GL_FUNC_ADD, GL_MAX);
 
 	struct copy_data data = STRETCH_DATA(
-			dx, dy, glyph->w * scale_x, glyph->h,
-			0,  0,  glyph->w,           glyph->h);
+			dx,          dy,          glyph_pos.w * scale_x, glyph_pos.h,
+			glyph_pos.x, glyph_pos.y, glyph_pos.w,           glyph_pos.h);
 	data.r = color.r / 255.0;
 	data.g = color.g / 255.0;
 	data.b = color.b / 255.0;
@@ -1050,7 +1278,7 @@ void gfx_draw_glyph_to_pmap(Texture *dst, float dx, int dy, Texture *glyph, Rect
 	data.g = color.g / 255.0;
 	data.b = color.b / 255.0;
 	data.a = 1.0;
-	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
+	blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
 	run_copy_shader(&blend_rmap_color_shader.s, dst, glyph, &data);
 	restore_blend_mode();
 }
@@ -1064,7 +1292,7 @@ void gfx_draw_glyph_to_amap(Texture *dst, float dx, int dy, Texture *glyph, Rect
 	data.g = 1.0;
 	data.b = 1.0;
 	data.a = 1.0;
-	glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
+	blend_func(GL_ZERO, GL_ONE, GL_ONE, GL_ZERO);
 	run_copy_shader(&blend_rmap_color_shader.s, dst, glyph, &data);
 	restore_blend_mode();
 }
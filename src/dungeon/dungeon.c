@@ -266,6 +266,7 @@ static void dungeon_render(struct sact_sprite *sp)
 	sprite_dirty(sp);
 	struct texture *texture = sprite_get_texture(sp);
 
+	gfx_draw_flush();
 	GLuint fbo = gfx_set_framebuffer(GL_DRAW_FRAMEBUFFER, texture, 0, 0, texture->w, texture->h);
 	glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, ctx->depth_buffer);
 	if (glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
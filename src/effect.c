@@ -18,6 +18,7 @@
 #include <math.h>
 #include <SDL.h>
 #include "effect.h"
+#include "frame_pacer.h"
 #include "gfx/gfx.h"
 #include "sact.h"
 #include "system4.h"
@@ -334,16 +335,13 @@ int sact_Effect(int type, int time, possibly_unused int key)
 	if (!sact_TRANS_Begin(type))
 		return 0;
 
-	uint32_t t = SDL_GetTicks() - start;
-	while (t < time) {
+	while (true) {
+		frame_pacer_wait(true);
+		uint32_t t = SDL_GetTicks() - start;
+		if (t >= time)
+			break;
 		sact_TRANS_Update((float)t / (float)time);
-		uint32_t t2 = SDL_GetTicks() - start;
-		if (t2 < t + 16) {
-			SDL_Delay(t + 16 - t2);
-			t += 16;
-		} else {
-			t = t2;
-		}
+		frame_pacer_end(true);
 	}
 
 	sact_TRANS_End();
@@ -23,13 +23,17 @@
 #include "system4/utfsjis.h"
 #include "vm.h"
 #include "vm/heap.h"
+#include "vm/hll_trampoline.h"
 #include "vm/page.h"
+#include "vm/profiler.h"
 #include "xsystem4.h"
 
 #define HLL_MAX_ARGS 64
 
 struct hll_function {
 	void *fun;
+	// typed trampoline, or NULL to call through libffi
+	hll_trampoline trampoline;
 	ffi_cif cif;
 	unsigned int nr_args;
 	ffi_type **args;
@@ -200,14 +204,12 @@ void hll_call(int libno, int fno)
 	if (!fun->fun)
 		VM_ERROR("Unimplemented HLL function: %s.%s", ain->libraries[libno].name, f->name);
 
-	// XXX: Try to prevent the heap from being reallocated mid-call.
-	//      This only works to the extent that HLL functions can guarantee
-	//      no more than 64 heap allocations occur within the call...
-	heap_guarantee(64);
-
+	// Argument values are collected in VALUES. The trampolines take their
+	// arguments from there directly; for libffi, ARGS points at each value.
+	union vm_value values[HLL_MAX_ARGS];
 	void *args[HLL_MAX_ARGS];
-	void *ptrs[HLL_MAX_ARGS];
 	for (int i = f->nr_arguments - 1; i >= 0; i--) {
+		args[i] = &values[i];
 		switch (f->arguments[i].type.data) {
 		case AIN_REF_INT:
 		case AIN_REF_LONG_INT:
@@ -217,44 +219,52 @@ void hll_call(int libno, int fno)
 			stack_ptr -= 2;
 			int pageno = stack[stack_ptr].i;
 			int varno  = stack[stack_ptr+1].i;
-			ptrs[i] = &heap[pageno].page->values[varno];
-			args[i] = &ptrs[i];
+			values[i].ref = &heap[pageno].page->values[varno];
 			break;
 		}
 		case AIN_STRING:
 			stack_ptr--;
-			args[i] = &heap[stack[stack_ptr].i].s;
+			values[i].ref = heap[stack[stack_ptr].i].s;
 			break;
 		case AIN_REF_STRING:
 			stack_ptr--;
-			ptrs[i] = &heap[stack[stack_ptr].i].s;
-			args[i] = &ptrs[i];
+			values[i].ref = &heap[stack[stack_ptr].i].s;
 			break;
 		case AIN_STRUCT:
 		case AIN_ARRAY_TYPE:
 			stack_ptr--;
-			args[i] = &heap[stack[stack_ptr].i].page;
+			values[i].ref = heap[stack[stack_ptr].i].page;
 			break;
 		case AIN_REF_STRUCT:
 		case AIN_REF_ARRAY_TYPE:
 			stack_ptr--;
-			ptrs[i] = &heap[stack[stack_ptr].i].page;
-			args[i] = &ptrs[i];
+			values[i].ref = &heap[stack[stack_ptr].i].page;
 			break;
-		default:
+		case AIN_LONG_INT:
+			// never called through a trampoline
 			stack_ptr--;
 			args[i] = &stack[stack_ptr];
 			break;
+		default:
+			stack_ptr--;
+			values[i] = stack[stack_ptr];
+			break;
 		}
 	}
 
 	union vm_value r;
+	if (unlikely(profiler_enabled))
+		profiler_hll_enter(libno, fno);
 #ifdef TRACE_HLL
 	trace_hll_call(&ain->libraries[libno], f, fun, &r, args);
 #else
-	ffi_call(&fun->cif, (void*)fun->fun, &r, args);
+	if (fun->trampoline)
+		fun->trampoline(fun->fun, values, &r);
+	else
+		ffi_call(&fun->cif, (void*)fun->fun, &r, args);
 #endif
-
+	if (unlikely(profiler_enabled))
+		profiler_hll_leave();
 
 	for (int i = 0, j = 0; i < f->nr_arguments; i++, j++) {
 		// XXX: We don't increase the ref count when passing ref arguments to HLL
@@ -450,6 +460,53 @@ static ffi_type *ain_to_ffi_type(enum ain_data_type type)
 	}
 }
 
+static char trampoline_type_char(enum ain_data_type type)
+{
+	switch (type) {
+	case AIN_VOID:
+		return 'v';
+	case AIN_INT:
+	case AIN_BOOL:
+		return 'i';
+	case AIN_FLOAT:
+		return 'f';
+	case AIN_LONG_INT:
+		return 0;
+	default:
+		return 'p';
+	}
+}
+
+static int trampoline_compare(const void *key, const void *elem)
+{
+	return strcmp(key, ((const struct hll_trampoline_entry*)elem)->signature);
+}
+
+/*
+ * Find the generated trampoline for the signature of an HLL function.
+ * Returns NULL if there is none, in which case libffi is used.
+ */
+static hll_trampoline get_trampoline(struct ain_hll_function *f)
+{
+	char sig[HLL_MAX_ARGS + 2];
+	if (f->nr_arguments >= HLL_MAX_ARGS)
+		return NULL;
+
+	if (!(sig[0] = trampoline_type_char(f->return_type.data)))
+		return NULL;
+	for (int i = 0; i < f->nr_arguments; i++) {
+		char c = trampoline_type_char(f->arguments[i].type.data);
+		if (!c || c == 'v')
+			return NULL;
+		sig[i+1] = c;
+	}
+	sig[f->nr_arguments+1] = '\0';
+
+	struct hll_trampoline_entry *e = bsearch(sig, hll_trampolines, hll_nr_trampolines,
+			sizeof(struct hll_trampoline_entry), trampoline_compare);
+	return e ? e->fun : NULL;
+}
+
 static void link_static_library_function(struct hll_function *dst, struct ain_hll_function *src, void *funcptr)
 {
 	dst->fun = funcptr;
@@ -463,6 +520,8 @@ static void link_static_library_function(struct hll_function *dst, struct ain_hl
 
 	if (ffi_prep_cif(&dst->cif, FFI_DEFAULT_ABI, dst->nr_args, dst->return_type, dst->args) != FFI_OK)
 		ERROR("Failed to link HLL function");
+
+	dst->trampoline = get_trampoline(src);
 }
 
 /*
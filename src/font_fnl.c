@@ -163,7 +163,7 @@ static bool fnl_font_get_glyph(struct font_size *_size, struct glyph *glyph, uin
 		pixels[(dst_row+off_y)*width + (dst_col+off_x)] = p;
 	}
 
-	gfx_init_texture_rmap(&glyph->t[weight], width, height, pixels);
+	bool ok = font_glyph_store(_size, glyph, weight, width, height, pixels);
 	glyph->rect.x = off_x;
 	glyph->rect.y = off_y;
 	glyph->rect.w = block_width;
@@ -172,7 +172,7 @@ static bool fnl_font_get_glyph(struct font_size *_size, struct glyph *glyph, uin
 
 	free(pixels);
 	free(acc);
-	return true;
+	return ok;
 }
 
 static float fnl_font_size_char(struct font_size *_size, uint32_t code)
@@ -0,0 +1,154 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "system4.h"
+
+#include "frame_pacer.h"
+#include "gfx/gfx.h"
+#include "xsystem4.h"
+
+// number of frame intervals kept for statistics
+#define NR_FRAME_SAMPLES 600
+// with vsync, wake up this long before the deadline so that the swap
+// doesn't miss the vertical blank
+#define VSYNC_SLACK_US 2000
+// SDL_Delay can oversleep by about a millisecond; yield for the remainder
+#define SPIN_US 1000
+
+static uint64_t perf_freq;
+// performance counter value at which the next frame slot begins
+static uint64_t next_deadline;
+static uint64_t last_present;
+
+static uint32_t frame_us[NR_FRAME_SAMPLES];
+static unsigned nr_samples;
+static unsigned sample_pos;
+static unsigned long nr_presented;
+static unsigned long nr_coalesced;
+
+static uint64_t us_to_ticks(uint64_t us)
+{
+	return us * perf_freq / 1000000;
+}
+
+// split into whole seconds and remainder so that large tick counts don't
+// overflow when multiplied
+static uint64_t ticks_to_us(uint64_t ticks)
+{
+	return ticks / perf_freq * 1000000 + ticks % perf_freq * 1000000 / perf_freq;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+	while (true) {
+		uint64_t t = SDL_GetPerformanceCounter();
+		if (t >= deadline)
+			return;
+		uint64_t us = ticks_to_us(deadline - t);
+		if (us > 2 * SPIN_US)
+			SDL_Delay((us - SPIN_US) / 1000);
+		else
+			SDL_Delay(0);
+	}
+}
+
+void frame_pacer_wait(bool will_present)
+{
+	if (!perf_freq)
+		perf_freq = SDL_GetPerformanceFrequency();
+	if (config.target_fps <= 0)
+		return;
+
+	uint64_t interval = perf_freq / config.target_fps;
+	uint64_t t = SDL_GetPerformanceCounter();
+	if (!will_present) {
+		// still within the current frame slot: let game logic run freely
+		if (t < next_deadline)
+			return;
+		// nothing was presented for a whole slot, i.e. the caller is
+		// idling; wait for the next slot instead of spinning
+		if (t > next_deadline + interval)
+			next_deadline = t;
+		next_deadline += interval;
+		sleep_until(next_deadline);
+		return;
+	}
+
+	// first frame, or more than a frame behind: don't try to catch up
+	if (!next_deadline || t > next_deadline + interval)
+		next_deadline = t;
+
+	uint64_t deadline = next_deadline;
+	uint64_t slack = us_to_ticks(VSYNC_SLACK_US);
+	if (will_present && gfx_get_wait_vsync() && deadline > slack)
+		deadline -= slack;
+	sleep_until(deadline);
+	next_deadline += interval;
+}
+
+void frame_pacer_end(bool presented)
+{
+	if (!presented) {
+		nr_coalesced++;
+		return;
+	}
+
+	uint64_t t = SDL_GetPerformanceCounter();
+	if (last_present) {
+		frame_us[sample_pos] = min(ticks_to_us(t - last_present), UINT32_MAX);
+		sample_pos = (sample_pos + 1) % NR_FRAME_SAMPLES;
+		if (nr_samples < NR_FRAME_SAMPLES)
+			nr_samples++;
+	}
+	last_present = t;
+	nr_presented++;
+}
+
+static int uint32_cmp(const void *_a, const void *_b)
+{
+	uint32_t a = *(const uint32_t*)_a;
+	uint32_t b = *(const uint32_t*)_b;
+	return a < b ? -1 : a > b;
+}
+
+void frame_pacer_get_stats(struct frame_pacer_stats *stats)
+{
+	memset(stats, 0, sizeof(struct frame_pacer_stats));
+	stats->presented = nr_presented;
+	stats->coalesced = nr_coalesced;
+	stats->nr_samples = nr_samples;
+	if (!nr_samples)
+		return;
+
+	uint32_t *sorted = xmalloc(nr_samples * sizeof(uint32_t));
+	memcpy(sorted, frame_us, nr_samples * sizeof(uint32_t));
+	qsort(sorted, nr_samples, sizeof(uint32_t), uint32_cmp);
+
+	uint64_t total = 0;
+	for (unsigned i = 0; i < nr_samples; i++) {
+		total += sorted[i];
+	}
+	stats->min = sorted[0] / 1000.0f;
+	stats->max = sorted[nr_samples - 1] / 1000.0f;
+	stats->avg = total / (float)nr_samples / 1000.0f;
+	stats->p99 = sorted[(nr_samples - 1) * 99 / 100] / 1000.0f;
+	free(sorted);
+}
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+#
+# Generate typed call trampolines for HLL functions.
+#
+# Each trampoline calls an HLL function with a particular C signature,
+# taking its arguments from an array of union vm_value. Signatures are
+# named by a return type character followed by one character per argument:
+#
+#     v = void (return type only)
+#     i = int32_t (int, bool)
+#     f = float
+#     p = pointer (strings, structs, arrays, references, ...)
+#
+# Trampolines are generated for every signature with up to MAX_ARGS
+# arguments. HLL functions with other signatures (e.g. 64-bit integer
+# arguments) are called through libffi.
+#
+# usage: gen_hll_trampolines.py <output.c>
+
+import itertools
+import sys
+
+MAX_ARGS = 5
+
+C_TYPE = {'v': 'void', 'i': 'int32_t', 'f': 'float', 'p': 'void*'}
+VALUE_FIELD = {'i': 'i', 'f': 'f', 'p': 'ref'}
+
+
+def signatures():
+    for nr_args in range(MAX_ARGS + 1):
+        for args in itertools.product('ifp', repeat=nr_args):
+            for ret in 'vifp':
+                yield ret + ''.join(args)
+
+
+def trampoline(sig):
+    ret, args = sig[0], sig[1:]
+    params = ', '.join(C_TYPE[a] for a in args) or 'void'
+    values = ', '.join('a[%d].%s' % (i, VALUE_FIELD[a]) for i, a in enumerate(args))
+    call = '((%s(*)(%s))f)(%s)' % (C_TYPE[ret], params, values)
+    if ret != 'v':
+        call = 'r->%s = %s' % (VALUE_FIELD[ret], call)
+    return ('static void hll_%s(void *f, union vm_value *a, union vm_value *r)\n'
+            '{\n'
+            '\t%s;\n'
+            '}\n' % (sig, call))
+
+
+def main():
+    sigs = sorted(signatures())
+    out = []
+    out.append('/* Generated by gen_hll_trampolines.py. Do not edit. */\n\n')
+    out.append('#include <stdint.h>\n')
+    out.append('#include "vm.h"\n')
+    out.append('#include "vm/hll_trampoline.h"\n\n')
+    for sig in sigs:
+        out.append(trampoline(sig))
+        out.append('\n')
+    out.append('// sorted by signature\n')
+    out.append('const struct hll_trampoline_entry hll_trampolines[] = {\n')
+    for sig in sigs:
+        out.append('\t{ "%s", hll_%s },\n' % (sig, sig))
+    out.append('};\n\n')
+    out.append('const unsigned hll_nr_trampolines = %d;\n' % len(sigs))
+
+    with open(sys.argv[1], 'w') as f:
+        f.write(''.join(out))
+
+
+if __name__ == '__main__':
+    main()
@@ -18,23 +18,63 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "system4/string.h"
 #include "vm.h"
 #include "vm/heap.h"
 #include "vm/page.h"
 #include "xsystem4.h"
 
-#define INITIAL_HEAP_SIZE  4096
-#define HEAP_ALLOC_STEP    4096
+/*
+ * Heap storage is reserved up front and committed in chunks, so that heap
+ * slots never move. This makes it safe to hold a pointer into the heap
+ * across anything that might allocate (e.g. an HLL call which receives a
+ * reference to a string variable).
+ *
+ * Reference counts and types are kept in separate dense arrays, since they
+ * are touched far more often than the object pointers.
+ *
+ * Each chunk has its own LIFO free list. Slots are allocated from the
+ * current chunk until it is full, then from another chunk with free slots
+ * (most recently freed first), and only then is a new chunk committed.
+ *
+ * The size of the reservation bounds the number of slots. On 64-bit hosts
+ * the default covers every slot number an int32_t can hold, so the heap
+ * can grow as far as it ever could. Address space is tighter on 32-bit
+ * hosts, so the default there is smaller; either can be overridden with
+ * --max-heap-slots.
+ */
+#define HEAP_CHUNK_SIZE 4096
+#define HEAP_SLOT_LIMIT ((size_t)INT32_MAX + 1)
+#define HEAP_DEFAULT_MAX_SIZE (sizeof(void*) >= 8 ? HEAP_SLOT_LIMIT : ((size_t)1 << 21))
+
+struct heap_chunk {
+	uint32_t nr_free;
+	// next chunk in the list of (non-current) chunks with free slots
+	int32_t next_partial;
+};
 
 struct vm_pointer *heap = NULL;
+int32_t *heap_refs = NULL;
+uint8_t *heap_types = NULL;
 size_t heap_size = 0;
 
-// Heap free list
-// This is a list of unused indices into the 'heap' array.
-int32_t *heap_free_stack = NULL;
-size_t heap_free_ptr = 0;
+// Per-chunk free lists: chunk N's free list is stored at
+// heap_free_slots[N * HEAP_CHUNK_SIZE], with heap_chunks[N].nr_free entries.
+static int32_t *heap_free_slots = NULL;
+static struct heap_chunk *heap_chunks = NULL;
+static uint32_t heap_nr_chunks = 0;
+static uint32_t heap_current_chunk = 0;
+static int32_t heap_partial_chunks = -1;
+// number of slots reserved (a multiple of HEAP_CHUNK_SIZE)
+static size_t heap_max_size = 0;
 
 static const char *vm_ptrtype_strtab[] = {
 	[VM_PAGE] = "VM_PAGE",
@@ -47,56 +87,139 @@ static const char *vm_ptrtype_string(enum vm_pointer_type type) {
 	return "INVALID POINTER TYPE";
 }
 
+static void *heap_reserve(size_t size)
+{
+#ifdef _WIN32
+	void *p = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+	if (!p)
+		ERROR("VirtualAlloc failed");
+#else
+	void *p = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		ERROR("mmap: %s", strerror(errno));
+#endif
+	return p;
+}
+
+// Make the range [offset, offset+size) of a reservation usable.
+static void heap_commit(void *base, size_t offset, size_t size)
+{
+#ifdef _WIN32
+	if (!VirtualAlloc((uint8_t*)base + offset, size, MEM_COMMIT, PAGE_READWRITE))
+		ERROR("VirtualAlloc failed");
+#else
+	static uintptr_t page_size = 0;
+	if (!page_size)
+		page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t)base + offset) & ~(page_size - 1);
+	uintptr_t end = ((uintptr_t)base + offset + size + page_size - 1) & ~(page_size - 1);
+	if (mprotect((void*)start, end - start, PROT_READ | PROT_WRITE))
+		ERROR("mprotect: %s", strerror(errno));
+#endif
+}
+
+static void chunk_push_partial(uint32_t c)
+{
+	heap_chunks[c].next_partial = heap_partial_chunks;
+	heap_partial_chunks = c;
+}
+
+// Fill the free list of chunk C with every slot in the chunk that is unused.
+// Slots are pushed in reverse so that they are allocated in increasing order.
+static void chunk_init_free_list(uint32_t c)
+{
+	int32_t base = c * HEAP_CHUNK_SIZE;
+	struct heap_chunk *chunk = &heap_chunks[c];
+	chunk->nr_free = 0;
+	chunk->next_partial = -1;
+	for (int32_t slot = base + HEAP_CHUNK_SIZE - 1; slot >= base; slot--) {
+		if (!heap_refs[slot] && slot != 0)
+			heap_free_slots[base + chunk->nr_free++] = slot;
+	}
+}
+
 void heap_grow(size_t new_size)
 {
 	assert(new_size > heap_size);
-	heap = xrealloc(heap, sizeof(struct vm_pointer) * new_size);
-	heap_free_stack = xrealloc(heap_free_stack, sizeof(int32_t) * new_size);
-	for (size_t i = heap_size; i < new_size; i++) {
-		heap[i].ref = 0;
-		heap_free_stack[i] = i;
+	if (new_size > heap_max_size)
+		VM_ERROR("Heap exhausted (%zu slots); try a larger --max-heap-slots", heap_max_size);
+
+	uint32_t new_nr_chunks = (new_size + HEAP_CHUNK_SIZE - 1) / HEAP_CHUNK_SIZE;
+	size_t old_size = heap_size;
+	new_size = (size_t)new_nr_chunks * HEAP_CHUNK_SIZE;
+
+	size_t n = new_size - old_size;
+	heap_commit(heap, old_size * sizeof(struct vm_pointer), n * sizeof(struct vm_pointer));
+	heap_commit(heap_refs, old_size * sizeof(int32_t), n * sizeof(int32_t));
+	heap_commit(heap_types, old_size * sizeof(uint8_t), n * sizeof(uint8_t));
+	heap_commit(heap_free_slots, old_size * sizeof(int32_t), n * sizeof(int32_t));
+	memset(heap + old_size, 0, n * sizeof(struct vm_pointer));
+	memset(heap_refs + old_size, 0, n * sizeof(int32_t));
+
+	heap_chunks = xrealloc_array(heap_chunks, heap_nr_chunks, new_nr_chunks, sizeof(struct heap_chunk));
+	for (uint32_t c = heap_nr_chunks; c < new_nr_chunks; c++) {
+		chunk_init_free_list(c);
+		if (c != heap_current_chunk)
+			chunk_push_partial(c);
 	}
+	heap_nr_chunks = new_nr_chunks;
 	heap_size = new_size;
 }
 
-void heap_guarantee(unsigned headroom)
+void heap_rebuild_free_lists(void)
 {
-	if (heap_size - heap_free_ptr >= headroom)
-		return;
-
-	size_t new_size = heap_size;
-	while (new_size - heap_free_ptr < headroom) {
-		new_size += HEAP_ALLOC_STEP;
+	heap_current_chunk = 0;
+	heap_partial_chunks = -1;
+	for (int32_t c = heap_nr_chunks - 1; c >= 0; c--) {
+		chunk_init_free_list(c);
+		if (c != 0 && heap_chunks[c].nr_free)
+			chunk_push_partial(c);
 	}
-
-	heap_grow(new_size);
 }
 
 void heap_init(void)
 {
 	if (!heap) {
-		heap_size = INITIAL_HEAP_SIZE;
-		heap = xcalloc(1, INITIAL_HEAP_SIZE * sizeof(struct vm_pointer));
-		heap_free_stack = xmalloc(INITIAL_HEAP_SIZE * sizeof(int32_t));
+		heap_max_size = HEAP_DEFAULT_MAX_SIZE;
+		if (config.max_heap_slots > 0) {
+			heap_max_size = (size_t)config.max_heap_slots + HEAP_CHUNK_SIZE - 1;
+			heap_max_size -= heap_max_size % HEAP_CHUNK_SIZE;
+			if (heap_max_size > HEAP_SLOT_LIMIT)
+				heap_max_size = HEAP_SLOT_LIMIT;
+		}
+		heap = heap_reserve(heap_max_size * sizeof(struct vm_pointer));
+		heap_refs = heap_reserve(heap_max_size * sizeof(int32_t));
+		heap_types = heap_reserve(heap_max_size * sizeof(uint8_t));
+		heap_free_slots = heap_reserve(heap_max_size * sizeof(int32_t));
+		heap_grow(HEAP_CHUNK_SIZE);
 	} else {
-		memset(heap, 0, heap_size * sizeof(struct vm_pointer*));
+		memset(heap, 0, heap_size * sizeof(struct vm_pointer));
+		memset(heap_refs, 0, heap_size * sizeof(int32_t));
 	}
+	// global page at index 0 is never on a free list
+	heap_rebuild_free_lists();
+}
 
-	for (size_t i = 0; i < heap_size; i++) {
-		heap_free_stack[i] = i;
-	}
-	heap_free_ptr = 1; // global page at index 0
+// Switch to a chunk with free slots, committing a new one if necessary.
+static struct heap_chunk *heap_next_chunk(void)
+{
+	if (heap_partial_chunks < 0)
+		heap_grow(heap_size + HEAP_CHUNK_SIZE);
+	heap_current_chunk = heap_partial_chunks;
+	heap_partial_chunks = heap_chunks[heap_current_chunk].next_partial;
+	heap_chunks[heap_current_chunk].next_partial = -1;
+	return &heap_chunks[heap_current_chunk];
 }
 
 int32_t heap_alloc_slot(enum vm_pointer_type type)
 {
-	if (heap_free_ptr >= heap_size) {
-		heap_grow(heap_size+HEAP_ALLOC_STEP);
-	}
+	struct heap_chunk *chunk = &heap_chunks[heap_current_chunk];
+	if (unlikely(!chunk->nr_free))
+		chunk = heap_next_chunk();
 
-	int32_t slot = heap_free_stack[heap_free_ptr++];
-	heap[slot].ref = 1;
-	heap[slot].type = type;
+	int32_t slot = heap_free_slots[heap_current_chunk * HEAP_CHUNK_SIZE + --chunk->nr_free];
+	heap_refs[slot] = 1;
+	heap_types[slot] = type;
 #ifdef DEBUG_HEAP
 	heap[slot].alloc_addr = instr_ptr;
 	memset(heap[slot].ref_addr, 0, sizeof(heap[slot].ref_addr));
@@ -110,17 +233,21 @@ int32_t heap_alloc_slot(enum vm_pointer_type type)
 
 static void heap_free_slot(int32_t slot)
 {
-	heap_free_stack[--heap_free_ptr] = slot;
+	uint32_t c = slot / HEAP_CHUNK_SIZE;
+	struct heap_chunk *chunk = &heap_chunks[c];
+	heap_free_slots[c * HEAP_CHUNK_SIZE + chunk->nr_free++] = slot;
+	if (chunk->nr_free == 1 && c != heap_current_chunk)
+		chunk_push_partial(c);
 }
 
 static void heap_double_free(int32_t slot)
 {
 #ifdef DEBUG_HEAP
 		WARNING("double free of slot %d (%s)\nOriginally allocated at %X\nOriginally freed at %X",
-			 slot, vm_ptrtype_string(heap[slot].type),
+			 slot, vm_ptrtype_string(heap_types[slot]),
 			 heap[slot].alloc_addr, heap[slot].free_addr);
 #else
-		WARNING("double free of slot %d (%s)", slot, vm_ptrtype_string(heap[slot].type));
+		WARNING("double free of slot %d (%s)", slot, vm_ptrtype_string(heap_types[slot]));
 #endif
 }
 
@@ -128,7 +255,7 @@ void heap_ref(int32_t slot)
 {
 	if (slot == -1)
 		return;
-	heap[slot].ref++;
+	heap_refs[slot]++;
 #ifdef DEBUG_HEAP
 	heap[slot].ref_addr[heap[slot].ref_nr++ % 16] = instr_ptr;
 #endif
@@ -136,21 +263,21 @@ void heap_ref(int32_t slot)
 
 void heap_unref(int slot)
 {
-	if (unlikely(heap[slot].ref <= 0)) {
+	if (unlikely(heap_refs[slot] <= 0)) {
 		heap_double_free(slot);
 		VM_ERROR("double free");
 	}
-	if (heap[slot].ref > 1) {
+	if (heap_refs[slot] > 1) {
 #ifdef DEBUG_HEAP
 		heap[slot].deref_addr[heap[slot].deref_nr++ % 16] = instr_ptr;
 #endif
-		heap[slot].ref--;
+		heap_refs[slot]--;
 		return;
 	}
 #ifdef DEBUG_HEAP
 	heap[slot].free_addr = instr_ptr;
 #endif
-	switch (heap[slot].type) {
+	switch (heap_types[slot]) {
 	case VM_PAGE:
 		if (heap[slot].page) {
 			delete_page(slot);
@@ -160,7 +287,7 @@ void heap_unref(int slot)
 		free_string(heap[slot].s);
 		break;
 	}
-	heap[slot].ref = 0;
+	heap_refs[slot] = 0;
 	heap_free_slot(slot);
 }
 
@@ -171,18 +298,18 @@ void exit_unref(int slot)
 		WARNING("out of bounds heap index: %d", slot);
 		return;
 	}
-	if (heap[slot].ref <= 0) {
+	if (heap_refs[slot] <= 0) {
 		heap_double_free(slot);
 		return;
 	}
-	if (heap[slot].ref > 1) {
+	if (heap_refs[slot] > 1) {
 #ifdef DEBUG_HEAP
 		heap[slot].deref_addr[heap[slot].deref_nr++ % 16] = 0xDEADC0DE;
 #endif
-		heap[slot].ref--;
+		heap_refs[slot]--;
 		return;
 	}
-	switch (heap[slot].type) {
+	switch (heap_types[slot]) {
 	case VM_PAGE:
 		if (heap[slot].page) {
 			struct page *page = heap[slot].page;
@@ -208,23 +335,23 @@ void exit_unref(int slot)
 		free_string(heap[slot].s);
 		break;
 	}
-	heap[slot].ref = 0;
+	heap_refs[slot] = 0;
 	heap_free_slot(slot);
 }
 
 bool heap_index_valid(int index)
 {
-	return index >= 0 && (size_t)index < heap_size && heap[index].ref > 0;
+	return index >= 0 && (size_t)index < heap_size && heap_refs[index] > 0;
 }
 
 bool page_index_valid(int index)
 {
-	return heap_index_valid(index) && heap[index].type == VM_PAGE;
+	return heap_index_valid(index) && heap_types[index] == VM_PAGE;
 }
 
 bool string_index_valid(int index)
 {
-	return heap_index_valid(index) && heap[index].type == VM_STRING;
+	return heap_index_valid(index) && heap_types[index] == VM_STRING;
 }
 
 struct page *heap_get_page(int index)
@@ -337,10 +464,10 @@ static void describe_page(struct page *page)
 
 void heap_describe_slot(int slot)
 {
-	if (heap[slot].type == VM_STRING && heap[slot].s == &EMPTY_STRING)
+	if (heap_types[slot] == VM_STRING && heap[slot].s == &EMPTY_STRING)
 		return;
 #ifdef DEBUG_HEAP
-	sys_message("[%d](%d)(%08X)[", slot, heap[slot].ref, heap[slot].alloc_addr);
+	sys_message("[%d](%d)(%08X)[", slot, heap_refs[slot], heap[slot].alloc_addr);
 	for (int i = 0; i < heap[slot].ref_nr && i < 16; i++) {
 		if (i > 0)
 			sys_message(",");
@@ -354,9 +481,9 @@ void heap_describe_slot(int slot)
 	}
 	sys_message("] = ");
 #else
-	sys_message("[%d](%d) = ", slot, heap[slot].ref);
+	sys_message("[%d](%d) = ", slot, heap_refs[slot]);
 #endif
-	switch (heap[slot].type) {
+	switch (heap_types[slot]) {
 	case VM_PAGE:
 		describe_page(heap[slot].page);
 		break;
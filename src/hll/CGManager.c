@@ -22,6 +22,7 @@
 
 static bool CGManager_Init(void *imain_system, int cg_cache_size)
 {
+	asset_cg_cache_init(cg_cache_size);
 	return true;
 }
 
@@ -24,6 +24,7 @@
 #include "system4/string.h"
 
 #include "hll.h"
+#include "vm/intern.h"
 #include "asset_manager.h"
 #include "xsystem4.h"
 
@@ -51,6 +52,7 @@ struct gdat_table {
 struct gdat {
 	char **labels;
 	uint32_t nr_labels;
+	struct intern_table label_table;
 	struct gdat_table *tables;
 	uint32_t nr_tables;
 	int32_t *ints;
@@ -72,6 +74,7 @@ static void gdat_free(struct gdat *dat)
 			free(dat->labels[i]);
 		free(dat->labels);
 	}
+	intern_table_fini(&dat->label_table);
 	if (dat->tables) {
 		for (uint32_t i = 0; i < dat->nr_tables; i++) {
 			for (uint32_t j = 0; j < dat->tables[i].nr_rows; j++) {
@@ -124,6 +127,10 @@ static struct gdat *gdat_read(struct buffer *r)
 		dat->labels[i] = xstrdup(buffer_strdata(r));
 		buffer_skip(r, strlen(dat->labels[i]) + 1);
 	}
+	intern_table_init(&dat->label_table, dat->nr_labels);
+	for (uint32_t i = 0; i < dat->nr_labels; i++) {
+		intern_table_insert(&dat->label_table, dat->labels[i], strlen(dat->labels[i]), i);
+	}
 
 	if (strncmp(buffer_strdata(r), "DATA", 4)) {
 		WARNING("Missing DATA section marker");
@@ -300,10 +307,9 @@ static int DataFile_SarchLabel(struct string *label)
 {
 	if (!current_gdat)
 		return -1;
-	for (uint32_t i = 0; i < current_gdat->nr_labels; i++) {
-		if (!strcmp(current_gdat->labels[i], label->text))
-			return i;
-	}
+	int i = intern_table_lookup(&current_gdat->label_table, label->text, label->size);
+	if (i >= 0)
+		return i;
 	WARNING("Label '%s' not found", label->text);
 	return -1;
 }
@@ -176,7 +176,7 @@ static int Gpx2Plus_LoadCG(int cg_num)
 {
 	if (!cg_num)
 		return -1;
-	struct cg *cg = asset_cg_load(cg_num);
+	struct cg *cg = asset_cg_get(cg_num);
 	if (!cg)
 		return -1;
 	struct gpx_surface *sf = create_surface(1, 1);
@@ -185,7 +185,7 @@ static int Gpx2Plus_LoadCG(int cg_num)
 	sf->h = cg->metrics.h;
 	sf->has_pixel = cg->metrics.has_pixel;
 	sf->has_alpha = cg->metrics.has_alpha;
-	cg_free(cg);
+	asset_cg_release(cg);
 	return sf->no;
 }
 
@@ -26,6 +26,7 @@
 #include "hll.h"
 #include "asset_manager.h"
 #include "audio.h"
+#include "frame_pacer.h"
 #include "input.h"
 #include "queue.h"
 #include "gfx/gfx.h"
@@ -92,12 +93,13 @@ struct sact_sprite *sact_try_get_sprite(int sp)
 	return sprites[sp];
 }
 
-int sact_Init(possibly_unused void *_, possibly_unused int cg_cache_size)
+int sact_Init(possibly_unused void *_, int cg_cache_size)
 {
 	// already initialized
 	if (sprites)
 		return 1;
 
+	asset_cg_cache_init(cg_cache_size);
 	gfx_init();
 	gfx_font_init();
 	audio_init();
@@ -152,11 +154,15 @@ int sact_Update(void)
 {
 	handle_events();
 	sprite_call_plugins();
+	// events and plugins may dirty the scene, so check it only after them
+	frame_pacer_wait(scene_is_dirty);
+	bool presented = scene_is_dirty;
 	if (scene_is_dirty) {
 		scene_render();
 		gfx_swap();
 		scene_is_dirty = false;
 	}
+	frame_pacer_end(presented);
 	return 1;
 }
 
@@ -171,14 +177,16 @@ void sact_QuakeScreen(int amp_x, int amp_y, int time, int key)
 
 	Texture *dst = gfx_main_surface();
 
-	for (int i = 0; i < time; i+= 16) {
+	uint32_t start = SDL_GetTicks();
+	for (int i = 0; i < time; i = SDL_GetTicks() - start) {
+		frame_pacer_wait(true);
 		float rate = 1.0f - ((float)i / (float)time);
 		int delta_x = (rand() % amp_x - amp_x/2) * rate;
 		int delta_y = (rand() % amp_y - amp_y/2) * rate;
 		gfx_clear();
 		gfx_copy(dst, delta_x, delta_y, &tex, 0, 0, dst->w, dst->h);
 		gfx_swap();
-		SDL_Delay(16);
+		frame_pacer_end(true);
 	}
 }
 
@@ -0,0 +1,218 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "system4.h"
+#include "system4/ain.h"
+#include "system4/string.h"
+
+#include "vm/intern.h"
+
+/*
+ * Hashes of the ain file's constant strings, keyed by address. Strings
+ * pushed by S_PUSH share the struct string of the ain file, so a string
+ * literal can be recognized by pointer identity.
+ */
+struct string_hash_table {
+	uint32_t mask;
+	struct string_hash_entry {
+		const struct string *s; // NULL if the slot is empty
+		uint32_t hash;
+	} *entries;
+};
+
+static struct ain *interned_ain = NULL;
+static struct intern_table function_table;
+static struct string_hash_table string_hashes;
+
+uint32_t intern_hash(const char *text, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)text[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint32_t table_size(uint32_t nr_expected)
+{
+	// keep the load factor at or below 1/2
+	uint32_t size = 8;
+	while (size < nr_expected * 2)
+		size *= 2;
+	return size;
+}
+
+void intern_table_init(struct intern_table *t, uint32_t nr_expected)
+{
+	uint32_t size = table_size(nr_expected);
+	t->mask = size - 1;
+	t->nr_entries = 0;
+	t->entries = xcalloc(size, sizeof(struct intern_entry));
+}
+
+void intern_table_fini(struct intern_table *t)
+{
+	free(t->entries);
+	t->entries = NULL;
+	t->mask = 0;
+	t->nr_entries = 0;
+}
+
+static void intern_table_grow(struct intern_table *t)
+{
+	struct intern_entry *old = t->entries;
+	uint32_t old_size = t->mask + 1;
+
+	t->mask = old_size * 2 - 1;
+	t->entries = xcalloc(old_size * 2, sizeof(struct intern_entry));
+	for (uint32_t i = 0; i < old_size; i++) {
+		if (!old[i].text)
+			continue;
+		uint32_t slot = old[i].hash & t->mask;
+		while (t->entries[slot].text)
+			slot = (slot + 1) & t->mask;
+		t->entries[slot] = old[i];
+	}
+	free(old);
+}
+
+struct intern_entry *intern_table_put(struct intern_table *t, const char *text, size_t len, uint32_t hash)
+{
+	if ((t->nr_entries + 1) * 2 > t->mask + 1)
+		intern_table_grow(t);
+
+	uint32_t slot = hash & t->mask;
+	for (;; slot = (slot + 1) & t->mask) {
+		struct intern_entry *e = &t->entries[slot];
+		if (!e->text) {
+			*e = (struct intern_entry) {
+				.text = text,
+				.len = len,
+				.hash = hash,
+				.value = -1
+			};
+			t->nr_entries++;
+			return e;
+		}
+		if (e->hash == hash && e->len == len && !memcmp(e->text, text, len))
+			return e;
+	}
+}
+
+int32_t intern_table_insert(struct intern_table *t, const char *text, size_t len, int32_t value)
+{
+	uint32_t nr_entries = t->nr_entries;
+	struct intern_entry *e = intern_table_put(t, text, len, intern_hash(text, len));
+	if (t->nr_entries != nr_entries)
+		e->value = value;
+	return e->value;
+}
+
+int32_t intern_table_lookup(struct intern_table *t, const char *text, size_t len)
+{
+	if (!t->entries)
+		return -1;
+
+	uint32_t hash = intern_hash(text, len);
+	uint32_t slot = hash & t->mask;
+	for (;; slot = (slot + 1) & t->mask) {
+		struct intern_entry *e = &t->entries[slot];
+		if (!e->text)
+			return -1;
+		if (e->hash == hash && e->len == len && !memcmp(e->text, text, len))
+			return e->value;
+	}
+}
+
+static uint32_t pointer_hash(const void *p)
+{
+	uintptr_t v = (uintptr_t)p;
+	return (uint32_t)((v >> 4) ^ ((uint64_t)v >> 32)) * 2654435761u;
+}
+
+static void string_hashes_insert(const struct string *s)
+{
+	uint32_t slot = pointer_hash(s) & string_hashes.mask;
+	for (;; slot = (slot + 1) & string_hashes.mask) {
+		struct string_hash_entry *e = &string_hashes.entries[slot];
+		if (e->s == s)
+			return;
+		if (!e->s) {
+			e->s = s;
+			e->hash = intern_hash(s->text, s->size);
+			return;
+		}
+	}
+}
+
+uint32_t intern_string_hash(const struct string *s)
+{
+	if (string_hashes.entries) {
+		uint32_t slot = pointer_hash(s) & string_hashes.mask;
+		for (;; slot = (slot + 1) & string_hashes.mask) {
+			struct string_hash_entry *e = &string_hashes.entries[slot];
+			if (e->s == s)
+				return e->hash;
+			if (!e->s)
+				break;
+		}
+	}
+	return intern_hash(s->text, s->size);
+}
+
+void intern_ain(struct ain *ain)
+{
+	if (ain == interned_ain)
+		return;
+	intern_fini();
+	interned_ain = ain;
+
+	// NOTE: for duplicate names the first object wins, which matches the
+	//       linear scans this replaces
+	intern_table_init(&function_table, ain->nr_functions);
+	for (int i = 0; i < ain->nr_functions; i++) {
+		const char *name = ain->functions[i].name;
+		intern_table_insert(&function_table, name, strlen(name), i);
+	}
+
+	uint32_t size = table_size(ain->nr_strings + ain->nr_messages);
+	string_hashes.mask = size - 1;
+	string_hashes.entries = xcalloc(size, sizeof(struct string_hash_entry));
+	for (int i = 0; i < ain->nr_strings; i++) {
+		string_hashes_insert(ain->strings[i]);
+	}
+	for (int i = 0; i < ain->nr_messages; i++) {
+		string_hashes_insert(ain->messages[i]);
+	}
+}
+
+void intern_fini(void)
+{
+	intern_table_fini(&function_table);
+	free(string_hashes.entries);
+	string_hashes.entries = NULL;
+	string_hashes.mask = 0;
+	interned_ain = NULL;
+}
+
+int intern_get_function(const char *name)
+{
+	return intern_table_lookup(&function_table, name, strlen(name));
+}
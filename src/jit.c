@@ -0,0 +1,603 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Baseline JIT compiler.
+ *
+ * Functions which are called often enough are translated to x86-64 machine
+ * code, one instruction at a time. Simple stack/arithmetic/branch
+ * instructions are emitted inline; everything else is compiled to a call into
+ * the interpreter (vm_execute_instruction), so the native code shares the
+ * VM's stack, heap and call stack and needs no special handling elsewhere.
+ *
+ * Native code is entered through a trampoline which jumps to the code for a
+ * given instruction. Whenever control leaves the straight-line flow of the
+ * function (calls, returns, jumps out of the function, etc.) the native code
+ * sets instr_ptr and returns to the interpreter loop, which re-enters native
+ * code when it reaches an address that has been compiled.
+ *
+ * Native code can be invalidated while it is running (e.g. the debugger sets
+ * a breakpoint from within a function called by compiled code). It then
+ * leaves at the next point where it would otherwise keep running without
+ * going through the interpreter: after an interpreted instruction (which is
+ * also how calls return into it) and at backward branches.
+ */
+
+#define VM_PRIVATE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "system4.h"
+#include "system4/ain.h"
+#include "system4/instructions.h"
+
+#include "little_endian.h"
+#include "vm.h"
+#include "vm/jit.h"
+
+bool jit_enabled = false;
+
+#ifdef VM_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(union vm_value) == 8, "JIT assumes 8-byte stack values");
+
+// Size of the address space reserved for native code.
+// NOTE: must be < 2GB so that rel32 branches can reach the trampoline.
+#define JIT_ARENA_SIZE (64 * 1024 * 1024)
+
+// Functions larger than this are not compiled.
+#define JIT_MAX_INSTRUCTIONS 65536
+
+// Value of call_counts[fno] for functions which have already been compiled
+// (or which cannot be compiled).
+#define JIT_DONE UINT32_MAX
+
+struct jit_function {
+	uint32_t start;
+	uint32_t end;
+	// set when the native code is invalidated; checked by the code itself
+	uint8_t *invalid;
+};
+
+static uint8_t *arena = NULL;
+static size_t arena_used = 0;
+static size_t page_size;
+
+// trampoline entry points
+static void (*jit_enter)(void *target);
+static uint8_t *jit_exit;     // return to the interpreter
+static uint8_t *jit_exit_ip;  // set instr_ptr to EDI and return to the interpreter
+
+static uint32_t *call_counts = NULL;
+// native code for each instruction, indexed by (address / 2)
+static void **entry_points = NULL;
+
+static struct jit_function *functions = NULL;
+static size_t nr_functions = 0;
+
+struct jit_fixup {
+	size_t pos;
+	// either an instruction index (internal branch) or an absolute address
+	int32_t index;
+	uint8_t *target;
+};
+
+struct emitter {
+	uint8_t *buf;
+	size_t len;
+	size_t cap;
+	struct jit_fixup *fixups;
+	size_t nr_fixups;
+	size_t fixups_cap;
+};
+
+static void emit_byte(struct emitter *e, uint8_t b)
+{
+	if (e->len >= e->cap) {
+		e->cap = e->cap ? e->cap * 2 : 4096;
+		e->buf = xrealloc(e->buf, e->cap);
+	}
+	e->buf[e->len++] = b;
+}
+
+static void emit_bytes(struct emitter *e, int n, const uint8_t *bytes)
+{
+	for (int i = 0; i < n; i++) {
+		emit_byte(e, bytes[i]);
+	}
+}
+
+#define EMIT(e, ...) emit_bytes(e, sizeof((uint8_t[]){__VA_ARGS__}), (uint8_t[]){__VA_ARGS__})
+
+static void emit_u32(struct emitter *e, uint32_t v)
+{
+	for (int i = 0; i < 4; i++) {
+		emit_byte(e, (v >> (i*8)) & 0xFF);
+	}
+}
+
+static void emit_u64(struct emitter *e, uint64_t v)
+{
+	for (int i = 0; i < 8; i++) {
+		emit_byte(e, (v >> (i*8)) & 0xFF);
+	}
+}
+
+static void emit_fixup(struct emitter *e, int32_t index, uint8_t *target)
+{
+	if (e->nr_fixups >= e->fixups_cap) {
+		e->fixups_cap = e->fixups_cap ? e->fixups_cap * 2 : 64;
+		e->fixups = xrealloc(e->fixups, e->fixups_cap * sizeof(struct jit_fixup));
+	}
+	e->fixups[e->nr_fixups++] = (struct jit_fixup) {
+		.pos = e->len,
+		.index = index,
+		.target = target
+	};
+	emit_u32(e, 0);
+}
+
+// jmp rel32 to an absolute address
+static void emit_jmp_abs(struct emitter *e, uint8_t *target)
+{
+	EMIT(e, 0xE9);
+	emit_fixup(e, -1, target);
+}
+
+// jz rel32 to an absolute address
+static void emit_jz_abs(struct emitter *e, uint8_t *target)
+{
+	EMIT(e, 0x0F, 0x84);
+	emit_fixup(e, -1, target);
+}
+
+// mov edi, imm32
+static void emit_mov_edi(struct emitter *e, uint32_t v)
+{
+	EMIT(e, 0xBF);
+	emit_u32(e, v);
+}
+
+// mov esi, imm32
+static void emit_mov_esi(struct emitter *e, uint32_t v)
+{
+	EMIT(e, 0xBE);
+	emit_u32(e, v);
+}
+
+// mov rax, imm64
+static void emit_mov_rax(struct emitter *e, const void *p)
+{
+	EMIT(e, 0x48, 0xB8);
+	emit_u64(e, (uintptr_t)p);
+}
+
+/*
+ * rax = stack
+ * rcx = stack_ptr
+ * rdx = &stack[stack_ptr]
+ */
+static void emit_load_sp(struct emitter *e)
+{
+	EMIT(e, 0x49, 0x8B, 0x04, 0x24); // mov rax, [r12]
+	EMIT(e, 0x49, 0x63, 0x4D, 0x00); // movsxd rcx, dword [r13]
+	EMIT(e, 0x48, 0x8D, 0x14, 0xC8); // lea rdx, [rax+rcx*8]
+}
+
+static void emit_inc_sp(struct emitter *e)
+{
+	EMIT(e, 0x41, 0xFF, 0x45, 0x00); // inc dword [r13]
+}
+
+static void emit_dec_sp(struct emitter *e)
+{
+	EMIT(e, 0x41, 0xFF, 0x4D, 0x00); // dec dword [r13]
+}
+
+// eax = stack[stack_ptr-1].i
+static void emit_load_top(struct emitter *e)
+{
+	EMIT(e, 0x8B, 0x42, 0xF8); // mov eax, [rdx-8]
+}
+
+/*
+ * Called from native code to execute an instruction in the interpreter.
+ * Returns non-zero if execution should continue with the native code for the
+ * next instruction.
+ */
+static int jit_interpret(uint32_t addr, uint32_t next)
+{
+	instr_ptr = addr;
+	vm_execute_instruction();
+	return instr_ptr == next && entry_points[next / 2];
+}
+
+/*
+ * Jump to the instruction at ADDR (either natively, or via the interpreter).
+ * FROM is the index of the jumping instruction; backward jumps check INVALID
+ * first, so that a loop doesn't keep running invalidated code.
+ */
+static void emit_jump_to(struct emitter *e, uint32_t *addrs, int nr_addrs, int from,
+		uint8_t *invalid, uint32_t addr)
+{
+	// binary search for the target instruction
+	int lo = 0, hi = nr_addrs - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (addrs[mid] == addr) {
+			if (mid <= from) {
+				emit_mov_rax(e, invalid);
+				EMIT(e, 0x80, 0x38, 0x00); // cmp byte [rax], 0
+				EMIT(e, 0x75, 0x00);       // jnz <exit to the interpreter below>
+				size_t skip = e->len;
+				EMIT(e, 0xE9);
+				emit_fixup(e, mid, NULL);
+				e->buf[skip-1] = e->len - skip;
+				break;
+			}
+			EMIT(e, 0xE9);
+			emit_fixup(e, mid, NULL);
+			return;
+		}
+		if (addrs[mid] < addr)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	emit_mov_edi(e, addr);
+	emit_jmp_abs(e, jit_exit_ip);
+}
+
+static void emit_binop(struct emitter *e, uint8_t op)
+{
+	emit_load_sp(e);
+	emit_load_top(e);
+	EMIT(e, op, 0x42, 0xF0); // <op> [rdx-16], eax
+	emit_dec_sp(e);
+}
+
+static void emit_compare(struct emitter *e, uint8_t setcc)
+{
+	emit_load_sp(e);
+	emit_load_top(e);
+	EMIT(e, 0x39, 0x42, 0xF0);       // cmp [rdx-16], eax
+	EMIT(e, 0x0F, setcc, 0xC0);      // set<cc> al
+	EMIT(e, 0x0F, 0xB6, 0xC0);       // movzx eax, al
+	EMIT(e, 0x48, 0x89, 0x42, 0xF0); // mov [rdx-16], rax
+	emit_dec_sp(e);
+}
+
+static void emit_branch(struct emitter *e, uint32_t *addrs, int nr_addrs, int from,
+		uint8_t *invalid, bool if_zero, uint32_t target)
+{
+	emit_load_sp(e);
+	emit_load_top(e);
+	emit_dec_sp(e);
+	EMIT(e, 0x85, 0xC0); // test eax, eax
+	// skip the jump if the branch is not taken
+	EMIT(e, if_zero ? 0x75 : 0x74, 0x00);
+	size_t skip = e->len;
+	emit_jump_to(e, addrs, nr_addrs, from, invalid, target);
+	e->buf[skip-1] = e->len - skip;
+}
+
+static void emit_interpret(struct emitter *e, uint32_t addr, uint32_t next)
+{
+	emit_mov_edi(e, addr);
+	emit_mov_esi(e, next);
+	emit_mov_rax(e, jit_interpret);
+	EMIT(e, 0xFF, 0xD0); // call rax
+	EMIT(e, 0x85, 0xC0); // test eax, eax
+	emit_jz_abs(e, jit_exit);
+}
+
+static void emit_instruction(struct emitter *e, uint32_t *addrs, int nr_addrs, int i, uint8_t *invalid)
+{
+	uint32_t addr = addrs[i];
+	uint16_t opcode = LittleEndian_getW(ain->code, addr);
+	uint32_t next = addr + instruction_width(opcode & ~OPTYPE_MASK);
+	int32_t arg0 = LittleEndian_getDW(ain->code, addr + 2);
+
+	switch (opcode) {
+	case PUSH:
+	case F_PUSH:
+		// write the whole slot, zero-extended like vm_int/vm_float
+		emit_load_sp(e);
+		EMIT(e, 0xB8);             // mov eax, imm32
+		emit_u32(e, arg0);
+		EMIT(e, 0x48, 0x89, 0x02); // mov [rdx], rax
+		emit_inc_sp(e);
+		break;
+	case POP:
+		emit_dec_sp(e);
+		break;
+	case DUP:
+		emit_load_sp(e);
+		EMIT(e, 0x48, 0x8B, 0x42, 0xF8); // mov rax, [rdx-8]
+		EMIT(e, 0x48, 0x89, 0x02);       // mov [rdx], rax
+		emit_inc_sp(e);
+		break;
+	case INV:
+		emit_load_sp(e);
+		EMIT(e, 0xF7, 0x5A, 0xF8); // neg dword [rdx-8]
+		break;
+	case NOT:
+		emit_load_sp(e);
+		emit_load_top(e);
+		EMIT(e, 0x85, 0xC0);       // test eax, eax
+		EMIT(e, 0x0F, 0x94, 0xC0);       // sete al
+		EMIT(e, 0x0F, 0xB6, 0xC0);       // movzx eax, al
+		EMIT(e, 0x48, 0x89, 0x42, 0xF8); // mov [rdx-8], rax
+		break;
+	case ADD: emit_binop(e, 0x01); break;
+	case SUB: emit_binop(e, 0x29); break;
+	case AND: emit_binop(e, 0x21); break;
+	case OR:  emit_binop(e, 0x09); break;
+	case MUL:
+		emit_load_sp(e);
+		emit_load_top(e);
+		EMIT(e, 0x8B, 0x4A, 0xF0); // mov ecx, [rdx-16]
+		EMIT(e, 0x0F, 0xAF, 0xC8); // imul ecx, eax
+		EMIT(e, 0x89, 0x4A, 0xF0); // mov [rdx-16], ecx
+		emit_dec_sp(e);
+		break;
+	case LT:     emit_compare(e, 0x9C); break;
+	case GT:     emit_compare(e, 0x9F); break;
+	case LTE:    emit_compare(e, 0x9E); break;
+	case GTE:    emit_compare(e, 0x9D); break;
+	case NOTE:   emit_compare(e, 0x95); break;
+	case EQUALE: emit_compare(e, 0x94); break;
+	case JUMP:
+		emit_jump_to(e, addrs, nr_addrs, i, invalid, arg0);
+		break;
+	case IFZ:
+		emit_branch(e, addrs, nr_addrs, i, invalid, true, arg0);
+		break;
+	case IFNZ:
+		emit_branch(e, addrs, nr_addrs, i, invalid, false, arg0);
+		break;
+	case FUNC:
+		break;
+	default:
+		// NOTE: this includes instructions with the BREAKPOINT flag set
+		emit_interpret(e, addr, next);
+		break;
+	}
+}
+
+static void *arena_alloc(size_t size)
+{
+	size_t start = arena_used;
+	size = (size + page_size - 1) & ~(page_size - 1);
+	if (start + size > JIT_ARENA_SIZE)
+		return NULL;
+	// NOTE: each function gets its own pages, so that native code which is
+	//       currently executing is never made non-executable
+	if (mprotect(arena + start, size, PROT_READ | PROT_WRITE)) {
+		WARNING("mprotect: %s", strerror(errno));
+		return NULL;
+	}
+	arena_used += size;
+	return arena + start;
+}
+
+static bool arena_seal(void *p, size_t size)
+{
+	size = (size + page_size - 1) & ~(page_size - 1);
+	if (mprotect(p, size, PROT_READ | PROT_EXEC)) {
+		WARNING("mprotect: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+// Get the addresses of the instructions in function FNO.
+static uint32_t *function_instructions(int fno, int *nr_out)
+{
+	uint32_t addr = ain->functions[fno].address;
+	int nr = 0, cap = 64;
+	uint32_t *addrs = xmalloc(cap * sizeof(uint32_t));
+
+	while (addr < ain->code_size) {
+		uint16_t opcode = LittleEndian_getW(ain->code, addr) & ~OPTYPE_MASK;
+		if (opcode >= NR_OPCODES || nr >= JIT_MAX_INSTRUCTIONS)
+			break;
+		if (entry_points[addr / 2])
+			break;
+		if (nr >= cap) {
+			cap *= 2;
+			addrs = xrealloc(addrs, cap * sizeof(uint32_t));
+		}
+		addrs[nr++] = addr;
+		if (opcode == ENDFUNC) {
+			*nr_out = nr;
+			return addrs;
+		}
+		addr += instruction_width(opcode);
+	}
+	free(addrs);
+	return NULL;
+}
+
+static void jit_compile(int fno)
+{
+	int nr_addrs;
+	uint32_t *addrs = function_instructions(fno, &nr_addrs);
+	if (!addrs)
+		return;
+
+	struct emitter e = {0};
+	// NOTE: never freed, like the native code which refers to it
+	uint8_t *invalid = xcalloc(1, 1);
+	size_t *offsets = xmalloc(nr_addrs * sizeof(size_t));
+	for (int i = 0; i < nr_addrs; i++) {
+		offsets[i] = e.len;
+		emit_instruction(&e, addrs, nr_addrs, i, invalid);
+	}
+	// falling off the end of the function returns to the interpreter
+	uint32_t end = addrs[nr_addrs-1] + instruction_width(ENDFUNC);
+	emit_mov_edi(&e, end);
+	emit_jmp_abs(&e, jit_exit_ip);
+
+	uint8_t *code = arena_alloc(e.len);
+	if (!code) {
+		free(invalid);
+		goto cleanup;
+	}
+	memcpy(code, e.buf, e.len);
+	for (size_t i = 0; i < e.nr_fixups; i++) {
+		struct jit_fixup *f = &e.fixups[i];
+		uint8_t *target = f->index < 0 ? f->target : code + offsets[f->index];
+		int32_t rel = target - (code + f->pos + 4);
+		memcpy(code + f->pos, &rel, 4);
+	}
+	if (!arena_seal(code, e.len)) {
+		free(invalid);
+		goto cleanup;
+	}
+
+	for (int i = 0; i < nr_addrs; i++) {
+		entry_points[addrs[i] / 2] = code + offsets[i];
+	}
+	functions = xrealloc_array(functions, nr_functions, nr_functions+1, sizeof(struct jit_function));
+	functions[nr_functions++] = (struct jit_function) {
+		.start = addrs[0],
+		.end = end,
+		.invalid = invalid
+	};
+cleanup:
+	free(e.buf);
+	free(e.fixups);
+	free(offsets);
+	free(addrs);
+}
+
+static void emit_trampoline(void)
+{
+	struct emitter e = {0};
+
+	// enter: save callee-saved registers and jump to RDI
+	EMIT(&e, 0x53);       // push rbx
+	EMIT(&e, 0x41, 0x54); // push r12
+	EMIT(&e, 0x41, 0x55); // push r13
+	EMIT(&e, 0x49, 0xBC); // mov r12, &stack
+	emit_u64(&e, (uintptr_t)&stack);
+	EMIT(&e, 0x49, 0xBD); // mov r13, &stack_ptr
+	emit_u64(&e, (uintptr_t)&stack_ptr);
+	EMIT(&e, 0xFF, 0xE7); // jmp rdi
+
+	// exit_ip: instr_ptr = EDI
+	size_t exit_ip = e.len;
+	emit_mov_rax(&e, &instr_ptr);
+	EMIT(&e, 0x48, 0x89, 0x38); // mov [rax], rdi
+
+	// exit: restore registers and return to the interpreter
+	size_t exit = e.len;
+	EMIT(&e, 0x41, 0x5D); // pop r13
+	EMIT(&e, 0x41, 0x5C); // pop r12
+	EMIT(&e, 0x5B);       // pop rbx
+	EMIT(&e, 0xC3);       // ret
+
+	uint8_t *code = arena_alloc(e.len);
+	if (!code)
+		ERROR("Failed to allocate memory for JIT trampoline");
+	memcpy(code, e.buf, e.len);
+	if (!arena_seal(code, e.len))
+		ERROR("Failed to initialize JIT trampoline");
+	free(e.buf);
+
+	jit_enter = (void(*)(void*))code;
+	jit_exit = code + exit;
+	jit_exit_ip = code + exit_ip;
+}
+
+void jit_init(void)
+{
+	if (arena)
+		return;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	arena = mmap(NULL, JIT_ARENA_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED) {
+		WARNING("Failed to reserve memory for JIT: %s", strerror(errno));
+		arena = NULL;
+		return;
+	}
+	emit_trampoline();
+
+	call_counts = xcalloc(ain->nr_functions, sizeof(uint32_t));
+	entry_points = xcalloc(ain->code_size / 2 + 1, sizeof(void*));
+	jit_enabled = true;
+}
+
+void jit_function_called(int fno)
+{
+	if (call_counts[fno] == JIT_DONE)
+		return;
+	if (++call_counts[fno] < JIT_HOT_THRESHOLD)
+		return;
+	call_counts[fno] = JIT_DONE;
+	jit_compile(fno);
+}
+
+bool jit_execute(void)
+{
+	void *target = entry_points[instr_ptr / 2];
+	if (!target)
+		return false;
+	jit_enter(target);
+	return true;
+}
+
+void jit_invalidate(uint32_t addr)
+{
+	if (!jit_enabled)
+		return;
+	for (size_t i = 0; i < nr_functions; i++) {
+		if (addr < functions[i].start || addr >= functions[i].end)
+			continue;
+		// NOTE: the native code itself is not freed, since it may be
+		//       executing right now (e.g. if the debugger was entered
+		//       from a compiled function). Clearing the entry points
+		//       stops it from being entered again, and makes running
+		//       code exit after the current interpreted instruction;
+		//       the flag makes it exit at the next backward branch.
+		*functions[i].invalid = 1;
+		for (uint32_t a = functions[i].start; a < functions[i].end; a += 2) {
+			entry_points[a / 2] = NULL;
+		}
+		functions[i] = functions[--nr_functions];
+		return;
+	}
+}
+
+#else /* VM_JIT */
+
+void jit_init(void)
+{
+	WARNING("JIT compiler is not supported on this platform");
+}
+
+void jit_function_called(possibly_unused int fno) {}
+bool jit_execute(void) { return false; }
+void jit_invalidate(possibly_unused uint32_t addr) {}
+
+#endif /* VM_JIT */
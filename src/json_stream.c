@@ -0,0 +1,589 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "system4.h"
+
+#include "json_stream.h"
+
+#define JSON_LEVEL_OBJECT 1
+#define JSON_LEVEL_NONEMPTY 2
+
+static char decimal_point(void)
+{
+	struct lconv *lconv = localeconv();
+	return lconv ? lconv->decimal_point[0] : '.';
+}
+
+/*
+ * Writer. The formatting rules are those of cJSON_Print: object members go
+ * on their own line, indented by one tab per open container (arrays
+ * included), with a tab between the key and value; array elements are
+ * separated by ", " on a single line.
+ */
+
+void json_writer_init(struct json_writer *w)
+{
+	*w = (struct json_writer) {0};
+}
+
+char *json_writer_finish(struct json_writer *w, size_t *len)
+{
+	char *buf = w->buf ? w->buf : xstrdup("");
+	if (len)
+		*len = w->len;
+	free(w->levels);
+	*w = (struct json_writer) {0};
+	return buf;
+}
+
+static char *reserve(struct json_writer *w, size_t n)
+{
+	// +1 for the terminating NUL
+	if (w->len + n + 1 > w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 4096;
+		while (w->len + n + 1 > w->cap)
+			w->cap *= 2;
+		w->buf = xrealloc(w->buf, w->cap);
+	}
+	char *p = w->buf + w->len;
+	w->len += n;
+	w->buf[w->len] = '\0';
+	return p;
+}
+
+static void put(struct json_writer *w, const char *s, size_t n)
+{
+	memcpy(reserve(w, n), s, n);
+}
+
+static void put_tabs(struct json_writer *w, int n)
+{
+	memset(reserve(w, n), '\t', n);
+}
+
+// Emit whatever has to come before a new array element.
+static void begin_value(struct json_writer *w)
+{
+	if (!w->depth)
+		return;
+	uint8_t *level = &w->levels[w->depth - 1];
+	// object members are preceded by their key instead
+	if (*level & JSON_LEVEL_OBJECT)
+		return;
+	if (*level & JSON_LEVEL_NONEMPTY)
+		put(w, ", ", 2);
+	*level |= JSON_LEVEL_NONEMPTY;
+}
+
+static void push_level(struct json_writer *w, uint8_t flags)
+{
+	if (w->depth == w->levels_cap) {
+		w->levels_cap = w->levels_cap ? w->levels_cap * 2 : 16;
+		w->levels = xrealloc(w->levels, w->levels_cap);
+	}
+	w->levels[w->depth++] = flags;
+}
+
+void json_begin_object(struct json_writer *w)
+{
+	begin_value(w);
+	put(w, "{\n", 2);
+	push_level(w, JSON_LEVEL_OBJECT);
+}
+
+void json_end_object(struct json_writer *w)
+{
+	if (w->levels[--w->depth] & JSON_LEVEL_NONEMPTY)
+		put(w, "\n", 1);
+	put_tabs(w, w->depth);
+	put(w, "}", 1);
+}
+
+void json_begin_array(struct json_writer *w)
+{
+	begin_value(w);
+	put(w, "[", 1);
+	push_level(w, 0);
+}
+
+void json_end_array(struct json_writer *w)
+{
+	w->depth--;
+	put(w, "]", 1);
+}
+
+static void put_string(struct json_writer *w, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	put(w, "\"", 1);
+	for (const unsigned char *p = (const unsigned char*)s; *p; p++) {
+		const unsigned char *start = p;
+		while (*p > 31 && *p != '"' && *p != '\\')
+			p++;
+		if (p > start)
+			put(w, (const char*)start, p - start);
+		if (!*p)
+			break;
+
+		char esc[6] = { '\\', 0 };
+		size_t n = 2;
+		switch (*p) {
+		case '\\': esc[1] = '\\'; break;
+		case '"':  esc[1] = '"'; break;
+		case '\b': esc[1] = 'b'; break;
+		case '\f': esc[1] = 'f'; break;
+		case '\n': esc[1] = 'n'; break;
+		case '\r': esc[1] = 'r'; break;
+		case '\t': esc[1] = 't'; break;
+		default:
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hex[*p >> 4];
+			esc[5] = hex[*p & 0xf];
+			n = 6;
+			break;
+		}
+		put(w, esc, n);
+	}
+	put(w, "\"", 1);
+}
+
+void json_write_key(struct json_writer *w, const char *key)
+{
+	uint8_t *level = &w->levels[w->depth - 1];
+	if (*level & JSON_LEVEL_NONEMPTY)
+		put(w, ",\n", 2);
+	*level |= JSON_LEVEL_NONEMPTY;
+	put_tabs(w, w->depth);
+	put_string(w, key);
+	put(w, ":\t", 2);
+}
+
+void json_write_string(struct json_writer *w, const char *s)
+{
+	begin_value(w);
+	put_string(w, s);
+}
+
+void json_write_int(struct json_writer *w, int32_t i)
+{
+	char buf[16];
+	int len = sprintf(buf, "%d", (int)i);
+	begin_value(w);
+	put(w, buf, len);
+}
+
+void json_write_number(struct json_writer *w, double d)
+{
+	char buf[32];
+	int len;
+	double test;
+
+	begin_value(w);
+	if (d * 0 != 0) {
+		// NaN or infinity
+		put(w, "null", 4);
+		return;
+	}
+	// same as cJSON's print_number
+	len = sprintf(buf, "%1.15g", d);
+	if (sscanf(buf, "%lg", &test) != 1 || test != d)
+		len = sprintf(buf, "%1.17g", d);
+
+	char point = decimal_point();
+	for (int i = 0; i < len; i++) {
+		if (buf[i] == point)
+			buf[i] = '.';
+	}
+	put(w, buf, len);
+}
+
+void json_write_null(struct json_writer *w)
+{
+	begin_value(w);
+	put(w, "null", 4);
+}
+
+/*
+ * Reader.
+ */
+
+enum reader_state {
+	EXPECT_VALUE,
+	EXPECT_VALUE_OR_END, // after '['
+	EXPECT_KEY,          // after ',' in an object
+	EXPECT_KEY_OR_END,   // after '{'
+	EXPECT_SEPARATOR,    // after a value in a container
+	EXPECT_EOF,          // after the top-level value
+};
+
+void json_reader_init(struct json_reader *r, FILE *f)
+{
+	r->f = f;
+	r->pos = 0;
+	r->len = 0;
+	r->state = EXPECT_VALUE;
+	r->containers = NULL;
+	r->depth = 0;
+	r->containers_cap = 0;
+	r->str = NULL;
+	r->str_len = 0;
+	r->str_cap = 0;
+	r->number = 0;
+	r->error = NULL;
+}
+
+void json_reader_fini(struct json_reader *r)
+{
+	free(r->containers);
+	free(r->str);
+	r->containers = NULL;
+	r->str = NULL;
+}
+
+void json_reader_rewind(struct json_reader *r)
+{
+	fseek(r->f, 0, SEEK_SET);
+	r->pos = 0;
+	r->len = 0;
+	r->state = EXPECT_VALUE;
+	r->depth = 0;
+	r->error = NULL;
+}
+
+static int peek_char(struct json_reader *r)
+{
+	if (r->pos == r->len) {
+		r->len = fread(r->buf, 1, sizeof(r->buf), r->f);
+		r->pos = 0;
+		if (!r->len)
+			return EOF;
+	}
+	return r->buf[r->pos];
+}
+
+static int next_char(struct json_reader *r)
+{
+	int c = peek_char(r);
+	if (c != EOF)
+		r->pos++;
+	return c;
+}
+
+static int skip_whitespace(struct json_reader *r)
+{
+	int c;
+	while ((c = peek_char(r)) == ' ' || c == '\t' || c == '\n' || c == '\r')
+		r->pos++;
+	return c;
+}
+
+static enum json_token reader_error(struct json_reader *r, const char *msg)
+{
+	if (!r->error)
+		r->error = msg;
+	return JSON_ERROR;
+}
+
+static void str_push(struct json_reader *r, char c)
+{
+	if (r->str_len + 1 >= r->str_cap) {
+		r->str_cap = r->str_cap ? r->str_cap * 2 : 64;
+		r->str = xrealloc(r->str, r->str_cap);
+	}
+	r->str[r->str_len++] = c;
+}
+
+static bool read_hex4(struct json_reader *r, unsigned *out)
+{
+	unsigned h = 0;
+	for (int i = 0; i < 4; i++) {
+		int c = next_char(r);
+		h <<= 4;
+		if (c >= '0' && c <= '9')
+			h |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			h |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			h |= c - 'A' + 10;
+		else
+			return false;
+	}
+	*out = h;
+	return true;
+}
+
+// \uXXXX (possibly a surrogate pair), encoded as UTF-8
+static bool read_utf16_escape(struct json_reader *r)
+{
+	unsigned cp;
+	if (!read_hex4(r, &cp))
+		return false;
+	if (cp >= 0xDC00 && cp <= 0xDFFF)
+		return false;
+	if (cp >= 0xD800 && cp <= 0xDBFF) {
+		unsigned lo;
+		if (next_char(r) != '\\' || next_char(r) != 'u' || !read_hex4(r, &lo))
+			return false;
+		if (lo < 0xDC00 || lo > 0xDFFF)
+			return false;
+		cp = 0x10000 + (((cp & 0x3FF) << 10) | (lo & 0x3FF));
+	}
+
+	if (cp < 0x80) {
+		str_push(r, cp);
+	} else if (cp < 0x800) {
+		str_push(r, 0xC0 | (cp >> 6));
+		str_push(r, 0x80 | (cp & 0x3F));
+	} else if (cp < 0x10000) {
+		str_push(r, 0xE0 | (cp >> 12));
+		str_push(r, 0x80 | ((cp >> 6) & 0x3F));
+		str_push(r, 0x80 | (cp & 0x3F));
+	} else {
+		str_push(r, 0xF0 | (cp >> 18));
+		str_push(r, 0x80 | ((cp >> 12) & 0x3F));
+		str_push(r, 0x80 | ((cp >> 6) & 0x3F));
+		str_push(r, 0x80 | (cp & 0x3F));
+	}
+	return true;
+}
+
+static bool read_string(struct json_reader *r)
+{
+	// opening quote already consumed
+	r->str_len = 0;
+	while (true) {
+		int c = next_char(r);
+		if (c == EOF)
+			return false;
+		if (c == '"')
+			break;
+		if (c != '\\') {
+			str_push(r, c);
+			continue;
+		}
+		switch ((c = next_char(r))) {
+		case 'b': str_push(r, '\b'); break;
+		case 'f': str_push(r, '\f'); break;
+		case 'n': str_push(r, '\n'); break;
+		case 'r': str_push(r, '\r'); break;
+		case 't': str_push(r, '\t'); break;
+		case '"':
+		case '\\':
+		case '/':
+			str_push(r, c);
+			break;
+		case 'u':
+			if (!read_utf16_escape(r))
+				return false;
+			break;
+		default:
+			return false;
+		}
+	}
+	str_push(r, '\0');
+	r->str_len--;
+	return true;
+}
+
+static bool read_number(struct json_reader *r)
+{
+	char buf[64];
+	char point = decimal_point();
+	size_t i = 0;
+	int c;
+	while (i < sizeof(buf) - 1 && (c = peek_char(r)) != EOF) {
+		if ((c >= '0' && c <= '9') || c == '+' || c == '-' || c == 'e' || c == 'E')
+			buf[i++] = c;
+		else if (c == '.')
+			buf[i++] = point;
+		else
+			break;
+		r->pos++;
+	}
+	buf[i] = '\0';
+
+	char *end;
+	r->number = strtod(buf, &end);
+	return i && end == buf + i;
+}
+
+static bool read_literal(struct json_reader *r, const char *rest)
+{
+	// first character already consumed
+	for (; *rest; rest++) {
+		if (next_char(r) != *rest)
+			return false;
+	}
+	return true;
+}
+
+static void push_container(struct json_reader *r, bool is_object)
+{
+	if (r->depth == r->containers_cap) {
+		r->containers_cap = r->containers_cap ? r->containers_cap * 2 : 16;
+		r->containers = xrealloc(r->containers, r->containers_cap * sizeof(bool));
+	}
+	r->containers[r->depth++] = is_object;
+}
+
+static enum json_token read_value(struct json_reader *r, int c)
+{
+	enum json_token token;
+	r->pos++;
+	switch (c) {
+	case '{':
+		push_container(r, true);
+		r->state = EXPECT_KEY_OR_END;
+		return JSON_OBJECT_BEGIN;
+	case '[':
+		push_container(r, false);
+		r->state = EXPECT_VALUE_OR_END;
+		return JSON_ARRAY_BEGIN;
+	case '"':
+		if (!read_string(r))
+			return reader_error(r, "Invalid string");
+		token = JSON_STRING;
+		break;
+	case 't':
+		if (!read_literal(r, "rue"))
+			return reader_error(r, "Invalid literal");
+		token = JSON_TRUE;
+		break;
+	case 'f':
+		if (!read_literal(r, "alse"))
+			return reader_error(r, "Invalid literal");
+		token = JSON_FALSE;
+		break;
+	case 'n':
+		if (!read_literal(r, "ull"))
+			return reader_error(r, "Invalid literal");
+		token = JSON_NULL;
+		break;
+	default:
+		if (c != '-' && (c < '0' || c > '9'))
+			return reader_error(r, "Unexpected character");
+		r->pos--;
+		if (!read_number(r))
+			return reader_error(r, "Invalid number");
+		token = JSON_NUMBER;
+		break;
+	}
+	r->state = r->depth ? EXPECT_SEPARATOR : EXPECT_EOF;
+	return token;
+}
+
+static enum json_token read_key(struct json_reader *r, int c)
+{
+	if (c != '"')
+		return reader_error(r, "Expected a key");
+	r->pos++;
+	if (!read_string(r))
+		return reader_error(r, "Invalid string");
+	if (skip_whitespace(r) != ':')
+		return reader_error(r, "Expected ':'");
+	r->pos++;
+	r->state = EXPECT_VALUE;
+	return JSON_KEY;
+}
+
+static enum json_token close_container(struct json_reader *r, int c)
+{
+	bool is_object = r->containers[r->depth - 1];
+	if (c != (is_object ? '}' : ']'))
+		return reader_error(r, "Mismatched brackets");
+	r->pos++;
+	r->depth--;
+	r->state = r->depth ? EXPECT_SEPARATOR : EXPECT_EOF;
+	return is_object ? JSON_OBJECT_END : JSON_ARRAY_END;
+}
+
+enum json_token json_read(struct json_reader *r)
+{
+	if (r->error)
+		return JSON_ERROR;
+
+	int c = skip_whitespace(r);
+	if (r->state == EXPECT_EOF)
+		return JSON_END;
+	if (c == EOF)
+		return reader_error(r, "Unexpected end of file");
+
+	switch (r->state) {
+	case EXPECT_VALUE:
+		return read_value(r, c);
+	case EXPECT_VALUE_OR_END:
+		if (c == ']')
+			return close_container(r, c);
+		return read_value(r, c);
+	case EXPECT_KEY:
+		return read_key(r, c);
+	case EXPECT_KEY_OR_END:
+		if (c == '}')
+			return close_container(r, c);
+		return read_key(r, c);
+	case EXPECT_SEPARATOR:
+		if (c != ',')
+			return close_container(r, c);
+		r->pos++;
+		r->state = r->containers[r->depth - 1] ? EXPECT_KEY : EXPECT_VALUE;
+		return json_read(r);
+	}
+	return reader_error(r, "Invalid state");
+}
+
+bool json_skip(struct json_reader *r, enum json_token token)
+{
+	if (token == JSON_ERROR)
+		return false;
+	if (token != JSON_OBJECT_BEGIN && token != JSON_ARRAY_BEGIN)
+		return true;
+
+	int depth = 1;
+	while (depth) {
+		switch (json_read(r)) {
+		case JSON_OBJECT_BEGIN:
+		case JSON_ARRAY_BEGIN:
+			depth++;
+			break;
+		case JSON_OBJECT_END:
+		case JSON_ARRAY_END:
+			depth--;
+			break;
+		case JSON_ERROR:
+		case JSON_END:
+			return false;
+		default:
+			break;
+		}
+	}
+	return true;
+}
+
+int json_reader_int(struct json_reader *r)
+{
+	if (r->number >= INT_MAX)
+		return INT_MAX;
+	if (r->number <= (double)INT_MIN)
+		return INT_MIN;
+	return (int)r->number;
+}
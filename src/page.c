@@ -25,6 +25,9 @@
 #define NR_CACHES 8
 #define CACHE_SIZE 64
 
+// Capacity below which page_reserve never shrinks a page
+#define PAGE_MIN_CAPACITY 8
+
 static const char *pagetype_strtab[] = {
 	[GLOBAL_PAGE] = "GLOBAL_PAGE",
 	[LOCAL_PAGE] = "LOCAL_PAGE",
@@ -55,12 +58,16 @@ struct page *_alloc_page(int nr_vars)
 		memset(page->values, 0, sizeof(union vm_value) * nr_vars);
 		return page;
 	}
-	return xcalloc(1, sizeof(struct page) + sizeof(union vm_value) * nr_vars);
+	struct page *page = xcalloc(1, sizeof(struct page) + sizeof(union vm_value) * nr_vars);
+	page->capacity = nr_vars;
+	return page;
 }
 
 void free_page(struct page *page)
 {
-	int cache_no = page->nr_vars - 1;
+	// NOTE: pages are cached by capacity, so that a cached page always has
+	//       room for exactly (cache_no + 1) values
+	int cache_no = page->capacity - 1;
 	if (cache_no < 0 || cache_no >= NR_CACHES || page_cache[cache_no].cached >= CACHE_SIZE) {
 		free(page);
 		return;
@@ -77,6 +84,28 @@ struct page *alloc_page(enum page_type type, int type_index, int nr_vars)
 	return page;
 }
 
+/*
+ * Ensure that PAGE has room for NR_VARS values, returning the (possibly
+ * moved) page. Storage grows geometrically, and is only given back once the
+ * page is less than a quarter full, so that a sequence of pushes/erases runs
+ * in amortized constant time. The caller is responsible for updating
+ * page->nr_vars.
+ */
+struct page *page_reserve(struct page *page, int nr_vars)
+{
+	int capacity = page->capacity;
+	if (nr_vars > capacity) {
+		capacity = max(nr_vars, max(capacity * 2, 4));
+	} else if (nr_vars < capacity / 4 && capacity > PAGE_MIN_CAPACITY) {
+		capacity = max(nr_vars * 2, PAGE_MIN_CAPACITY);
+	} else {
+		return page;
+	}
+	page = xrealloc(page, sizeof(struct page) + sizeof(union vm_value) * capacity);
+	page->capacity = capacity;
+	return page;
+}
+
 union vm_value variable_initval(enum ain_data_type type)
 {
 	int slot;
@@ -339,7 +368,7 @@ struct page *realloc_array(struct page *src, int rank, union vm_value *dimension
 		}
 	}
 
-	src = xrealloc(src, sizeof(struct page) + sizeof(union vm_value) * dimensions->i);
+	src = page_reserve(src, dimensions->i);
 
 	// if growing array, init new children
 	enum ain_data_type type = array_type(data_type);
@@ -437,9 +466,9 @@ struct page *array_pushback(struct page *dst, union vm_value v, enum ain_data_ty
 			VM_ERROR("Tried pushing to a multi-dimensional array");
 
 		int index = dst->nr_vars;
-		union vm_value dims[1] = { (union vm_value) { .i = index + 1 } };
-		dst = realloc_array(dst, 1, dims, dst->a_type, dst->array.struct_type, false);
-		variable_set(dst, index, array_type(data_type), v);
+		dst = page_reserve(dst, index + 1);
+		dst->values[index] = v;
+		dst->nr_vars = index + 1;
 	} else {
 		union vm_value dims[1] = { (union vm_value) { .i = 1 } };
 		dst = alloc_array(1, dims, data_type, struct_type, false);
@@ -488,7 +517,7 @@ struct page *array_erase(struct page *page, int i, bool *success)
 		page->values[j-1] = page->values[j];
 	}
 	page->nr_vars--;
-	page = xrealloc(page, sizeof(struct page) + sizeof(union vm_value) * page->nr_vars);
+	page = page_reserve(page, page->nr_vars);
 
 	*success = true;
 	return page;
@@ -510,8 +539,8 @@ struct page *array_insert(struct page *page, int i, union vm_value v, enum ain_d
 	if (i < 0)
 		i = 0;
 
+	page = page_reserve(page, page->nr_vars + 1);
 	page->nr_vars++;
-	page = xrealloc(page, sizeof(struct page) + sizeof(union vm_value) * page->nr_vars);
 	for (int j = page->nr_vars - 1; j > i; j--) {
 		page->values[j] = page->values[j-1];
 	}
@@ -519,52 +548,6 @@ struct page *array_insert(struct page *page, int i, union vm_value v, enum ain_d
 	return page;
 }
 
-static int current_sort_function;
-
-static int array_compare(const void *_a, const void *_b)
-{
-	union vm_value a = *((union vm_value*)_a);
-	union vm_value b = *((union vm_value*)_b);
-	if (!current_sort_function) {
-		return a.i - b.i;
-	}
-	stack_push(a);
-	stack_push(b);
-	vm_call(current_sort_function, -1);
-	return stack_pop().i;
-}
-
-void array_sort(struct page *page, int compare_fno)
-{
-	if (!page)
-		return;
-
-	current_sort_function = compare_fno;
-	qsort(page->values, page->nr_vars, sizeof(union vm_value), array_compare);
-}
-
-static int current_sort_member;
-
-static int array_compare_member(const void *_a, const void *_b)
-{
-	union vm_value a_slot = *((union vm_value*)_a);
-	union vm_value b_slot = *((union vm_value*)_b);
-	struct page *a = heap_get_page(a_slot.i);
-	struct page *b = heap_get_page(b_slot.i);
-	return a->values[current_sort_member].i - b->values[current_sort_member].i;
-}
-
-void array_sort_mem(struct page *page, int member_no)
-{
-	if (!page)
-		return;
-	if (page->type != ARRAY_PAGE || array_type(page->a_type) != AIN_STRUCT)
-		VM_ERROR("A_SORT_MEM called on something other than an array of structs");
-
-	current_sort_member = member_no;
-	qsort(page->values, page->nr_vars, sizeof(union vm_value), array_compare_member);
-}
-
 int array_find(struct page *page, int start, int end, union vm_value v, int compare_fno)
 {
 	if (!page)
@@ -644,7 +627,7 @@ struct page *delegate_append(struct page *dst, int obj, int fun)
 	if (delegate_contains(dst, obj, fun))
 		return dst;
 
-	dst = xrealloc(dst, sizeof(struct page) + sizeof(union vm_value) * (dst->nr_vars + 2));
+	dst = page_reserve(dst, dst->nr_vars + 2);
 	dst->values[dst->nr_vars+0].i = obj;
 	dst->values[dst->nr_vars+1].i = fun;
 	dst->nr_vars += 2;
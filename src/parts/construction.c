@@ -299,12 +299,12 @@ static void build_create_pixel_only(struct parts *parts, struct parts_constructi
 
 static void build_cg(struct parts *parts, struct parts_construction_process *cproc, struct parts_cp_cg *op)
 {
-	struct cg *cg = asset_cg_load(op->no);
+	struct cg *cg = asset_cg_get(op->no);
 	assert(cg);
 	gfx_delete_texture(&cproc->common.texture);
 	gfx_init_texture_with_cg(&cproc->common.texture, cg);
 	parts_set_dims(parts, &cproc->common, cg->metrics.w, cg->metrics.h);
-	cg_free(cg);
+	asset_cg_release(cg);
 }
 
 static void build_fill(struct parts_construction_process *cproc, struct parts_cp_fill *op)
@@ -324,12 +324,12 @@ static void build_fill_amap(struct parts_construction_process *cproc, struct par
 
 static void build_draw_cut_cg(struct parts_construction_process *cproc, struct parts_cp_cut_cg *op)
 {
-	struct cg *cg = asset_cg_load(op->cg_no);
+	struct cg *cg = asset_cg_get(op->cg_no);
 	assert(cg);
 
 	Texture src;
 	gfx_init_texture_with_cg(&src, cg);
-	cg_free(cg);
+	asset_cg_release(cg);
 
 	gfx_copy_stretch_blend_amap(&cproc->common.texture, op->dx, op->dy, op->dw, op->dh,
 			&src, op->sx, op->sy, op->sw, op->sh);
@@ -338,12 +338,12 @@ static void build_draw_cut_cg(struct parts_construction_process *cproc, struct p
 
 static void build_copy_cut_cg(struct parts_construction_process *cproc, struct parts_cp_cut_cg *op)
 {
-	struct cg *cg = asset_cg_load(op->cg_no);
+	struct cg *cg = asset_cg_get(op->cg_no);
 	assert(cg);
 
 	Texture src;
 	gfx_init_texture_with_cg(&src, cg);
-	cg_free(cg);
+	asset_cg_release(cg);
 
 	gfx_copy_stretch_with_alpha_map(&cproc->common.texture, op->dx, op->dy, op->dw, op->dh,
 			&src, op->sx, op->sy, op->sw, op->sh);
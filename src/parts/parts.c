@@ -520,7 +520,6 @@ static bool parts_set_cg(struct parts *parts, struct cg *cg, int cg_no, struct s
 		free_string(parts_cg->name);
 	parts_cg->name = name;
 	parts_dirty(parts);
-	cg_free(cg);
 	return true;
 }
 
@@ -531,7 +530,10 @@ bool parts_set_cg_by_index(struct parts *parts, int cg_no, int state)
 		parts_dirty(parts);
 		return true;
 	}
-	return parts_set_cg(parts, asset_cg_load(cg_no), cg_no, NULL, state);
+	struct cg *cg = asset_cg_get(cg_no);
+	bool r = parts_set_cg(parts, cg, cg_no, NULL, state);
+	asset_cg_release(cg);
+	return r;
 }
 
 bool parts_set_cg_by_name(struct parts *parts, struct string *cg_name, int state)
@@ -543,7 +545,11 @@ bool parts_set_cg_by_name(struct parts *parts, struct string *cg_name, int state
 	}
 	int no;
 	struct cg *cg = asset_cg_load_by_name(cg_name->text, &no);
-	return parts_set_cg(parts, cg, no, string_dup(cg_name), state);
+	if (!cg)
+		return false;
+	bool r = parts_set_cg(parts, cg, no, string_dup(cg_name), state);
+	cg_free(cg);
+	return r;
 }
 
 void parts_set_hgauge_rate(struct parts *parts, float rate, int state)
@@ -611,13 +617,13 @@ static bool parts_numeral_update(struct parts *parts, struct parts_numeral *num)
 	for (int i = 0; i < nr_chars; i++) {
 		if (num->cg[chars[i]].handle)
 			continue;
-		struct cg *cg = asset_cg_load(num->cg_no + chars[i]);
+		struct cg *cg = asset_cg_get(num->cg_no + chars[i]);
 		if (!cg) {
 			WARNING("Failed to load numeral cg: %d", num->cg_no + chars[i]);
 			continue;
 		}
 		gfx_init_texture_with_cg(&num->cg[chars[i]], cg);
-		cg_free(cg);
+		asset_cg_release(cg);
 	}
 
 	// determine output dimensions
@@ -1016,11 +1022,11 @@ bool PE_SetHGaugeCG(int parts_no, struct string *cg_name, int state)
 
 bool PE_SetHGaugeCG_by_index(int parts_no, int cg_no, int state)
 {
-	struct cg *cg = asset_cg_load(cg_no);
+	struct cg *cg = asset_cg_get(cg_no);
 	if (!cg)
 		return false;
 	bool r = set_gauge_cg(parts_no, cg, state, false);
-	cg_free(cg);
+	asset_cg_release(cg);
 	return r;
 }
 
@@ -1056,11 +1062,11 @@ bool PE_SetVGaugeCG(int parts_no, struct string *cg_name, int state)
 
 bool PE_SetVGaugeCG_by_index(int parts_no, int cg_no, int state)
 {
-	struct cg *cg = asset_cg_load(cg_no);
+	struct cg *cg = asset_cg_get(cg_no);
 	if (!cg)
 		return false;
 	bool r = set_gauge_cg(parts_no, cg, state, true);
-	cg_free(cg);
+	asset_cg_release(cg);
 	return r;
 }
 
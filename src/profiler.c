@@ -0,0 +1,417 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "system4.h"
+#include "system4/ain.h"
+#include "system4/file.h"
+#include "system4/instructions.h"
+#include "system4/utfsjis.h"
+
+#include "cJSON.h"
+#include "vm.h"
+#include "vm/profiler.h"
+
+/*
+ * Call tree node. Each distinct call stack gets its own node, so the tree
+ * can be written out directly as folded stacks.
+ */
+struct profile_node {
+	int32_t parent;
+	int32_t first_child;
+	int32_t next_sibling;
+	int32_t libno; // -1 for script functions
+	int32_t fno;
+	uint64_t calls;
+	uint64_t self_ns;
+	uint64_t total_ns;
+};
+
+struct profile_frame {
+	int32_t node;
+	uint64_t start;
+	uint64_t child_ns;
+};
+
+struct function_stats {
+	uint64_t calls;
+	uint64_t self_ns;
+	uint64_t total_ns;
+	// number of open frames for this function (for recursion)
+	int depth;
+};
+
+struct hll_stats {
+	uint64_t calls;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+bool profiler_enabled = false;
+uint64_t profiler_opcode_counts[NR_OPCODES];
+
+static const char *profile_prefix;
+static uint64_t profile_start;
+
+static struct profile_node *nodes = NULL;
+static int nr_nodes = 0;
+static int nodes_size = 0;
+
+static struct profile_frame *frames = NULL;
+static int nr_frames = 0;
+static int frames_size = 0;
+
+static struct function_stats *function_stats = NULL;
+static struct hll_stats **hll_stats = NULL;
+
+static uint64_t profile_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int alloc_node(int parent, int libno, int fno)
+{
+	if (nr_nodes == nodes_size) {
+		nodes_size = nodes_size ? nodes_size * 2 : 1024;
+		nodes = xrealloc_array(nodes, nr_nodes, nodes_size, sizeof(struct profile_node));
+	}
+	nodes[nr_nodes] = (struct profile_node) {
+		.parent = parent,
+		.first_child = -1,
+		.next_sibling = -1,
+		.libno = libno,
+		.fno = fno,
+	};
+	return nr_nodes++;
+}
+
+void profiler_init(const char *prefix)
+{
+	profile_prefix = prefix;
+	profiler_enabled = true;
+	profile_start = profile_time();
+
+	function_stats = xcalloc(ain->nr_functions, sizeof(struct function_stats));
+	hll_stats = xcalloc(ain->nr_libraries, sizeof(struct hll_stats*));
+	for (int i = 0; i < ain->nr_libraries; i++) {
+		hll_stats[i] = xcalloc(ain->libraries[i].nr_functions, sizeof(struct hll_stats));
+	}
+
+	// root node
+	alloc_node(-1, -1, -1);
+}
+
+/*
+ * Find (or create) the child of the current node for the given function.
+ * The child is moved to the front of the sibling list, since the same few
+ * callees tend to be called repeatedly.
+ */
+static int get_child(int parent, int libno, int fno)
+{
+	int prev = -1;
+	for (int i = nodes[parent].first_child; i >= 0; prev = i, i = nodes[i].next_sibling) {
+		if (nodes[i].fno != fno || nodes[i].libno != libno)
+			continue;
+		if (prev >= 0) {
+			nodes[prev].next_sibling = nodes[i].next_sibling;
+			nodes[i].next_sibling = nodes[parent].first_child;
+			nodes[parent].first_child = i;
+		}
+		return i;
+	}
+
+	int child = alloc_node(parent, libno, fno);
+	nodes[child].next_sibling = nodes[parent].first_child;
+	nodes[parent].first_child = child;
+	return child;
+}
+
+static void push_frame(int libno, int fno)
+{
+	int parent = nr_frames > 0 ? frames[nr_frames-1].node : 0;
+	int node = get_child(parent, libno, fno);
+	nodes[node].calls++;
+
+	if (nr_frames == frames_size) {
+		frames_size = frames_size ? frames_size * 2 : 256;
+		frames = xrealloc_array(frames, nr_frames, frames_size, sizeof(struct profile_frame));
+	}
+	frames[nr_frames++] = (struct profile_frame) {
+		.node = node,
+		.start = profile_time(),
+		.child_ns = 0,
+	};
+}
+
+static void pop_frame(void)
+{
+	if (nr_frames == 0)
+		return;
+
+	struct profile_frame *frame = &frames[--nr_frames];
+	struct profile_node *node = &nodes[frame->node];
+	uint64_t elapsed = profile_time() - frame->start;
+	uint64_t self = elapsed - min(frame->child_ns, elapsed);
+	node->total_ns += elapsed;
+	node->self_ns += self;
+	if (nr_frames > 0)
+		frames[nr_frames-1].child_ns += elapsed;
+
+	if (node->libno >= 0) {
+		struct hll_stats *s = &hll_stats[node->libno][node->fno];
+		s->calls++;
+		s->total_ns += elapsed;
+		s->max_ns = max(s->max_ns, elapsed);
+	} else {
+		struct function_stats *s = &function_stats[node->fno];
+		s->calls++;
+		s->self_ns += self;
+		// inclusive time is only counted for the outermost recursive call
+		if (--s->depth == 0)
+			s->total_ns += elapsed;
+	}
+}
+
+void profiler_function_enter(int fno)
+{
+	function_stats[fno].depth++;
+	push_frame(-1, fno);
+}
+
+void profiler_function_leave(void)
+{
+	pop_frame();
+}
+
+void profiler_hll_enter(int libno, int fno)
+{
+	push_frame(libno, fno);
+}
+
+void profiler_hll_leave(void)
+{
+	pop_frame();
+}
+
+void profiler_unwind(void)
+{
+	while (nr_frames > 0)
+		pop_frame();
+}
+
+static char *node_name(struct profile_node *node)
+{
+	if (node->libno >= 0) {
+		struct ain_library *lib = &ain->libraries[node->libno];
+		char *lib_name = sjis2utf(lib->name, 0);
+		char *fun_name = sjis2utf(lib->functions[node->fno].name, 0);
+		size_t len = strlen(lib_name) + strlen(fun_name) + 2;
+		char *name = xmalloc(len);
+		snprintf(name, len, "%s.%s", lib_name, fun_name);
+		free(lib_name);
+		free(fun_name);
+		return name;
+	}
+	return sjis2utf(ain->functions[node->fno].name, 0);
+}
+
+static void write_folded_stack(FILE *f, int node_no)
+{
+	// collect path from the root
+	int depth = 0;
+	for (int i = node_no; i > 0; i = nodes[i].parent)
+		depth++;
+	int *path = xmalloc(depth * sizeof(int));
+	for (int i = node_no, j = depth - 1; i > 0; i = nodes[i].parent, j--)
+		path[j] = i;
+
+	for (int i = 0; i < depth; i++) {
+		char *name = node_name(&nodes[path[i]]);
+		// ';' separates frames and ' ' separates the count
+		for (char *p = name; *p; p++) {
+			if (*p == ';' || *p == ' ')
+				*p = '_';
+		}
+		fprintf(f, i ? ";%s" : "%s", name);
+		free(name);
+	}
+	fprintf(f, " %llu\n", (unsigned long long)(nodes[node_no].self_ns / 1000));
+	free(path);
+}
+
+static bool write_folded(const char *path)
+{
+	FILE *f = file_open_utf8(path, "w");
+	if (!f) {
+		WARNING("Failed to open profile output: %s: %s", path, strerror(errno));
+		return false;
+	}
+	for (int i = 1; i < nr_nodes; i++) {
+		if (nodes[i].self_ns >= 1000)
+			write_folded_stack(f, i);
+	}
+	if (fclose(f)) {
+		WARNING("Error writing profile output: %s: %s", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static int function_stats_compare(const void *_a, const void *_b)
+{
+	const struct function_stats *a = &function_stats[*(const int*)_a];
+	const struct function_stats *b = &function_stats[*(const int*)_b];
+	if (a->self_ns != b->self_ns)
+		return a->self_ns < b->self_ns ? 1 : -1;
+	return 0;
+}
+
+static int opcode_count_compare(const void *_a, const void *_b)
+{
+	uint64_t a = profiler_opcode_counts[*(const int*)_a];
+	uint64_t b = profiler_opcode_counts[*(const int*)_b];
+	if (a != b)
+		return a < b ? 1 : -1;
+	return 0;
+}
+
+static cJSON *functions_to_json(void)
+{
+	int *order = xmalloc(ain->nr_functions * sizeof(int));
+	int n = 0;
+	for (int i = 0; i < ain->nr_functions; i++) {
+		if (function_stats[i].calls)
+			order[n++] = i;
+	}
+	qsort(order, n, sizeof(int), function_stats_compare);
+
+	cJSON *json = cJSON_CreateArray();
+	for (int i = 0; i < n; i++) {
+		struct function_stats *s = &function_stats[order[i]];
+		char *name = sjis2utf(ain->functions[order[i]].name, 0);
+		cJSON *item = cJSON_CreateObject();
+		cJSON_AddStringToObject(item, "name", name);
+		cJSON_AddNumberToObject(item, "calls", s->calls);
+		cJSON_AddNumberToObject(item, "self-us", s->self_ns / 1000);
+		cJSON_AddNumberToObject(item, "total-us", s->total_ns / 1000);
+		cJSON_AddItemToArray(json, item);
+		free(name);
+	}
+	free(order);
+	return json;
+}
+
+static cJSON *opcodes_to_json(void)
+{
+	int order[NR_OPCODES];
+	int n = 0;
+	for (int i = 0; i < NR_OPCODES; i++) {
+		if (profiler_opcode_counts[i])
+			order[n++] = i;
+	}
+	qsort(order, n, sizeof(int), opcode_count_compare);
+
+	cJSON *json = cJSON_CreateArray();
+	for (int i = 0; i < n; i++) {
+		cJSON *item = cJSON_CreateObject();
+		cJSON_AddStringToObject(item, "name", instructions[order[i]].name);
+		cJSON_AddNumberToObject(item, "count", profiler_opcode_counts[order[i]]);
+		cJSON_AddItemToArray(json, item);
+	}
+	return json;
+}
+
+static cJSON *hll_to_json(void)
+{
+	cJSON *json = cJSON_CreateArray();
+	for (int i = 0; i < ain->nr_libraries; i++) {
+		struct ain_library *lib = &ain->libraries[i];
+		for (int j = 0; j < lib->nr_functions; j++) {
+			struct hll_stats *s = &hll_stats[i][j];
+			if (!s->calls)
+				continue;
+			char *lib_name = sjis2utf(lib->name, 0);
+			char *fun_name = sjis2utf(lib->functions[j].name, 0);
+			cJSON *item = cJSON_CreateObject();
+			cJSON_AddStringToObject(item, "library", lib_name);
+			cJSON_AddStringToObject(item, "function", fun_name);
+			cJSON_AddNumberToObject(item, "calls", s->calls);
+			cJSON_AddNumberToObject(item, "total-us", s->total_ns / 1000);
+			cJSON_AddNumberToObject(item, "mean-us", (double)s->total_ns / s->calls / 1000.0);
+			cJSON_AddNumberToObject(item, "max-us", s->max_ns / 1000);
+			cJSON_AddItemToArray(json, item);
+			free(lib_name);
+			free(fun_name);
+		}
+	}
+	return json;
+}
+
+static bool write_summary(const char *path)
+{
+	cJSON *json = cJSON_CreateObject();
+	cJSON_AddNumberToObject(json, "elapsed-us", (profile_time() - profile_start) / 1000);
+	cJSON_AddItemToObject(json, "functions", functions_to_json());
+	cJSON_AddItemToObject(json, "opcodes", opcodes_to_json());
+	cJSON_AddItemToObject(json, "hll", hll_to_json());
+	char *str = cJSON_Print(json);
+	cJSON_Delete(json);
+
+	bool ok = true;
+	FILE *f = file_open_utf8(path, "w");
+	if (!f) {
+		WARNING("Failed to open profile output: %s: %s", path, strerror(errno));
+		free(str);
+		return false;
+	}
+	if (fwrite(str, strlen(str), 1, f) != 1) {
+		WARNING("Failed to write profile output: %s: %s", path, strerror(errno));
+		ok = false;
+	}
+	if (fclose(f)) {
+		WARNING("Error writing profile output: %s: %s", path, strerror(errno));
+		ok = false;
+	}
+	free(str);
+	return ok;
+}
+
+void profiler_write(const char *prefix)
+{
+	if (!profiler_enabled)
+		return;
+	if (!prefix)
+		prefix = profile_prefix;
+
+	size_t len = strlen(prefix) + strlen(".folded") + 1;
+	char *path = xmalloc(len);
+
+	snprintf(path, len, "%s.folded", prefix);
+	bool ok = write_folded(path);
+	snprintf(path, len, "%s.json", prefix);
+	ok = write_summary(path) && ok;
+	if (ok)
+		NOTICE("Wrote profile to %s.folded and %s.json", prefix, prefix);
+
+	free(path);
+}
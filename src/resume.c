@@ -18,22 +18,27 @@
 #define VM_PRIVATE
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <zlib.h>
 #include "cJSON.h"
 
 #include "system4.h"
 #include "system4/file.h"
 #include "system4/string.h"
 
+#include "little_endian.h"
 #include "savedata.h"
+#include "save_writer.h"
 #include "vm.h"
 #include "vm/heap.h"
 #include "vm/page.h"
+#include "vm/profiler.h"
 #include "xsystem4.h"
 
 /*
- * Save/load VM images as JSON.
+ * Save/load VM images as JSON, or in the binary format described below.
  */
 
 static const char * const page_type_strtab[] = {
@@ -85,13 +90,13 @@ static cJSON *resume_page_to_json(struct page *page)
 
 static cJSON *heap_item_to_json(int i, possibly_unused void *_)
 {
-	if (!heap[i].ref)
+	if (!heap_refs[i])
 		return NULL;
 
 	cJSON *item = cJSON_CreateArray();
 	cJSON_AddItemToArray(item, cJSON_CreateNumber(i));
-	cJSON_AddItemToArray(item, cJSON_CreateNumber(heap[i].ref));
-	switch (heap[i].type) {
+	cJSON_AddItemToArray(item, cJSON_CreateNumber(heap_refs[i]));
+	switch (heap_types[i]) {
 	case VM_PAGE:
 		cJSON_AddItemToArray(item, resume_page_to_json(heap[i].page));
 		break;
@@ -112,7 +117,7 @@ static cJSON *funcall_to_json(struct function_call *call)
 	cJSON *json = cJSON_CreateObject();
 	cJSON_AddNumberToObject(json, "function", call->fno);
 	cJSON_AddNumberToObject(json, "return-address", call->return_address);
-	cJSON_AddNumberToObject(json, "local-page", call->page_slot);
+	cJSON_AddNumberToObject(json, "local-page", call_frame_page_slot(call));
 	cJSON_AddNumberToObject(json, "struct-page", call->struct_page);
 	return json;
 }
@@ -137,6 +142,11 @@ static cJSON *stack_to_json(void)
 
 static cJSON *vm_image_to_json(const char *key)
 {
+	// local pages must be on the heap before it is serialized
+	for (int i = 0; i < call_stack_ptr; i++) {
+		call_frame_page_slot(&call_stack[i]);
+	}
+
 	cJSON *image = cJSON_CreateObject();
 	cJSON_AddStringToObject(image, "key", key);
 	cJSON_AddItemToObject(image, "heap", heap_to_json());
@@ -146,12 +156,9 @@ static cJSON *vm_image_to_json(const char *key)
 	return image;
 }
 
-int vm_save_image(const char *key, const char *path)
+static int json_save_image(const char *key, const char *path)
 {
-	cJSON *image = vm_image_to_json(key);
-	int r = save_json(path, image);
-	cJSON_Delete(image);
-	return r;
+	return save_json(path, vm_image_to_json(key));
 }
 
 #define _invalid_save_data(file, func, line, fmt, ...)	\
@@ -216,23 +223,23 @@ static void load_page(int slot, cJSON *json)
 	}
 
 	heap[slot].page = page;
-	heap[slot].type = VM_PAGE;
+	heap_types[slot] = VM_PAGE;
 }
 
 static void load_string(int slot, cJSON *json)
 {
 	const char *str = cJSON_GetStringValue(json);
 	heap[slot].s = make_string(str, strlen(str));
-	heap[slot].type = VM_STRING;
+	heap_types[slot] = VM_STRING;
 }
 
 static void delete_heap(void)
 {
 	// free heap
 	for (size_t i = 0; i < heap_size; i++) {
-		if (!heap[i].ref)
+		if (!heap_refs[i])
 			continue;
-		switch (heap[i].type) {
+		switch (heap_types[i]) {
 		case VM_PAGE:
 			if (heap[i].page)
 				free_page(heap[i].page);
@@ -241,29 +248,18 @@ static void delete_heap(void)
 			free_string(heap[i].s);
 			break;
 		}
-		heap[i].ref = 0;
-	}
-
-	heap_free_ptr = 0;
-	for (size_t i = 0; i < heap_size; i++) {
-		heap_free_stack[i] = i;
+		heap_refs[i] = 0;
 	}
 }
 
 // Allocate a specific heap slot
-// XXX: This only works while heap_free_stack[i]=i
-//      After calling delete_heap, this can be called for INCREASING indices.
-//      Out-of-order allocations would break the above assumption!
+// NOTE: the free lists are rebuilt once the whole heap has been loaded
 static void alloc_heap_slot(int slot)
 {
-	if ((size_t)slot >= heap_size) {
-		size_t next_size = heap_size * 2;
-		while ((size_t)slot >= next_size)
-			next_size *= 2;
-		heap_grow(next_size);
-	}
-	heap_free_stack[slot] = heap_free_stack[heap_free_ptr];
-	heap_free_ptr++;
+	if (slot < 0)
+		invalid_save_data("Invalid heap data");
+	if ((size_t)slot >= heap_size)
+		heap_grow(slot + 1);
 }
 
 static void load_heap(cJSON *json)
@@ -281,19 +277,20 @@ static void load_heap(cJSON *json)
 		cJSON *value = cJSON_GetArrayItem(item, 2);
 
 		alloc_heap_slot(slot);
-		heap[slot].ref = ref;
+		heap_refs[slot] = ref;
 
 		if (cJSON_IsString(value)) {
 			load_string(slot, value);
 		} else if (cJSON_IsObject(value)) {
 			load_page(slot, value);
 		} else if (cJSON_IsNull(value)) {
-			heap[slot].type = VM_PAGE;
+			heap_types[slot] = VM_PAGE;
 			heap[slot].page = NULL;
 		} else {
 			invalid_save_data("Invalid heap data");
 		}
 	}
+	heap_rebuild_free_lists();
 }
 
 static void load_call_stack(cJSON *json)
@@ -302,11 +299,16 @@ static void load_call_stack(cJSON *json)
 	cJSON *item;
 	cJSON_ArrayForEach(item, json) {
 		type_check(cJSON_Object, item);
+		int page_slot = type_check(cJSON_Number, cJSON_GetObjectItem(item, "local-page"))->valueint;
+		if (!heap_index_valid(page_slot))
+			invalid_save_data("Invalid local page");
 		call_stack[call_stack_ptr++] = (struct function_call) {
 			.fno            = type_check(cJSON_Number, cJSON_GetObjectItem(item, "function"))->valueint,
 			.return_address = type_check(cJSON_Number, cJSON_GetObjectItem(item, "return-address"))->valueint,
-			.page_slot      = type_check(cJSON_Number, cJSON_GetObjectItem(item, "local-page"))->valueint,
-			.struct_page    = type_check(cJSON_Number, cJSON_GetObjectItem(item, "struct-page"))->valueint
+			.page_slot      = page_slot,
+			.struct_page    = type_check(cJSON_Number, cJSON_GetObjectItem(item, "struct-page"))->valueint,
+			.page           = heap[page_slot].page,
+			.arena_ptr      = FRAME_NOT_IN_ARENA
 		};
 	}
 }
@@ -325,6 +327,11 @@ static void load_stack(cJSON *json)
 static cJSON *read_image(const char *keyname, const char *path)
 {
 	char *full_path = savedir_path(path);
+	if (!save_writer_flush(full_path)) {
+		WARNING("Last write to save file failed: %s", display_sjis0(path));
+		free(full_path);
+		return NULL;
+	}
 	char *save_file = file_read(full_path, NULL);
 	if (!save_file) {
 		free(save_file);
@@ -342,13 +349,14 @@ static cJSON *read_image(const char *keyname, const char *path)
 	return type_check(cJSON_Object, save);
 }
 
-void vm_load_image(const char *key, const char *path)
+static void json_load_image(const char *key, const char *path)
 {
 	cJSON *save = read_image(key, path);
 	if (!save) {
 		VM_ERROR("Failed to read VM image: '%s'", display_sjis0(path));
 	}
 	cJSON *ip = type_check(cJSON_Number, cJSON_GetObjectItem(save, "ip"));
+	call_frames_detach();
 	load_heap(type_check(cJSON_Array, cJSON_GetObjectItem(save, "heap")));
 	load_call_stack(type_check(cJSON_Array, cJSON_GetObjectItem(save, "call-stack")));
 	load_stack(type_check(cJSON_Array, cJSON_GetObjectItem(save, "stack")));
@@ -356,7 +364,7 @@ void vm_load_image(const char *key, const char *path)
 	cJSON_Delete(save);
 }
 
-struct page *vm_load_image_comments(const char *key, const char *path, int *success)
+static struct page *json_load_image_comments(const char *key, const char *path, int *success)
 {
 	cJSON *save = read_image(key, path);
 	if (!save) {
@@ -393,7 +401,7 @@ struct page *vm_load_image_comments(const char *key, const char *path, int *succ
 	return array;
 }
 
-int vm_write_image_comments(const char *key, const char *path, struct page *comments)
+static int json_write_image_comments(const char *key, const char *path, struct page *comments)
 {
 	cJSON *save = read_image(key, path);
 	if (!save) {
@@ -411,7 +419,692 @@ int vm_write_image_comments(const char *key, const char *path, struct page *comm
 	}
 	cJSON_AddItemToObject(save, "comments", array);
 
-	save_json(path, save);
-	cJSON_Delete(save);
-	return 1;
+	return save_json(path, save);
+}
+
+/*
+ * Binary VM images.
+ *
+ * All integers are 32-bit little-endian, and every field is 4-byte aligned
+ * (strings are padded), so an image can be read in place (e.g. mmap'd).
+ *
+ *   header:  "XS4I" version key-length key
+ *   segment: type flags raw-size stored-size data
+ *
+ * A segment's data is zlib-compressed if SEG_COMPRESSED is set in its flags.
+ * The first VM segment of a file is always a full snapshot. In incremental
+ * mode, later saves to the same file append a delta segment which contains
+ * only the heap slots that changed since the previous save, followed by the
+ * complete call stack and stack. Comments are stored in their own segment
+ * type; the last one wins.
+ *
+ *   VM data: ip nr-freed freed-slot* nr-slots slot* nr-frames frame*
+ *            stack-size value*
+ *   slot:    index ref kind (string: length bytes | page: type subtype
+ *            struct-type rank nr-vars value*)
+ */
+
+#define IMAGE_MAGIC "XS4I"
+#define IMAGE_VERSION 1
+
+enum image_segment_type {
+	SEG_FULL = 1,
+	SEG_DELTA = 2,
+	SEG_COMMENTS = 3,
+};
+
+#define SEG_COMPRESSED 1
+
+enum image_slot_kind {
+	SLOT_NULL_PAGE = 0,
+	SLOT_PAGE = 1,
+	SLOT_STRING = 2,
+};
+
+// Segments smaller than this aren't worth compressing
+#define IMAGE_COMPRESS_THRESHOLD 1024
+
+// Number of delta segments after which a full snapshot is written instead
+#define IMAGE_MAX_DELTAS 16
+
+struct image_writer {
+	uint8_t *buf;
+	size_t len;
+	size_t cap;
+};
+
+struct image_reader {
+	const uint8_t *buf;
+	size_t len;
+	size_t pos;
+};
+
+/*
+ * State of the last binary image written, for incremental saves. Each heap
+ * slot's contents are summarized by a hash; slots whose hash changed are
+ * written in the next delta.
+ */
+static struct {
+	char *path;
+	size_t file_size;
+	int nr_deltas;
+	uint64_t *hashes;
+	size_t nr_hashes;
+} last_image = {0};
+
+static void iw_reserve(struct image_writer *w, size_t n)
+{
+	if (w->len + n <= w->cap)
+		return;
+	size_t cap = w->cap ? w->cap : 4096;
+	while (cap < w->len + n)
+		cap *= 2;
+	w->buf = xrealloc(w->buf, cap);
+	w->cap = cap;
+}
+
+static void iw_int32(struct image_writer *w, int32_t v)
+{
+	iw_reserve(w, 4);
+	LittleEndian_putDW(w->buf, w->len, v);
+	w->len += 4;
+}
+
+static void iw_bytes(struct image_writer *w, const void *data, size_t n)
+{
+	size_t padded = (n + 3) & ~(size_t)3;
+	iw_reserve(w, padded);
+	memcpy(w->buf + w->len, data, n);
+	memset(w->buf + w->len + n, 0, padded - n);
+	w->len += padded;
+}
+
+static void ir_need(struct image_reader *r, size_t n)
+{
+	if (r->len - r->pos < n)
+		invalid_save_data("Truncated VM image");
+}
+
+static int32_t ir_int32(struct image_reader *r)
+{
+	ir_need(r, 4);
+	int32_t v = LittleEndian_getDW(r->buf, r->pos);
+	r->pos += 4;
+	return v;
+}
+
+static const uint8_t *ir_bytes(struct image_reader *r, size_t n)
+{
+	size_t padded = (n + 3) & ~(size_t)3;
+	ir_need(r, padded);
+	const uint8_t *p = r->buf + r->pos;
+	r->pos += padded;
+	return p;
+}
+
+// FNV-1a (64-bit)
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t n)
+{
+	const uint8_t *p = data;
+	for (size_t i = 0; i < n; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+static uint64_t hash_int32(uint64_t h, int32_t v)
+{
+	return hash_bytes(h, &v, sizeof(v));
+}
+
+// Hash of a heap slot's serialized contents (0 for free slots)
+static uint64_t hash_slot(size_t i)
+{
+	if (!heap_refs[i])
+		return 0;
+
+	uint64_t h = 0xcbf29ce484222325ull;
+	h = hash_int32(h, heap_refs[i]);
+	h = hash_int32(h, heap_types[i]);
+	if (heap_types[i] == VM_STRING) {
+		h = hash_bytes(h, heap[i].s->text, heap[i].s->size);
+	} else if (heap[i].page) {
+		struct page *page = heap[i].page;
+		h = hash_int32(h, page->type);
+		h = hash_int32(h, page->index);
+		h = hash_int32(h, page->array.struct_type);
+		h = hash_int32(h, page->array.rank);
+		h = hash_int32(h, page->nr_vars);
+		for (int j = 0; j < page->nr_vars; j++) {
+			h = hash_int32(h, page->values[j].i);
+		}
+	}
+	return h ? h : 1;
+}
+
+static void write_slot(struct image_writer *w, size_t i)
+{
+	iw_int32(w, i);
+	iw_int32(w, heap_refs[i]);
+	if (heap_types[i] == VM_STRING) {
+		iw_int32(w, SLOT_STRING);
+		iw_int32(w, heap[i].s->size);
+		iw_bytes(w, heap[i].s->text, heap[i].s->size);
+	} else if (!heap[i].page) {
+		iw_int32(w, SLOT_NULL_PAGE);
+	} else {
+		struct page *page = heap[i].page;
+		iw_int32(w, SLOT_PAGE);
+		iw_int32(w, page->type);
+		iw_int32(w, page->index);
+		iw_int32(w, page->array.struct_type);
+		iw_int32(w, page->array.rank);
+		iw_int32(w, page->nr_vars);
+		for (int j = 0; j < page->nr_vars; j++) {
+			iw_int32(w, page->values[j].i);
+		}
+	}
+}
+
+/*
+ * Serialize the VM state. If PREV is non-NULL, only slots whose hash differs
+ * from PREV are written (a delta). HASHES receives the hash of every slot.
+ */
+static void write_vm_data(struct image_writer *w, uint64_t *prev, size_t nr_prev, uint64_t *hashes)
+{
+	for (size_t i = 0; i < heap_size; i++) {
+		hashes[i] = hash_slot(i);
+	}
+
+	iw_int32(w, instr_ptr);
+
+	// freed slots
+	size_t count_pos = w->len;
+	int32_t count = 0;
+	iw_int32(w, 0);
+	for (size_t i = 0; prev && i < heap_size; i++) {
+		if (!hashes[i] && i < nr_prev && prev[i]) {
+			iw_int32(w, i);
+			count++;
+		}
+	}
+	LittleEndian_putDW(w->buf, count_pos, count);
+
+	// live slots
+	count_pos = w->len;
+	count = 0;
+	iw_int32(w, 0);
+	for (size_t i = 0; i < heap_size; i++) {
+		if (!hashes[i])
+			continue;
+		if (prev && i < nr_prev && prev[i] == hashes[i])
+			continue;
+		write_slot(w, i);
+		count++;
+	}
+	LittleEndian_putDW(w->buf, count_pos, count);
+
+	iw_int32(w, call_stack_ptr);
+	for (int i = 0; i < call_stack_ptr; i++) {
+		iw_int32(w, call_stack[i].fno);
+		iw_int32(w, call_stack[i].return_address);
+		iw_int32(w, call_frame_page_slot(&call_stack[i]));
+		iw_int32(w, call_stack[i].struct_page);
+	}
+
+	iw_int32(w, stack_ptr);
+	for (int i = 0; i < stack_ptr; i++) {
+		iw_int32(w, stack[i].i);
+	}
+}
+
+static void write_header(struct image_writer *w, const char *key)
+{
+	size_t key_len = strlen(key);
+	iw_bytes(w, IMAGE_MAGIC, 4);
+	iw_int32(w, IMAGE_VERSION);
+	iw_int32(w, key_len);
+	iw_bytes(w, key, key_len);
+}
+
+static void write_segment(struct image_writer *w, enum image_segment_type type, struct image_writer *data)
+{
+	uLongf stored_size = data->len;
+	uint8_t *stored = data->buf;
+	int flags = 0;
+
+	if (data->len >= IMAGE_COMPRESS_THRESHOLD) {
+		uLongf bound = compressBound(data->len);
+		uint8_t *z = xmalloc(bound);
+		if (compress2(z, &bound, data->buf, data->len, Z_BEST_SPEED) == Z_OK && bound < data->len) {
+			stored = z;
+			stored_size = bound;
+			flags |= SEG_COMPRESSED;
+		} else {
+			free(z);
+		}
+	}
+
+	iw_int32(w, type);
+	iw_int32(w, flags);
+	iw_int32(w, data->len);
+	iw_int32(w, stored_size);
+	iw_bytes(w, stored, stored_size);
+	if (stored != data->buf)
+		free(stored);
+}
+
+static bool write_file(const char *full_path, bool append, struct image_writer *w)
+{
+	bool ok = save_writer_write(full_path, w->buf, w->len, append);
+	w->buf = NULL;
+	return ok;
+}
+
+static size_t file_size_or_zero(const char *full_path)
+{
+	// if the last write failed the file is unusable as a delta base
+	if (!save_writer_flush(full_path))
+		return 0;
+	FILE *f = file_open_utf8(full_path, "rb");
+	if (!f)
+		return 0;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size < 0 ? 0 : size;
+}
+
+static void set_last_image(char *full_path, size_t file_size, uint64_t *hashes, size_t nr_hashes)
+{
+	if (last_image.path != full_path)
+		free(last_image.path);
+	free(last_image.hashes);
+	last_image.path = full_path;
+	last_image.file_size = file_size;
+	last_image.hashes = hashes;
+	last_image.nr_hashes = nr_hashes;
+}
+
+static int binary_save_image(const char *key, const char *path, bool incremental)
+{
+	// local pages must be on the heap before it is serialized
+	for (int i = 0; i < call_stack_ptr; i++) {
+		call_frame_page_slot(&call_stack[i]);
+	}
+
+	char *full_path = savedir_path(path);
+	bool delta = incremental
+		&& last_image.path
+		&& !strcmp(last_image.path, full_path)
+		&& last_image.nr_deltas < IMAGE_MAX_DELTAS
+		&& file_size_or_zero(full_path) == last_image.file_size;
+
+	struct image_writer data = {0};
+	struct image_writer out = {0};
+	uint64_t *hashes = xmalloc(heap_size * sizeof(uint64_t));
+	if (delta) {
+		write_vm_data(&data, last_image.hashes, last_image.nr_hashes, hashes);
+		write_segment(&out, SEG_DELTA, &data);
+	} else {
+		write_vm_data(&data, NULL, 0, hashes);
+		write_header(&out, key);
+		write_segment(&out, SEG_FULL, &data);
+	}
+	free(data.buf);
+
+	size_t out_len = out.len;
+	bool ok = write_file(full_path, delta, &out);
+
+	// NOTE: if the write fails, the file size won't match on the next save
+	//       and a full image is written instead of a delta
+	size_t file_size = delta ? last_image.file_size + out_len : out_len;
+	int nr_deltas = delta ? last_image.nr_deltas + 1 : 0;
+	set_last_image(full_path, file_size, hashes, heap_size);
+	last_image.nr_deltas = nr_deltas;
+	return ok;
+}
+
+static bool is_binary_image(const uint8_t *data, size_t size)
+{
+	return size >= 4 && !memcmp(data, IMAGE_MAGIC, 4);
+}
+
+static void read_header(struct image_reader *r, const char *key)
+{
+	ir_bytes(r, 4);
+	int32_t version = ir_int32(r);
+	if (version != IMAGE_VERSION)
+		invalid_save_data("Unsupported VM image version: %d", version);
+	int32_t key_len = ir_int32(r);
+	if (key_len < 0)
+		invalid_save_data("Invalid key length");
+	const uint8_t *image_key = ir_bytes(r, key_len);
+	if ((size_t)key_len != strlen(key) || memcmp(key, image_key, key_len))
+		invalid_save_data("Key doesn't match");
+}
+
+/*
+ * Read the next segment. Returns false at the end of the image. A truncated
+ * segment at the end of the file (e.g. an interrupted incremental save) is
+ * ignored. The segment data is returned in DATA; if it had to be
+ * decompressed, *TO_FREE must be freed by the caller.
+ */
+static bool read_segment(struct image_reader *r, int *type, struct image_reader *data, uint8_t **to_free)
+{
+	*to_free = NULL;
+	if (r->len - r->pos < 16)
+		return false;
+
+	*type = ir_int32(r);
+	int32_t flags = ir_int32(r);
+	uint32_t raw_size = ir_int32(r);
+	uint32_t stored_size = ir_int32(r);
+	if (r->len - r->pos < stored_size) {
+		WARNING("Ignoring truncated segment at end of VM image");
+		r->pos = r->len;
+		return false;
+	}
+	const uint8_t *stored = ir_bytes(r, stored_size);
+
+	if (flags & SEG_COMPRESSED) {
+		uLongf size = raw_size;
+		*to_free = xmalloc(raw_size ? raw_size : 1);
+		if (uncompress(*to_free, &size, stored, stored_size) != Z_OK || size != raw_size)
+			invalid_save_data("Failed to decompress VM image segment");
+		stored = *to_free;
+	} else if (raw_size != stored_size) {
+		invalid_save_data("Corrupt VM image segment");
+	}
+	*data = (struct image_reader) { .buf = stored, .len = raw_size, .pos = 0 };
+	return true;
+}
+
+static void free_slot_contents(int slot)
+{
+	if (!heap_refs[slot])
+		return;
+	if (heap_types[slot] == VM_STRING)
+		free_string(heap[slot].s);
+	else if (heap[slot].page)
+		free_page(heap[slot].page);
+	heap_refs[slot] = 0;
+	heap[slot].page = NULL;
+}
+
+static void read_slot(struct image_reader *r)
+{
+	int32_t slot = ir_int32(r);
+	int32_t ref = ir_int32(r);
+	int32_t kind = ir_int32(r);
+	if (ref <= 0)
+		invalid_save_data("Invalid reference count");
+
+	alloc_heap_slot(slot);
+	free_slot_contents(slot);
+	heap_refs[slot] = ref;
+
+	switch (kind) {
+	case SLOT_STRING: {
+		int32_t len = ir_int32(r);
+		if (len < 0)
+			invalid_save_data("Invalid string length");
+		heap_types[slot] = VM_STRING;
+		heap[slot].s = make_string((const char*)ir_bytes(r, len), len);
+		break;
+	}
+	case SLOT_NULL_PAGE:
+		heap_types[slot] = VM_PAGE;
+		heap[slot].page = NULL;
+		break;
+	case SLOT_PAGE: {
+		int32_t type = ir_int32(r);
+		int32_t subtype = ir_int32(r);
+		int32_t struct_type = ir_int32(r);
+		int32_t rank = ir_int32(r);
+		int32_t nr_vars = ir_int32(r);
+		if (type < 0 || type >= NR_PAGE_TYPES || nr_vars < 0)
+			invalid_save_data("Invalid page");
+		ir_need(r, (size_t)nr_vars * 4);
+		struct page *page = alloc_page(type, subtype, nr_vars);
+		page->array.struct_type = struct_type;
+		page->array.rank = rank;
+		for (int i = 0; i < nr_vars; i++) {
+			page->values[i].i = ir_int32(r);
+		}
+		heap_types[slot] = VM_PAGE;
+		heap[slot].page = page;
+		break;
+	}
+	default:
+		invalid_save_data("Invalid heap slot kind: %d", kind);
+	}
+}
+
+static void read_vm_data(struct image_reader *r, bool full)
+{
+	if (full)
+		delete_heap();
+
+	instr_ptr = ir_int32(r);
+
+	int32_t nr_freed = ir_int32(r);
+	for (int32_t i = 0; i < nr_freed; i++) {
+		int32_t slot = ir_int32(r);
+		if (slot < 0 || (size_t)slot >= heap_size)
+			invalid_save_data("Invalid heap slot: %d", slot);
+		free_slot_contents(slot);
+	}
+
+	int32_t nr_slots = ir_int32(r);
+	for (int32_t i = 0; i < nr_slots; i++) {
+		read_slot(r);
+	}
+
+	call_stack_ptr = 0;
+	int32_t nr_frames = ir_int32(r);
+	if (nr_frames < 0 || (size_t)nr_frames > sizeof(call_stack) / sizeof(call_stack[0]))
+		invalid_save_data("Invalid call stack size");
+	for (int32_t i = 0; i < nr_frames; i++) {
+		int32_t fno = ir_int32(r);
+		int32_t return_address = ir_int32(r);
+		int32_t page_slot = ir_int32(r);
+		int32_t struct_page = ir_int32(r);
+		call_stack[call_stack_ptr++] = (struct function_call) {
+			.fno            = fno,
+			.return_address = return_address,
+			.page_slot      = page_slot,
+			.struct_page    = struct_page,
+			.arena_ptr      = FRAME_NOT_IN_ARENA
+		};
+	}
+
+	stack_ptr = 0;
+	int32_t nr_values = ir_int32(r);
+	if (nr_values < 0)
+		invalid_save_data("Invalid stack size");
+	for (int32_t i = 0; i < nr_values; i++) {
+		stack_push_value(vm_int(ir_int32(r)));
+	}
+}
+
+static void binary_load_image(const char *key, const char *full_path, uint8_t *file, size_t size)
+{
+	struct image_reader r = { .buf = file, .len = size, .pos = 0 };
+	read_header(&r, key);
+
+	call_frames_detach();
+
+	bool have_vm_data = false;
+	int type;
+	struct image_reader data;
+	uint8_t *to_free;
+	while (read_segment(&r, &type, &data, &to_free)) {
+		if (type == SEG_FULL || (type == SEG_DELTA && have_vm_data)) {
+			read_vm_data(&data, type == SEG_FULL);
+			have_vm_data = true;
+		} else if (type == SEG_DELTA) {
+			invalid_save_data("Delta segment without a full snapshot");
+		}
+		free(to_free);
+	}
+	if (!have_vm_data)
+		invalid_save_data("VM image contains no VM data");
+
+	heap_rebuild_free_lists();
+	for (int i = 0; i < call_stack_ptr; i++) {
+		struct function_call *call = &call_stack[i];
+		if (!page_index_valid(call->page_slot))
+			invalid_save_data("Invalid local page");
+		call->page = heap[call->page_slot].page;
+	}
+
+	// subsequent incremental saves to this file can be deltas against the
+	// loaded state
+	uint64_t *hashes = xmalloc(heap_size * sizeof(uint64_t));
+	for (size_t i = 0; i < heap_size; i++) {
+		hashes[i] = hash_slot(i);
+	}
+	set_last_image(xstrdup(full_path), size, hashes, heap_size);
+	last_image.nr_deltas = 0;
+}
+
+static struct page *binary_load_image_comments(const char *key, uint8_t *file, size_t size, int *success)
+{
+	struct image_reader r = { .buf = file, .len = size, .pos = 0 };
+	read_header(&r, key);
+
+	struct page *array = NULL;
+	int type;
+	struct image_reader data;
+	uint8_t *to_free;
+	while (read_segment(&r, &type, &data, &to_free)) {
+		if (type != SEG_COMMENTS) {
+			free(to_free);
+			continue;
+		}
+		if (array) {
+			delete_page_vars(array);
+			free_page(array);
+			array = NULL;
+		}
+		int32_t nr_comments = ir_int32(&data);
+		if (nr_comments > 0) {
+			union vm_value dims = { .i = nr_comments };
+			array = alloc_array(1, &dims, AIN_ARRAY_STRING, 0, false);
+			for (int i = 0; i < nr_comments; i++) {
+				int32_t len = ir_int32(&data);
+				if (len < 0)
+					invalid_save_data("Invalid string length");
+				const char *str = (const char*)ir_bytes(&data, len);
+				int slot = heap_alloc_slot(VM_STRING);
+				heap[slot].s = len ? make_string(str, len) : string_ref(&EMPTY_STRING);
+				array->values[i].i = slot;
+			}
+		}
+		free(to_free);
+	}
+
+	*success = 1;
+	return array;
+}
+
+static int binary_write_image_comments(const char *key, const char *full_path, struct page *comments)
+{
+	struct image_writer data = {0};
+	struct image_writer out = {0};
+
+	iw_int32(&data, comments->nr_vars);
+	for (int i = 0; i < comments->nr_vars; i++) {
+		struct string *s = heap_get_string(comments->values[i].i);
+		iw_int32(&data, s->size);
+		iw_bytes(&data, s->text, s->size);
+	}
+	write_segment(&out, SEG_COMMENTS, &data);
+	free(data.buf);
+
+	if (last_image.path && !strcmp(last_image.path, full_path))
+		last_image.file_size += out.len;
+	return write_file(full_path, true, &out);
+}
+
+int vm_save_image(const char *key, const char *path)
+{
+	switch (config.resume_format) {
+	case RESUME_FORMAT_BINARY:
+		return binary_save_image(key, path, false);
+	case RESUME_FORMAT_INCREMENTAL:
+		return binary_save_image(key, path, true);
+	case RESUME_FORMAT_JSON:
+	default:
+		return json_save_image(key, path);
+	}
+}
+
+// Read an image file if it is in the binary format
+static uint8_t *read_binary_image(const char *full_path, size_t *size)
+{
+	if (!save_writer_flush(full_path))
+		return NULL;
+	uint8_t *file = file_read(full_path, size);
+	if (file && !is_binary_image(file, *size)) {
+		free(file);
+		return NULL;
+	}
+	return file;
+}
+
+void vm_load_image(const char *key, const char *path)
+{
+	size_t size;
+	char *full_path = savedir_path(path);
+	uint8_t *file = read_binary_image(full_path, &size);
+	if (file) {
+		binary_load_image(key, full_path, file, size);
+		free(file);
+	} else {
+		json_load_image(key, path);
+	}
+	free(full_path);
+
+	// the frames the profiler had open belong to the discarded call stack
+	if (profiler_enabled) {
+		profiler_unwind();
+		for (int i = 0; i < call_stack_ptr; i++) {
+			profiler_function_enter(call_stack[i].fno);
+		}
+	}
+}
+
+struct page *vm_load_image_comments(const char *key, const char *path, int *success)
+{
+	size_t size;
+	char *full_path = savedir_path(path);
+	uint8_t *file = read_binary_image(full_path, &size);
+	free(full_path);
+	if (file) {
+		struct page *comments = binary_load_image_comments(key, file, size, success);
+		free(file);
+		return comments;
+	}
+	return json_load_image_comments(key, path, success);
+}
+
+int vm_write_image_comments(const char *key, const char *path, struct page *comments)
+{
+	size_t size;
+	char *full_path = savedir_path(path);
+	uint8_t *file = read_binary_image(full_path, &size);
+	int r;
+	if (file) {
+		struct image_reader reader = { .buf = file, .len = size, .pos = 0 };
+		read_header(&reader, key);
+		free(file);
+		r = binary_write_image_comments(key, full_path, comments);
+	} else {
+		r = json_write_image_comments(key, path, comments);
+	}
+	free(full_path);
+	return r;
 }
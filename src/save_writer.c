@@ -0,0 +1,292 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <SDL.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "system4.h"
+#include "system4/file.h"
+
+#include "save_writer.h"
+#include "xsystem4.h"
+
+struct save_job {
+	struct save_job *next;
+	char *path;
+	cJSON *json;
+	void *data;
+	size_t size;
+	bool append;
+};
+
+// paths whose most recent write failed
+struct failed_path {
+	struct failed_path *next;
+	char *path;
+};
+
+static SDL_Thread *worker;
+static SDL_mutex *mutex;
+static SDL_cond *job_cond;
+static SDL_cond *idle_cond;
+static struct save_job *queue_head;
+static struct save_job *queue_tail;
+static bool worker_busy;
+static bool worker_quit;
+static struct failed_path *failed_paths;
+static bool initialized;
+
+static bool sync_file(FILE *f)
+{
+	if (fflush(f))
+		return false;
+#ifdef _WIN32
+	return !_commit(_fileno(f));
+#else
+	return !fsync(fileno(f));
+#endif
+}
+
+static bool replace_file(const char *src, const char *dst)
+{
+#ifdef _WIN32
+	// rename() doesn't replace existing files on Windows
+	wchar_t wsrc[MAX_PATH], wdst[MAX_PATH];
+	if (!MultiByteToWideChar(CP_UTF8, 0, src, -1, wsrc, MAX_PATH)
+			|| !MultiByteToWideChar(CP_UTF8, 0, dst, -1, wdst, MAX_PATH))
+		return false;
+	return MoveFileExW(wsrc, wdst, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+	return !rename(src, dst);
+#endif
+}
+
+// NOTE: these run on the worker thread; display_utf0 isn't thread safe
+static bool write_data(const char *path, const void *data, size_t size, const char *mode)
+{
+	FILE *f = file_open_utf8(path, mode);
+	if (!f) {
+		WARNING("Failed to open save file: %s: %s", path, strerror(errno));
+		return false;
+	}
+	bool ok = (!size || fwrite(data, size, 1, f) == 1) && sync_file(f);
+	if (fclose(f) || !ok) {
+		WARNING("Error writing save file: %s: %s", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static bool write_atomic(const char *path, const void *data, size_t size)
+{
+	size_t len = strlen(path);
+	char *tmp = xmalloc(len + 5);
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", 5);
+
+	bool ok = write_data(tmp, data, size, "wb");
+	if (ok && !(ok = replace_file(tmp, path))) {
+		WARNING("Failed to replace save file: %s: %s", path, strerror(errno));
+	}
+	if (!ok)
+		remove(tmp);
+	free(tmp);
+	return ok;
+}
+
+static bool run_job(struct save_job *job)
+{
+	if (job->json) {
+		char *str = cJSON_Print(job->json);
+		bool ok = write_atomic(job->path, str, strlen(str));
+		free(str);
+		return ok;
+	}
+	if (job->append)
+		return write_data(job->path, job->data, job->size, "ab");
+	return write_atomic(job->path, job->data, job->size);
+}
+
+static bool path_failed(const char *path)
+{
+	for (struct failed_path *p = failed_paths; p; p = p->next) {
+		if (!strcmp(p->path, path))
+			return true;
+	}
+	return false;
+}
+
+// NOTE: called with the mutex held (if there is a worker)
+static void record_result(struct save_job *job, bool ok)
+{
+	if (!ok) {
+		if (path_failed(job->path))
+			return;
+		struct failed_path *p = xmalloc(sizeof(struct failed_path));
+		p->path = xstrdup(job->path);
+		p->next = failed_paths;
+		failed_paths = p;
+		return;
+	}
+	// an append on top of a failed write doesn't repair the file; only a
+	// successful whole-file write does
+	if (job->append)
+		return;
+	for (struct failed_path **p = &failed_paths; *p; p = &(*p)->next) {
+		if (!strcmp((*p)->path, job->path)) {
+			struct failed_path *tmp = *p;
+			*p = tmp->next;
+			free(tmp->path);
+			free(tmp);
+			return;
+		}
+	}
+}
+
+static void free_job(struct save_job *job)
+{
+	cJSON_Delete(job->json);
+	free(job->data);
+	free(job->path);
+	free(job);
+}
+
+static int worker_main(void *_)
+{
+	SDL_LockMutex(mutex);
+	while (true) {
+		while (!queue_head && !worker_quit)
+			SDL_CondWait(job_cond, mutex);
+		if (!queue_head)
+			break;
+
+		struct save_job *job = queue_head;
+		queue_head = job->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		worker_busy = true;
+		SDL_UnlockMutex(mutex);
+
+		bool ok = run_job(job);
+
+		SDL_LockMutex(mutex);
+		record_result(job, ok);
+		free_job(job);
+		worker_busy = false;
+		if (!queue_head)
+			SDL_CondBroadcast(idle_cond);
+	}
+	SDL_UnlockMutex(mutex);
+	return 0;
+}
+
+static void save_writer_fini(void)
+{
+	if (!worker)
+		return;
+	SDL_LockMutex(mutex);
+	worker_quit = true;
+	SDL_CondSignal(job_cond);
+	SDL_UnlockMutex(mutex);
+	// the worker drains the queue before exiting
+	SDL_WaitThread(worker, NULL);
+	worker = NULL;
+}
+
+static void save_writer_init(void)
+{
+	initialized = true;
+	if (!(mutex = SDL_CreateMutex())
+			|| !(job_cond = SDL_CreateCond())
+			|| !(idle_cond = SDL_CreateCond())
+			|| !(worker = SDL_CreateThread(worker_main, "save writer", NULL))) {
+		WARNING("Failed to start save writer thread: %s", SDL_GetError());
+		return;
+	}
+	atexit(save_writer_fini);
+}
+
+static bool queue_job(struct save_job *job)
+{
+	if (!initialized)
+		save_writer_init();
+
+	// write synchronously if the worker couldn't be started
+	if (!worker) {
+		bool ok = !(job->append && path_failed(job->path)) && run_job(job);
+		record_result(job, ok);
+		free_job(job);
+		return ok;
+	}
+
+	SDL_LockMutex(mutex);
+	if (job->append && path_failed(job->path)) {
+		// appending to a file whose last write failed would corrupt it
+		SDL_UnlockMutex(mutex);
+		WARNING("Not appending to save file after failed write: %s", display_utf0(job->path));
+		free_job(job);
+		return false;
+	}
+	if (queue_tail)
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+	SDL_CondSignal(job_cond);
+	SDL_UnlockMutex(mutex);
+	return true;
+}
+
+bool save_writer_write_json(const char *full_path, cJSON *json)
+{
+	struct save_job *job = xcalloc(1, sizeof(struct save_job));
+	job->path = xstrdup(full_path);
+	job->json = json;
+	return queue_job(job);
+}
+
+bool save_writer_write(const char *full_path, void *data, size_t size, bool append)
+{
+	struct save_job *job = xcalloc(1, sizeof(struct save_job));
+	job->path = xstrdup(full_path);
+	job->data = data;
+	job->size = size;
+	job->append = append;
+	return queue_job(job);
+}
+
+bool save_writer_flush(const char *full_path)
+{
+	if (!worker)
+		return !path_failed(full_path);
+
+	SDL_LockMutex(mutex);
+	while (queue_head || worker_busy)
+		SDL_CondWait(idle_cond, mutex);
+	bool ok = !path_failed(full_path);
+	SDL_UnlockMutex(mutex);
+	return ok;
+}
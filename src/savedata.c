@@ -25,7 +25,9 @@
 #include "system4/file.h"
 #include "system4/string.h"
 
+#include "json_stream.h"
 #include "savedata.h"
+#include "save_writer.h"
 #include "vm.h"
 #include "vm/heap.h"
 #include "vm/page.h"
@@ -77,72 +79,107 @@ cJSON *vm_value_to_json(enum ain_data_type type, union vm_value val)
 	}
 }
 
-struct global_save_data {
-	cJSON *save;
-	cJSON *globals;
-};
+static void write_page(struct json_writer *w, struct page *page);
 
-static void init_global_save_data(struct global_save_data *data, const char *keyname)
+// Same output as vm_value_to_json() + cJSON_Print()
+static void write_vm_value(struct json_writer *w, enum ain_data_type type, union vm_value val)
 {
-	data->save = cJSON_CreateObject();
-	data->globals = cJSON_CreateArray();
-	cJSON_AddStringToObject(data->save, "key", keyname);
-	cJSON_AddItemToObject(data->save, "globals", data->globals);
+	switch (type) {
+	case AIN_INT:
+	case AIN_BOOL:
+	case AIN_FUNC_TYPE:
+	case AIN_DELEGATE:
+	case AIN_LONG_INT:
+		json_write_int(w, val.i);
+		break;
+	case AIN_FLOAT:
+		json_write_number(w, val.f);
+		break;
+	case AIN_STRING:
+		json_write_string(w, heap[val.i].s->text);
+		break;
+	case AIN_STRUCT:
+	case AIN_ARRAY_TYPE:
+		write_page(w, heap_get_page(val.i));
+		break;
+	case AIN_REF_TYPE:
+		json_write_int(w, -1);
+		break;
+	default:
+		WARNING("Unhandled type: %s", ain_strtype(ain, type, -1));
+		json_write_null(w);
+		break;
+	}
+}
+
+static void write_page(struct json_writer *w, struct page *page)
+{
+	if (!page) {
+		json_write_null(w);
+		return;
+	}
+	json_begin_array(w);
+	for (int i = 0; i < page->nr_vars; i++) {
+		write_vm_value(w, variable_type(page, i, NULL, NULL), page->values[i]);
+	}
+	json_end_array(w);
+}
+
+static void begin_global_save_data(struct json_writer *w, const char *keyname)
+{
+	json_writer_init(w);
+	json_begin_object(w);
+	json_write_key(w, "key");
+	json_write_string(w, keyname);
+	json_write_key(w, "globals");
+	json_begin_array(w);
 }
 
-static void add_global(struct global_save_data *data, int global, union vm_value val)
+static void add_global(struct json_writer *w, int global, union vm_value val)
 {
-	cJSON *obj = cJSON_CreateObject();
-	cJSON_AddNumberToObject(obj, "index", global);
-	cJSON_AddItemToObject(obj, "value", vm_value_to_json(ain->globals[global].type.data, val));
-	cJSON_AddItemToArray(data->globals, obj);
+	json_begin_object(w);
+	json_write_key(w, "index");
+	json_write_int(w, global);
+	json_write_key(w, "value");
+	write_vm_value(w, ain->globals[global].type.data, val);
+	json_end_object(w);
 }
 
 int save_json(const char *filename, cJSON *json)
 {
 	char *path = savedir_path(filename);
-	FILE *f = file_open_utf8(path, "w");
-	if (!f) {
-		WARNING("Failed to open save file: %s: %s", display_utf0(filename), strerror(errno));
-		free(path);
-		return 0;
-	}
+	bool ok = save_writer_write_json(path, json);
 	free(path);
-
-	char *str = cJSON_Print(json);
-
-	if (fwrite(str, strlen(str), 1, f) != 1) {
-		WARNING("Failed to write save file: %s", strerror(errno));
-		free(str);
-		return 0;
-	}
-	if (fclose(f)) {
-		WARNING("Error writing save to file: %s: %s", display_utf0(filename), strerror(errno));
-		free(str);
-		return 0;
-	}
-	free(str);
-	return 1;
-
+	return ok;
 }
 
-static int write_save_data(struct global_save_data *data, const char *filename)
+/*
+ * The save data is rendered straight into a buffer, which is handed off to
+ * the save writer.
+ */
+static int write_save_data(struct json_writer *w, const char *filename)
 {
-	int r = save_json(filename, data->save);
-	cJSON_Delete(data->save);
-	return r;
+	json_end_array(w);
+	json_end_object(w);
+
+	size_t len;
+	char *buf = json_writer_finish(w, &len);
+	char *path = savedir_path(filename);
+	bool ok = save_writer_write(path, buf, len, false);
+	free(path);
+	return ok;
 }
 
 int save_globals(const char *keyname, const char *filename)
 {
-	struct global_save_data data;
-	init_global_save_data(&data, keyname);
+	struct json_writer w;
+	begin_global_save_data(&w, keyname);
 
 	for (int i = 0; i < ain->nr_globals; i++) {
-		add_global(&data, i, global_get(i));
+		add_global(&w, i, global_get(i));
 	}
 
-	return write_save_data(&data, filename);
+	return write_save_data(&w, filename);
 }
 
 static int get_group_index(const char *name)
@@ -163,18 +200,18 @@ int save_group(const char *keyname, const char *filename, const char *group_name
 		return 0;
 	}
 
-	struct global_save_data data;
-	init_global_save_data(&data, keyname);
+	struct json_writer w;
+	begin_global_save_data(&w, keyname);
 
 	*n = 0;
 	for (int i = 0; i < ain->nr_globals; i++) {
 		if (ain->globals[i].group_index != group)
 			continue;
-		add_global(&data, i, global_get(i));
+		add_global(&w, i, global_get(i));
 		(*n)++;
 	}
 
-	return write_save_data(&data, filename);
+	return write_save_data(&w, filename);
 }
 
 union vm_value json_to_vm_value(enum ain_data_type type, enum ain_data_type struct_type, int array_rank, cJSON *json);
@@ -273,101 +310,276 @@ union vm_value json_to_vm_value(enum ain_data_type type, enum ain_data_type stru
 	}
 }
 
-static cJSON *read_save_file(const char *filename)
-{
-	FILE *f;
-	long len;
-	char *buf;
-	char *path = savedir_path(filename);
+/*
+ * Streaming loader for GlobalSave/GroupSave files. The file is parsed twice:
+ * once to check that it is well formed (so that a corrupt file doesn't leave
+ * the globals half-loaded), and once to load the values.
+ */
 
-	if (!(f = file_open_utf8(path, "rb"))) {
-		WARNING("Failed to open save file: %s: %s", display_utf0(filename), strerror(errno));
-		free(path);
-		return NULL;
-	}
-	free(path);
+#define invalid_stream_data(msg) \
+	WARNING("Invalid save data (%d): " msg, current_global)
 
-	fseek(f, 0, SEEK_END);
-	len = ftell(f);
-	fseek(f, 0, SEEK_SET);
+static union vm_value stream_to_vm_value(struct json_reader *r, enum json_token token,
+		enum ain_data_type type, int struct_type, int array_rank);
 
-	buf = xmalloc(len+1);
-	buf[len] = '\0';
-	if (fread(buf, len, 1, f) != 1) {
-		WARNING("Failed to read save file: %s", display_utf0(filename));
-		free(buf);
-		return 0;
+static void stream_load_struct(struct json_reader *r, struct page *page)
+{
+	enum json_token token;
+	int i = 0;
+	while ((token = json_read(r)) != JSON_ARRAY_END) {
+		if (token == JSON_ERROR || token == JSON_END)
+			return;
+		if (i >= page->nr_vars) {
+			json_skip(r, token);
+			i++;
+			continue;
+		}
+		int struct_type, array_rank;
+		enum ain_data_type data_type = variable_type(page, i, &struct_type, &array_rank);
+		page->values[i] = stream_to_vm_value(r, token, data_type, struct_type, array_rank);
+		i++;
 	}
-	fclose(f);
+	if (i != page->nr_vars)
+		invalid_stream_data("Wrong number of struct members");
+}
 
-	cJSON *r = cJSON_Parse(buf);
-	free(buf);
-	return r;
+static struct page *stream_load_array(struct json_reader *r, enum ain_data_type type,
+		int struct_type, int array_rank)
+{
+	// the length isn't known up front, so the page grows as values are read
+	union vm_value zero = vm_int(0);
+	struct page *page = alloc_array(array_rank, &zero, type, struct_type, false);
+	enum json_token token;
+	while ((token = json_read(r)) != JSON_ARRAY_END) {
+		if (token == JSON_ERROR || token == JSON_END)
+			break;
+		int i = page->nr_vars;
+		page = page_reserve(page, i + 1);
+		page->nr_vars = i + 1;
+
+		int elem_struct_type, elem_rank;
+		enum ain_data_type elem_type = variable_type(page, i, &elem_struct_type, &elem_rank);
+		page->values[i] = stream_to_vm_value(r, token, elem_type, elem_struct_type, elem_rank);
+	}
+	return page;
 }
 
-int load_globals(const char *keyname, const char *filename, const char *group_name, int *n)
+// Same as json_to_vm_value(), for the value starting with TOKEN
+static union vm_value stream_to_vm_value(struct json_reader *r, enum json_token token,
+		enum ain_data_type type, int struct_type, int array_rank)
 {
-	int retval = 0;
-	cJSON *save = read_save_file(filename);
-	if (!save)
-		return 0;
-	if (!cJSON_IsObject(save)) {
-		invalid_save_data("Not an object", save);
-		goto cleanup;
+	int slot;
+	switch (type) {
+	case AIN_INT:
+	case AIN_BOOL:
+	case AIN_LONG_INT:
+		if (token != JSON_NUMBER) {
+			invalid_stream_data("Not a number");
+			json_skip(r, token);
+			return vm_int(0);
+		}
+		return vm_int(json_reader_int(r));
+	case AIN_FLOAT:
+		if (token != JSON_NUMBER) {
+			invalid_stream_data("Not a number");
+			json_skip(r, token);
+			return vm_float(0);
+		}
+		return vm_float(r->number);
+	case AIN_STRING:
+		slot = heap_alloc_slot(VM_STRING);
+		if (token != JSON_STRING) {
+			invalid_stream_data("Not a string");
+			json_skip(r, token);
+			heap[slot].s = string_ref(&EMPTY_STRING);
+		} else if (!r->str[0]) {
+			heap[slot].s = string_ref(&EMPTY_STRING);
+		} else {
+			heap[slot].s = make_string(r->str, strlen(r->str));
+		}
+		return vm_int(slot);
+	case AIN_STRUCT:
+		slot = alloc_struct(struct_type);
+		if (token != JSON_ARRAY_BEGIN) {
+			invalid_stream_data("Not an array");
+			json_skip(r, token);
+		} else {
+			stream_load_struct(r, heap[slot].page);
+		}
+		return vm_int(slot);
+	case AIN_ARRAY_TYPE:
+		slot = heap_alloc_slot(VM_PAGE);
+		heap[slot].page = NULL;
+		if (token == JSON_NULL)
+			return vm_int(slot);
+		if (token != JSON_ARRAY_BEGIN) {
+			invalid_stream_data("Not an array");
+			json_skip(r, token);
+			return vm_int(slot);
+		}
+		heap[slot].page = stream_load_array(r, type, struct_type, array_rank);
+		return vm_int(slot);
+	case AIN_REF_TYPE:
+		json_skip(r, token);
+		return vm_int(-1);
+	default:
+		WARNING("Unhandled data type: %s", ain_strtype(ain, type, -1));
+		json_skip(r, token);
+		return vm_int(-1);
 	}
+}
 
-	cJSON *key = cJSON_GetObjectItem(save, "key");
-	if (!key || strcmp(keyname, cJSON_GetStringValue(key)))
-		VM_ERROR("Attempted to load save data with wrong key: %s", display_sjis0(keyname));
+// First pass: check syntax and the key.
+static bool check_save_file(struct json_reader *r, const char *keyname)
+{
+	enum json_token token;
+	bool key_ok = false;
 
-	if (group_name) {
-		// TODO?
+	if ((token = json_read(r)) != JSON_OBJECT_BEGIN) {
+		if (token != JSON_ERROR)
+			WARNING("Invalid save data: Not an object");
+		goto error;
+	}
+	while ((token = json_read(r)) == JSON_KEY) {
+		bool is_key = !strcmp(r->str, "key");
+		token = json_read(r);
+		if (is_key && token == JSON_STRING)
+			key_ok = !strcmp(r->str, keyname);
+		if (!json_skip(r, token))
+			goto error;
 	}
+	if (token != JSON_OBJECT_END || json_read(r) != JSON_END)
+		goto error;
 
-	cJSON *globals = cJSON_GetObjectItem(save, "globals");
-	if (!globals || !cJSON_IsArray(globals)) {
-		invalid_save_data("Not an array", globals);
-		goto cleanup;
+	if (!key_ok)
+		VM_ERROR("Attempted to load save data with wrong key: %s", display_sjis0(keyname));
+	return true;
+error:
+	if (r->error)
+		WARNING("Failed to parse save file: %s", r->error);
+	return false;
+}
+
+// Load a single {"index": ..., "value": ...} object from the "globals" array.
+static bool stream_load_global(struct json_reader *r, int *n)
+{
+	enum json_token token;
+	int i = -1;
+	bool have_value = false;
+
+	while ((token = json_read(r)) == JSON_KEY) {
+		bool is_index = !strcmp(r->str, "index");
+		bool is_value = !strcmp(r->str, "value");
+		token = json_read(r);
+		if (is_index && i < 0) {
+			if (token != JSON_NUMBER) {
+				invalid_stream_data("Not a number");
+				return false;
+			}
+			i = json_reader_int(r);
+			if (i < 0 || i >= ain->nr_globals) {
+				invalid_stream_data("Invalid global index");
+				return false;
+			}
+			current_global = i;
+		} else if (is_value && !have_value) {
+			if (i < 0) {
+				invalid_stream_data("Missing index");
+				return false;
+			}
+			bool call_dtors = false; // Destructors for old objects are not called.
+			struct ain_type *t = &ain->globals[i].type;
+			global_set(i, stream_to_vm_value(r, token, t->data, t->struc, t->rank), call_dtors);
+			have_value = true;
+			if (n)
+				(*n)++;
+		} else {
+			json_skip(r, token);
+		}
+	}
+	if (token != JSON_OBJECT_END)
+		return false;
+	if (i < 0) {
+		invalid_stream_data("Missing index");
+		return false;
 	}
+	if (!have_value) {
+		invalid_stream_data("Missing value");
+		return false;
+	}
+	return true;
+}
 
-	cJSON *g;
-	cJSON_ArrayForEach(g, globals) {
-		cJSON *index, *value;
-		if (!(index = cJSON_GetObjectItem(g, "index"))) {
-			invalid_save_data("Missing index", g);
-			goto cleanup;
+// Second pass: load the globals.
+static bool stream_load_globals(struct json_reader *r, int *n)
+{
+	enum json_token token;
+	bool have_globals = false;
+
+	json_read(r); // JSON_OBJECT_BEGIN
+	while ((token = json_read(r)) == JSON_KEY) {
+		if (strcmp(r->str, "globals") || have_globals) {
+			json_skip(r, json_read(r));
+			continue;
 		}
-		if (!(value = cJSON_GetObjectItem(g, "value"))) {
-			invalid_save_data("Missing value", g);
-			goto cleanup;
+		have_globals = true;
+		if ((token = json_read(r)) != JSON_ARRAY_BEGIN) {
+			invalid_stream_data("Not an array");
+			return false;
 		}
-		if (!cJSON_IsNumber(index)) {
-			invalid_save_data("Not a number", index);
-			goto cleanup;
+		while ((token = json_read(r)) != JSON_ARRAY_END) {
+			if (token != JSON_OBJECT_BEGIN) {
+				invalid_stream_data("Missing index");
+				return false;
+			}
+			if (!stream_load_global(r, n))
+				return false;
 		}
+	}
+	if (!have_globals) {
+		invalid_stream_data("Not an array");
+		return false;
+	}
+	return true;
+}
 
-		int i = index->valueint;
-		if (i < 0 || i > ain->nr_globals) {
-			invalid_save_data("Invalid global index", index);
-			goto cleanup;
-		}
-		current_global = i;
+int load_globals(const char *keyname, const char *filename, const char *group_name, int *n)
+{
+	char *path = savedir_path(filename);
+	if (!save_writer_flush(path)) {
+		WARNING("Last write to save file failed: %s", display_utf0(filename));
+		free(path);
+		return 0;
+	}
+	FILE *f = file_open_utf8(path, "rb");
+	if (!f) {
+		WARNING("Failed to open save file: %s: %s", display_utf0(filename), strerror(errno));
+		free(path);
+		return 0;
+	}
+	free(path);
 
-		bool call_dtors = false; // Destructors for old objects are not called.
-		global_set(i, json_to_vm_value(ain->globals[i].type.data, ain->globals[i].type.struc, ain->globals[i].type.rank, value), call_dtors);
-		if (n)
-			(*n)++;
+	if (group_name) {
+		// TODO?
 	}
 
-	retval = 1;
-cleanup:
-	cJSON_Delete(save);
+	int retval = 0;
+	struct json_reader r;
+	json_reader_init(&r, f);
+	if (check_save_file(&r, keyname)) {
+		json_reader_rewind(&r);
+		retval = stream_load_globals(&r, n);
+	}
+	json_reader_fini(&r);
+	fclose(f);
 	return retval;
 }
 
 int delete_save_file(const char *filename)
 {
 	char *path = savedir_path(filename);
+	// a failed earlier write doesn't matter if the file is being deleted
+	(void)save_writer_flush(path);
 	if (!file_exists(path)) {
 		free(path);
 		return 0;
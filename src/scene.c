@@ -23,50 +23,197 @@
 
 #include "asset_manager.h"
 #include "gfx/gfx.h"
-#include "queue.h"
 #include "scene.h"
 #include "xsystem4.h"
 
 bool scene_is_dirty = true;
+// true when the whole scene must be redrawn, rather than just the damaged
+// areas of sprites
+bool scene_damage_all = true;
 
-static TAILQ_HEAD(listhead, sprite) sprite_list = TAILQ_HEAD_INITIALIZER(sprite_list);
+/*
+ * Damage tracking.
+ *
+ * When a sprite changes, both the area it covered when it was last drawn
+ * and the area it covers now are added to the damage list, and only the
+ * damaged areas of the main surface are redrawn (with scissoring) on the
+ * next call to scene_render. The list is kept short by merging overlapping
+ * rectangles; if it overflows, everything is merged into one rectangle.
+ */
+#define MAX_DAMAGE_RECTS 8
+static Rectangle damage[MAX_DAMAGE_RECTS];
+static int nr_damage = 0;
+
+// version of the main surface after the last scene_render
+static unsigned main_surface_version = 0;
+
+/*
+ * Sprites in the scene are kept in a skiplist ordered by (z, z2, seq), where
+ * seq increases each time a sprite is registered. This is the same order the
+ * scene has always been rendered in (sprites with equal z/z2 are drawn in
+ * the order they were added) but insertion, removal and changing a sprite's
+ * Z-layer take O(log n) time rather than O(n).
+ */
+static struct sprite *scene_head[SCENE_MAX_LEVEL];
+static int scene_level = 1;
+static uint64_t scene_seq = 0;
+
+#define SCENE_FOREACH(sp) \
+	for (sp = scene_head[0]; sp; sp = sp->scene_node.next[0])
+
+static struct sprite **forward(struct sprite *sp)
+{
+	return sp ? sp->scene_node.next : scene_head;
+}
+
+static bool sprite_key_less(struct sprite *a, struct sprite *b)
+{
+	if (a->scene_node.z != b->scene_node.z)
+		return a->scene_node.z < b->scene_node.z;
+	if (a->scene_node.z2 != b->scene_node.z2)
+		return a->scene_node.z2 < b->scene_node.z2;
+	return a->scene_node.seq < b->scene_node.seq;
+}
+
+static int random_level(void)
+{
+	// xorshift32; the skiplist doesn't need a good source of randomness
+	static uint32_t state = 2463534242u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+
+	int level = 1;
+	uint32_t bits = state;
+	// p = 1/4
+	while (level < SCENE_MAX_LEVEL && !(bits & 3)) {
+		level++;
+		bits >>= 2;
+	}
+	return level;
+}
+
+// Find the last node at each level whose key is less than SP's.
+static void scene_find(struct sprite *sp, struct sprite **update)
+{
+	struct sprite *x = NULL;
+	for (int i = scene_level - 1; i >= 0; i--) {
+		struct sprite *n;
+		while ((n = forward(x)[i]) && sprite_key_less(n, sp))
+			x = n;
+		update[i] = x;
+	}
+}
+
+static void scene_insert(struct sprite *sp)
+{
+	sp->scene_node.z = sp->z;
+	sp->scene_node.z2 = sp->z2;
+	sp->scene_node.seq = scene_seq++;
+	sp->scene_node.level = random_level();
+
+	struct sprite *update[SCENE_MAX_LEVEL];
+	scene_find(sp, update);
+	for (; scene_level < sp->scene_node.level; scene_level++) {
+		update[scene_level] = NULL;
+	}
+	for (int i = 0; i < sp->scene_node.level; i++) {
+		struct sprite **fwd = forward(update[i]);
+		sp->scene_node.next[i] = fwd[i];
+		fwd[i] = sp;
+	}
+}
+
+static void scene_remove(struct sprite *sp)
+{
+	struct sprite *update[SCENE_MAX_LEVEL];
+	scene_find(sp, update);
+	for (int i = 0; i < sp->scene_node.level; i++) {
+		struct sprite **fwd = forward(update[i]);
+		if (fwd[i] == sp)
+			fwd[i] = sp->scene_node.next[i];
+		sp->scene_node.next[i] = NULL;
+	}
+	while (scene_level > 1 && !scene_head[scene_level - 1])
+		scene_level--;
+}
 
 static Texture wp = {0};
 
-void scene_register_sprite(struct sprite *sp)
+static Rectangle rect_union(Rectangle *a, Rectangle *b)
 {
-	if (sp->in_scene)
+	Rectangle r;
+	SDL_UnionRect(a, b, &r);
+	return r;
+}
+
+static void scene_damage(Rectangle r)
+{
+	Texture *dst = gfx_main_surface();
+	Rectangle screen = RECT(0, 0, dst->w, dst->h);
+	if (!SDL_IntersectRect(&r, &screen, &r))
 		return;
 
-	struct sprite *p;
-	TAILQ_FOREACH(p, &sprite_list, entry) {
-		if (p->z == sp->z) {
-			if (p->z2 > sp->z2) {
-				TAILQ_INSERT_BEFORE(p, sp, entry);
-				sp->in_scene = true;
-				return;
-			}
-		} else if (p->z > sp->z) {
-			TAILQ_INSERT_BEFORE(p, sp, entry);
-			sp->in_scene = true;
-			return;
+	// merge with overlapping rectangles until nothing overlaps
+	for (int i = 0; i < nr_damage; i++) {
+		if (SDL_HasIntersection(&r, &damage[i])) {
+			r = rect_union(&r, &damage[i]);
+			damage[i] = damage[--nr_damage];
+			i = -1;
 		}
 	}
-	TAILQ_INSERT_TAIL(&sprite_list, sp, entry);
+	if (nr_damage == MAX_DAMAGE_RECTS) {
+		for (int i = 0; i < nr_damage; i++) {
+			r = rect_union(&r, &damage[i]);
+		}
+		nr_damage = 0;
+	}
+	damage[nr_damage++] = r;
+}
+
+static void sprite_bounds(struct sprite *sp, Rectangle *r)
+{
+	if (sp->get_bounds) {
+		sp->get_bounds(sp, r);
+	} else {
+		Texture *dst = gfx_main_surface();
+		*r = RECT(0, 0, dst->w, dst->h);
+	}
+}
+
+void scene_register_sprite(struct sprite *sp)
+{
+	if (sp->in_scene)
+		return;
+
+	sp->damaged = true;
+	scene_is_dirty = true;
+
+	scene_insert(sp);
 	sp->in_scene = true;
-	scene_dirty();
 }
 
 void scene_unregister_sprite(struct sprite *sp)
 {
 	if (!sp->in_scene)
 		return;
-	TAILQ_REMOVE(&sprite_list, sp, entry);
+	scene_remove(sp);
 	sp->in_scene = false;
-	scene_dirty();
+	if (sp->drawn)
+		scene_damage(sp->drawn_rect);
+	sp->drawn = false;
+	scene_is_dirty = true;
 }
 
-void scene_render(void)
+static void render_sprite(struct sprite *sp)
+{
+	if (sp->render)
+		sp->render(sp);
+	else
+		WARNING("sprite in scene without render function");
+}
+
+static void render_full(void)
 {
 	gfx_clear();
 	if (wp.handle) {
@@ -75,14 +222,70 @@ void scene_render(void)
 	}
 
 	struct sprite *sp;
-	TAILQ_FOREACH(sp, &sprite_list, entry) {
-		if (sp->render)
-			sp->render(sp);
-		else
-			WARNING("sprite in scene without render function");
+	SCENE_FOREACH(sp) {
+		render_sprite(sp);
 	}
 }
 
+static void render_damaged(void)
+{
+	for (int i = 0; i < nr_damage; i++) {
+		gfx_set_scissor(&damage[i]);
+		gfx_clear();
+		if (wp.handle) {
+			Rectangle r = RECT(0, 0, wp.w, wp.h);
+			if (SDL_HasIntersection(&r, &damage[i]))
+				gfx_render_texture(&wp, &r);
+		}
+
+		struct sprite *sp;
+		SCENE_FOREACH(sp) {
+			if (SDL_HasIntersection(&sp->drawn_rect, &damage[i]))
+				render_sprite(sp);
+		}
+	}
+	gfx_set_scissor(NULL);
+}
+
+void scene_render(void)
+{
+	Texture *dst = gfx_main_surface();
+	// something other than the scene was drawn to the main surface
+	if (dst->version != main_surface_version)
+		scene_damage_all = true;
+
+	// collect damage from sprites that changed since the last render
+	struct sprite *sp;
+	SCENE_FOREACH(sp) {
+		if (sp->contents_changed && sp->contents_changed(sp))
+			sp->damaged = true;
+		if (sp->damaged && !scene_damage_all && sp->drawn)
+			scene_damage(sp->drawn_rect);
+		sprite_bounds(sp, &sp->drawn_rect);
+		if (sp->damaged && !scene_damage_all)
+			scene_damage(sp->drawn_rect);
+		sp->damaged = false;
+		sp->drawn = true;
+	}
+
+	// redraw everything if most of the screen is damaged anyway
+	int damaged_area = 0;
+	for (int i = 0; i < nr_damage; i++) {
+		damaged_area += damage[i].w * damage[i].h;
+	}
+	if (damaged_area * 2 > dst->w * dst->h)
+		scene_damage_all = true;
+
+	if (scene_damage_all)
+		render_full();
+	else
+		render_damaged();
+
+	nr_damage = 0;
+	scene_damage_all = false;
+	main_surface_version = dst->version;
+}
+
 int scene_set_wp(int cg_no) {
 	if (!cg_no) {
 		gfx_delete_texture(&wp);
@@ -90,13 +293,13 @@ int scene_set_wp(int cg_no) {
 		return 1;
 	}
 
-	struct cg *cg = asset_cg_load(cg_no);
+	struct cg *cg = asset_cg_get(cg_no);
 	if (!cg)
 		return 0;
 
 	gfx_delete_texture(&wp);
 	gfx_init_texture_with_cg(&wp, cg);
-	cg_free(cg);
+	asset_cg_release(cg);
 	scene_dirty();
 	return 1;
 }
@@ -154,7 +357,7 @@ void scene_print_sprite(struct sprite *sp, int indent)
 void scene_print(void)
 {
 	struct sprite *p;
-	TAILQ_FOREACH(p, &sprite_list, entry) {
+	SCENE_FOREACH(p) {
 		if (p->debug_print) {
 			p->debug_print(p);
 		} else {
@@ -0,0 +1,229 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Array sorting (A_SORT, A_SORT_MEM).
+ *
+ * Arrays are sorted with a stable merge sort over (key, value) pairs. Keys are
+ * extracted once before sorting: for A_SORT_MEM the key is the struct member,
+ * and for string arrays it is the string object itself. All state is kept in
+ * a sort_context, so sorts may be nested (e.g. a comparator which itself
+ * sorts an array).
+ */
+
+#include <string.h>
+#include "system4.h"
+#include "system4/ain.h"
+#include "system4/string.h"
+#include "vm.h"
+#include "vm/heap.h"
+#include "vm/page.h"
+
+// Runs of this length or less are sorted with insertion sort
+#define INSERTION_SORT_MAX 16
+
+struct sort_item {
+	union vm_value key;
+	union vm_value value;
+};
+
+struct sort_context {
+	int (*compare)(struct sort_context *ctx, union vm_value a, union vm_value b);
+	int fno;
+	// array being sorted with a script comparator
+	int slot;
+	struct page *page;
+	int nr_vars;
+	bool aborted;
+};
+
+static int compare_int(possibly_unused struct sort_context *ctx, union vm_value a, union vm_value b)
+{
+	return a.i < b.i ? -1 : a.i > b.i;
+}
+
+static int compare_float(possibly_unused struct sort_context *ctx, union vm_value a, union vm_value b)
+{
+	return a.f < b.f ? -1 : a.f > b.f;
+}
+
+static int compare_string(possibly_unused struct sort_context *ctx, union vm_value a, union vm_value b)
+{
+	return strcmp(((struct string*)a.ref)->text, ((struct string*)b.ref)->text);
+}
+
+/*
+ * The comparator is script code, which may modify (or free) the array being
+ * sorted. If it does, the sort is abandoned: the remaining comparisons are
+ * skipped and the array is left as the comparator left it.
+ */
+static int compare_function(struct sort_context *ctx, union vm_value a, union vm_value b)
+{
+	if (ctx->aborted)
+		return 0;
+	int r = vm_call_compare(ctx->fno, a, b);
+	struct page *page = heap[ctx->slot].page;
+	if (page != ctx->page || !page || page->nr_vars != ctx->nr_vars)
+		ctx->aborted = true;
+	return r;
+}
+
+static void insertion_sort(struct sort_context *ctx, struct sort_item *items, int n)
+{
+	for (int i = 1; i < n; i++) {
+		struct sort_item tmp = items[i];
+		int j = i;
+		for (; j > 0 && ctx->compare(ctx, items[j-1].key, tmp.key) > 0; j--) {
+			items[j] = items[j-1];
+		}
+		items[j] = tmp;
+	}
+}
+
+// TMP must have room for (n / 2) items.
+static void merge_sort(struct sort_context *ctx, struct sort_item *items, struct sort_item *tmp, int n)
+{
+	if (n <= INSERTION_SORT_MAX) {
+		insertion_sort(ctx, items, n);
+		return;
+	}
+
+	int mid = n / 2;
+	merge_sort(ctx, items, tmp, mid);
+	merge_sort(ctx, items + mid, tmp, n - mid);
+
+	// already in order
+	if (ctx->compare(ctx, items[mid-1].key, items[mid].key) <= 0)
+		return;
+
+	// merge; the left run is moved out of the way first
+	memcpy(tmp, items, mid * sizeof(struct sort_item));
+	int i = 0, j = mid, k = 0;
+	while (i < mid && j < n) {
+		if (ctx->compare(ctx, tmp[i].key, items[j].key) <= 0)
+			items[k++] = tmp[i++];
+		else
+			items[k++] = items[j++];
+	}
+	while (i < mid) {
+		items[k++] = tmp[i++];
+	}
+}
+
+static void sort_items(struct sort_context *ctx, struct sort_item *items, int n)
+{
+	struct sort_item *tmp = xmalloc((n / 2 + 1) * sizeof(struct sort_item));
+	merge_sort(ctx, items, tmp, n);
+	free(tmp);
+}
+
+static union vm_value string_key(int slot)
+{
+	if (!heap_index_valid(slot))
+		return (union vm_value) { .ref = &EMPTY_STRING };
+	return (union vm_value) { .ref = heap_get_string(slot) };
+}
+
+void array_sort(int slot, int compare_fno)
+{
+	struct page *page = heap[slot].page;
+	if (!page || page->nr_vars < 2)
+		return;
+
+	struct sort_context ctx = {
+		.compare = compare_int,
+		.fno = compare_fno,
+		.slot = slot,
+		.page = page,
+		.nr_vars = page->nr_vars
+	};
+	enum ain_data_type type = page->array.rank == 1 ? array_type(page->a_type) : AIN_INT;
+	if (compare_fno) {
+		ctx.compare = compare_function;
+	} else if (type == AIN_FLOAT) {
+		ctx.compare = compare_float;
+	} else if (type == AIN_STRING) {
+		ctx.compare = compare_string;
+	}
+
+	int n = page->nr_vars;
+	struct sort_item *items = xmalloc(n * sizeof(struct sort_item));
+	for (int i = 0; i < n; i++) {
+		items[i].value = page->values[i];
+		if (ctx.compare == compare_string)
+			items[i].key = string_key(page->values[i].i);
+		else
+			items[i].key = page->values[i];
+	}
+
+	// keep the slot alive in case the comparator drops the array
+	if (compare_fno)
+		heap_ref(slot);
+	sort_items(&ctx, items, n);
+
+	if (ctx.aborted) {
+		WARNING("Array modified by comparator during sort");
+	} else {
+		for (int i = 0; i < n; i++) {
+			page->values[i] = items[i].value;
+		}
+	}
+	free(items);
+	if (compare_fno)
+		heap_unref(slot);
+}
+
+void array_sort_mem(struct page *page, int member_no)
+{
+	if (!page)
+		return;
+	if (page->type != ARRAY_PAGE || array_type(page->a_type) != AIN_STRUCT)
+		VM_ERROR("A_SORT_MEM called on something other than an array of structs");
+	if (page->nr_vars < 2)
+		return;
+
+	struct sort_context ctx = { .compare = compare_int };
+	enum ain_data_type type = AIN_INT;
+	int struct_type = page->array.struct_type;
+	if (struct_type >= 0 && struct_type < ain->nr_structures) {
+		struct ain_struct *s = &ain->structures[struct_type];
+		if (member_no < 0 || member_no >= s->nr_members)
+			VM_ERROR("Invalid member number for A_SORT_MEM: %d", member_no);
+		type = s->members[member_no].type.data;
+	}
+	if (type == AIN_FLOAT)
+		ctx.compare = compare_float;
+	else if (type == AIN_STRING)
+		ctx.compare = compare_string;
+
+	// extract keys
+	int n = page->nr_vars;
+	struct sort_item *items = xmalloc(n * sizeof(struct sort_item));
+	for (int i = 0; i < n; i++) {
+		int slot = page->values[i].i;
+		struct page *obj = heap_index_valid(slot) ? heap_get_page(slot) : NULL;
+		union vm_value v = obj ? obj->values[member_no] : (union vm_value) { .i = -1 };
+		items[i].value = page->values[i];
+		items[i].key = type == AIN_STRING ? string_key(v.i) : v;
+	}
+
+	sort_items(&ctx, items, n);
+
+	for (int i = 0; i < n; i++) {
+		page->values[i] = items[i].value;
+	}
+	free(items);
+}
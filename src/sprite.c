@@ -45,6 +45,7 @@ void sprite_free(struct sact_sprite *sp)
 	scene_unregister_sprite(&sp->sp);
 	gfx_delete_texture(&sp->texture);
 	gfx_delete_texture(&sp->text.texture);
+	gfx_alpha_shadow_free(&sp->amap);
 	if (sp->plugin)
 		LIST_REMOVE(sp, entry);
 	memset(sp, 0, sizeof(struct sact_sprite));
@@ -57,9 +58,21 @@ static void sprite_init_texture(struct sact_sprite *sp)
 			gfx_init_texture_rgba(&sp->texture, sp->rect.w, sp->rect.h, sp->color);
 		else
 			gfx_init_texture_rgb(&sp->texture, sp->rect.w, sp->rect.h, sp->color);
+		gfx_alpha_shadow_set_uniform(&sp->amap, &sp->texture,
+				sp->sp.has_alpha ? sp->color.a : 255);
 	}
 }
 
+static void sprite_get_bounds(struct sprite *_sp, Rectangle *r)
+{
+	struct sact_sprite *sp = (struct sact_sprite*)_sp;
+	// the texture is drawn at its own size, which is normally the same as
+	// the sprite's
+	*r = sp->rect;
+	r->w = max(r->w, sp->texture.w);
+	r->h = max(r->h, sp->texture.h);
+}
+
 static void sprite_render(struct sprite *_sp)
 {
 	struct sact_sprite *sp = (struct sact_sprite*)_sp;
@@ -68,6 +81,16 @@ static void sprite_render(struct sprite *_sp)
 	if (sp->text.texture.handle) {
 		gfx_render_texture(&sp->text.texture, &sp->rect);
 	}
+	sp->drawn_version = sp->texture.version;
+	sp->drawn_text_version = sp->text.texture.version;
+}
+
+// Catches draws to the sprite's texture that weren't followed by sprite_dirty.
+static bool sprite_contents_changed(struct sprite *_sp)
+{
+	struct sact_sprite *sp = (struct sact_sprite*)_sp;
+	return sp->texture.version != sp->drawn_version
+		|| sp->text.texture.version != sp->drawn_text_version;
 }
 
 struct texture *sprite_get_texture(struct sact_sprite *sp)
@@ -80,11 +103,14 @@ void sprite_set_cg(struct sact_sprite *sp, struct cg *cg)
 {
 	gfx_delete_texture(&sp->texture);
 	gfx_init_texture_with_cg(&sp->texture, cg);
+	gfx_alpha_shadow_set_cg(&sp->amap, &sp->texture, cg);
 	sp->rect.w = cg->metrics.w;
 	sp->rect.h = cg->metrics.h;
 	sp->sp.has_pixel = true;
 	sp->sp.has_alpha = cg->metrics.has_alpha;
 	sp->sp.render = sprite_render;
+	sp->sp.get_bounds = sprite_get_bounds;
+	sp->sp.contents_changed = sprite_contents_changed;
 	sprite_dirty(sp);
 }
 
@@ -113,29 +139,31 @@ void sprite_set_cg_2x(struct sact_sprite *sp, struct cg *cg)
 	sp->sp.has_pixel = true;
 	sp->sp.has_alpha = cg->metrics.has_alpha;
 	sp->sp.render = sprite_render;
+	sp->sp.get_bounds = sprite_get_bounds;
+	sp->sp.contents_changed = sprite_contents_changed;
 	sprite_dirty(sp);
 	gfx_delete_texture(&tmp);
 }
 
 int sprite_set_cg_from_asset(struct sact_sprite *sp, int cg_no)
 {
-	struct cg *cg = asset_cg_load(cg_no);
+	struct cg *cg = asset_cg_get(cg_no);
 	if (!cg)
 		return 0;
 	sprite_set_cg(sp, cg);
 	sp->cg_no = cg_no;
-	cg_free(cg);
+	asset_cg_release(cg);
 	return 1;
 }
 
 int sprite_set_cg_2x_from_asset(struct sact_sprite *sp, int cg_no)
 {
-	struct cg *cg = asset_cg_load(cg_no);
+	struct cg *cg = asset_cg_get(cg_no);
 	if (!cg)
 		return 0;
 	sprite_set_cg_2x(sp, cg);
 	sp->cg_no = cg_no;
-	cg_free(cg);
+	asset_cg_release(cg);
 	return 1;
 }
 
@@ -182,6 +210,8 @@ void sprite_init(struct sact_sprite *sp, int w, int h, int r, int g, int b, int
 	sp->sp.has_pixel = true;
 	sp->sp.has_alpha = a >= 0;
 	sp->sp.render = sprite_render;
+	sp->sp.get_bounds = sprite_get_bounds;
+	sp->sp.contents_changed = sprite_contents_changed;
 	sp->sp.debug_print = _sprite_print;
 	sprite_dirty(sp);
 }
@@ -323,13 +353,12 @@ bool sprite_is_point_in(struct sact_sprite *sp, int x, int y)
 
 	// check alpha
 	struct texture *t = sprite_get_texture(sp);
-	SDL_Color c = gfx_get_pixel(t, x - sp->rect.x, y - sp->rect.y);
-	return !!c.a;
+	return !!gfx_alpha_shadow_get(&sp->amap, t, x - sp->rect.x, y - sp->rect.y);
 }
 
 int sprite_get_amap_value(struct sact_sprite *sp, int x, int y)
 {
-	return gfx_get_pixel(sprite_get_texture(sp), x, y).a;
+	return gfx_alpha_shadow_get(&sp->amap, sprite_get_texture(sp), x, y);
 }
 
 void sprite_get_pixel_value(struct sact_sprite *sp, int x, int y, int *r, int *g, int *b)
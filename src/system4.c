@@ -61,6 +61,16 @@ struct config config = {
 	.echo = false,
 	.text_x_scale = 1.0,
 	.manual_text_x_scale = false,
+	.threaded_dispatch = false,
+	.jit = false,
+	.profile = NULL,
+	.resume_format = RESUME_FORMAT_JSON,
+	.asset_index_cache = NULL,
+	.cg_cache_size = -1,
+	.cg_prefetch_threads = -1,
+	.max_heap_slots = 0,
+	.target_fps = 0,
+	.vsync = VSYNC_GAME,
 
 	.bgi_path = NULL,
 	.wai_path = NULL,
@@ -351,6 +361,17 @@ static void usage(void)
 	puts("        --font-x-scale  Specify the x scale for text rendering (1.0 = default scale)");
 	puts("    -j, --joypad        Enable joypad");
 	puts("        --save-folder   Override save folder location");
+	puts("        --threaded-dispatch  Use the pre-decoded threaded interpreter");
+	puts("        --jit           Compile frequently called functions to native code");
+	puts("        --no-jit        Disable the JIT compiler");
+	puts("        --resume-format  Format of resume (quick save) images: json (default), binary or incremental");
+	puts("        --profile[=prefix]  Profile script execution; writes <prefix>.folded and <prefix>.json on exit");
+	puts("        --cg-cache-size  Size of the decoded CG cache in MB (0 = disabled; default: the game's setting)");
+	puts("        --cg-prefetch-threads  Number of threads decoding CGs in the background (0 = disabled)");
+	puts("        --max-heap-slots  Maximum number of heap slots (default: 2147483648 on 64-bit hosts, 2097152 on 32-bit)");
+	puts("        --target-fps    Frame rate limit for screen updates (default: 0 = unlimited)");
+	puts("        --vsync         Override the game's vsync setting: on, off or adaptive");
+	puts("        --asset-index-cache[=dir]  Cache archive name indices in <dir> (default: asset-index in the save folder)");
 #ifdef DEBUGGER_ENABLED
 	puts("        --nodebug       Disable debugger");
 	puts("        --debug         Start in debugger");
@@ -379,6 +400,17 @@ enum {
 	LOPT_FONT_X_SCALE,
 	LOPT_JOYPAD,
 	LOPT_SAVE_FOLDER,
+	LOPT_THREADED_DISPATCH,
+	LOPT_JIT,
+	LOPT_NO_JIT,
+	LOPT_PROFILE,
+	LOPT_RESUME_FORMAT,
+	LOPT_ASSET_INDEX_CACHE,
+	LOPT_CG_CACHE_SIZE,
+	LOPT_CG_PREFETCH_THREADS,
+	LOPT_MAX_HEAP_SLOTS,
+	LOPT_TARGET_FPS,
+	LOPT_VSYNC,
 #ifdef DEBUGGER_ENABLED
 	LOPT_NODEBUG,
 	LOPT_DEBUG,
@@ -423,6 +455,17 @@ int main(int argc, char *argv[])
 			{ "font-x-scale", required_argument, 0, LOPT_FONT_X_SCALE },
 			{ "joypad",       optional_argument, 0, LOPT_JOYPAD },
 			{ "save-folder",  required_argument, 0, LOPT_SAVE_FOLDER },
+			{ "threaded-dispatch", no_argument,  0, LOPT_THREADED_DISPATCH },
+			{ "jit",          no_argument,       0, LOPT_JIT },
+			{ "no-jit",       no_argument,       0, LOPT_NO_JIT },
+			{ "profile",      optional_argument, 0, LOPT_PROFILE },
+			{ "resume-format", required_argument, 0, LOPT_RESUME_FORMAT },
+			{ "asset-index-cache", optional_argument, 0, LOPT_ASSET_INDEX_CACHE },
+			{ "cg-cache-size", required_argument, 0, LOPT_CG_CACHE_SIZE },
+			{ "cg-prefetch-threads", required_argument, 0, LOPT_CG_PREFETCH_THREADS },
+			{ "max-heap-slots", required_argument, 0, LOPT_MAX_HEAP_SLOTS },
+			{ "target-fps",   required_argument, 0, LOPT_TARGET_FPS },
+			{ "vsync",        required_argument, 0, LOPT_VSYNC },
 #ifdef DEBUGGER_ENABLED
 			{ "nodebug",      no_argument,       0, LOPT_NODEBUG },
 			{ "debug",        no_argument,       0, LOPT_DEBUG },
@@ -476,6 +519,61 @@ int main(int argc, char *argv[])
 		case LOPT_SAVE_FOLDER:
 			savedir = optarg;
 			break;
+		case LOPT_THREADED_DISPATCH:
+			config.threaded_dispatch = true;
+			break;
+		case LOPT_JIT:
+			config.jit = true;
+			break;
+		case LOPT_NO_JIT:
+			config.jit = false;
+			break;
+		case LOPT_PROFILE:
+			config.profile = optarg ? optarg : "xsystem4-profile";
+			break;
+		case LOPT_RESUME_FORMAT:
+			if (!strcmp(optarg, "json"))
+				config.resume_format = RESUME_FORMAT_JSON;
+			else if (!strcmp(optarg, "binary"))
+				config.resume_format = RESUME_FORMAT_BINARY;
+			else if (!strcmp(optarg, "incremental"))
+				config.resume_format = RESUME_FORMAT_INCREMENTAL;
+			else
+				usage_error("Invalid value for --resume-format option: \"%s\"", optarg);
+			break;
+		case LOPT_ASSET_INDEX_CACHE:
+			config.asset_index_cache = optarg ? optarg : "asset-index";
+			break;
+		case LOPT_CG_CACHE_SIZE:
+			config.cg_cache_size = atoi(optarg);
+			if (config.cg_cache_size < 0)
+				usage_error("Invalid value for --cg-cache-size option: \"%s\"", optarg);
+			break;
+		case LOPT_CG_PREFETCH_THREADS:
+			config.cg_prefetch_threads = atoi(optarg);
+			if (config.cg_prefetch_threads < 0)
+				usage_error("Invalid value for --cg-prefetch-threads option: \"%s\"", optarg);
+			break;
+		case LOPT_MAX_HEAP_SLOTS:
+			config.max_heap_slots = atoi(optarg);
+			if (config.max_heap_slots <= 0)
+				usage_error("Invalid value for --max-heap-slots option: \"%s\"", optarg);
+			break;
+		case LOPT_TARGET_FPS:
+			config.target_fps = atoi(optarg);
+			if (config.target_fps < 0)
+				usage_error("Invalid value for --target-fps option: \"%s\"", optarg);
+			break;
+		case LOPT_VSYNC:
+			if (!strcmp(optarg, "on"))
+				config.vsync = VSYNC_ON;
+			else if (!strcmp(optarg, "off"))
+				config.vsync = VSYNC_OFF;
+			else if (!strcmp(optarg, "adaptive"))
+				config.vsync = VSYNC_ADAPTIVE;
+			else
+				usage_error("Invalid value for --vsync option: \"%s\"", optarg);
+			break;
 #ifdef DEBUGGER_ENABLED
 		case LOPT_NODEBUG:
 			dbg_enabled = false;
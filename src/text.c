@@ -14,6 +14,9 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+#include <limits.h>
+#include <math.h>
+
 #include "system4.h"
 #include "system4/fnl.h"
 #include "system4/hashtable.h"
@@ -133,19 +136,189 @@ static struct font_size *text_style_font_size(struct text_style *ts)
 	return ts->font_size = font_get_size(ts->face, ts->size);
 }
 
+/*
+ * Glyph atlas.
+ *
+ * Each font size packs its glyph bitmaps into a few large R8 textures
+ * ("pages") using simple shelf packing, so that consecutive glyphs of a
+ * string share a texture and their draws can be batched. When every page is
+ * full, the least recently used page (that isn't in use by the current
+ * string) is cleared and its generation bumped, which invalidates all glyph
+ * slots that pointed into it; those glyphs are re-rendered on demand.
+ */
+
+#define GLYPH_ATLAS_PAGE_SIZE 1024
+// pages to allocate before evicting
+#define GLYPH_ATLAS_MAX_PAGES 4
+// pages to allocate when nothing can be evicted
+#define GLYPH_ATLAS_HARD_MAX_PAGES 16
+// empty space between glyphs; must be larger than the widest dilation so
+// that bold/edge rendering doesn't sample neighbouring glyphs
+#define GLYPH_ATLAS_PADDING 8
+
+struct glyph_shelf {
+	int y, h;
+	int x;
+};
+
+struct glyph_atlas_page {
+	Texture t;
+	unsigned gen;
+	unsigned last_used;
+	int nr_shelves;
+	struct glyph_shelf *shelves;
+};
+
+struct glyph_atlas {
+	int page_size;
+	int nr_pages;
+	struct glyph_atlas_page pages[GLYPH_ATLAS_HARD_MAX_PAGES];
+};
+
+// incremented for every string rendered
+static unsigned atlas_clock = 1;
+
+static void atlas_page_clear(struct glyph_atlas *atlas, struct glyph_atlas_page *page)
+{
+	uint8_t *zero = xcalloc(atlas->page_size, atlas->page_size);
+	if (page->t.handle)
+		gfx_delete_texture(&page->t);
+	gfx_init_texture_rmap(&page->t, atlas->page_size, atlas->page_size, zero);
+	free(zero);
+
+	free(page->shelves);
+	page->shelves = NULL;
+	page->nr_shelves = 0;
+	page->gen++;
+}
+
+static bool atlas_page_alloc(struct glyph_atlas *atlas, struct glyph_atlas_page *page,
+		int w, int h, int *x_out, int *y_out)
+{
+	int pw = w + GLYPH_ATLAS_PADDING;
+	int ph = h + GLYPH_ATLAS_PADDING;
+
+	// find the shortest shelf with room for the glyph
+	struct glyph_shelf *best = NULL;
+	for (int i = 0; i < page->nr_shelves; i++) {
+		struct glyph_shelf *shelf = &page->shelves[i];
+		if (shelf->h < ph || shelf->x + pw > atlas->page_size)
+			continue;
+		if (!best || shelf->h < best->h)
+			best = shelf;
+	}
+
+	// open a new shelf
+	if (!best) {
+		int y = 0;
+		if (page->nr_shelves) {
+			struct glyph_shelf *last = &page->shelves[page->nr_shelves - 1];
+			y = last->y + last->h;
+		}
+		if (y + ph > atlas->page_size || pw > atlas->page_size)
+			return false;
+		page->shelves = xrealloc_array(page->shelves, page->nr_shelves,
+				page->nr_shelves + 1, sizeof(struct glyph_shelf));
+		best = &page->shelves[page->nr_shelves++];
+		best->y = y;
+		best->h = ph;
+		best->x = 0;
+	}
+
+	*x_out = best->x + GLYPH_ATLAS_PADDING;
+	*y_out = best->y + GLYPH_ATLAS_PADDING;
+	best->x += pw;
+	return true;
+}
+
+static struct glyph_atlas_page *atlas_new_page(struct glyph_atlas *atlas)
+{
+	struct glyph_atlas_page *page = &atlas->pages[atlas->nr_pages++];
+	page->gen = 0;
+	atlas_page_clear(atlas, page);
+	return page;
+}
+
+bool font_glyph_store(struct font_size *size, struct glyph *glyph, enum font_weight weight,
+		int w, int h, uint8_t *pixels)
+{
+	if (!size->atlas) {
+		size->atlas = xcalloc(1, sizeof(struct glyph_atlas));
+		// at least a few cells per page, even for very large fonts
+		size->atlas->page_size = max(GLYPH_ATLAS_PAGE_SIZE, (int)(size->size * 8));
+	}
+	struct glyph_atlas *atlas = size->atlas;
+
+	int x, y, page_no = -1;
+	for (int i = 0; i < atlas->nr_pages; i++) {
+		if (atlas_page_alloc(atlas, &atlas->pages[i], w, h, &x, &y)) {
+			page_no = i;
+			break;
+		}
+	}
+	if (page_no < 0 && atlas->nr_pages < GLYPH_ATLAS_MAX_PAGES) {
+		page_no = atlas->nr_pages;
+		atlas_new_page(atlas);
+		if (!atlas_page_alloc(atlas, &atlas->pages[page_no], w, h, &x, &y))
+			page_no = -1;
+	}
+	if (page_no < 0) {
+		// evict the least recently used page, unless it's in use by the
+		// string currently being rendered
+		struct glyph_atlas_page *lru = NULL;
+		for (int i = 0; i < atlas->nr_pages; i++) {
+			struct glyph_atlas_page *page = &atlas->pages[i];
+			if (page->last_used == atlas_clock)
+				continue;
+			if (!lru || page->last_used < lru->last_used)
+				lru = page;
+		}
+		if (lru) {
+			page_no = lru - atlas->pages;
+			atlas_page_clear(atlas, lru);
+		} else if (atlas->nr_pages < GLYPH_ATLAS_HARD_MAX_PAGES) {
+			page_no = atlas->nr_pages;
+			atlas_new_page(atlas);
+		}
+		if (page_no < 0 || !atlas_page_alloc(atlas, &atlas->pages[page_no], w, h, &x, &y)) {
+			WARNING("Glyph atlas full (%dx%d glyph)", w, h);
+			return false;
+		}
+	}
+
+	struct glyph_atlas_page *page = &atlas->pages[page_no];
+	gfx_update_texture_rmap(&page->t, x, y, w, h, pixels);
+	glyph->slot[weight] = (struct glyph_slot) {
+		.page = page_no,
+		.gen = page->gen,
+		.x = x,
+		.y = y,
+		.w = w,
+		.h = h,
+	};
+	return true;
+}
+
+static bool glyph_slot_valid(struct font_size *size, struct glyph *glyph, enum font_weight weight)
+{
+	struct glyph_slot *slot = &glyph->slot[weight];
+	return slot->w && size->atlas && slot->gen == size->atlas->pages[slot->page].gen;
+}
+
 static struct glyph *font_get_glyph(struct font_size *size, uint32_t code, enum font_weight weight)
 {
 	if (!size->glyph_table)
 		size->glyph_table = ht_create(4096);
 	// return cached glyph if available
 	struct ht_slot *slot = ht_put_int(size->glyph_table, code, NULL);
-	if (slot->value && ((struct glyph*)slot->value)->t[weight].handle)
+	if (slot->value && glyph_slot_valid(size, slot->value, weight))
 		return slot->value;
 	// alloc if necessary
 	if (!slot->value)
 		slot->value = xcalloc(1, sizeof(struct glyph));
 	// render glyph
-	if (!size->font->get_glyph(size, slot->value, code, weight))
+	if (!size->font->get_glyph(size, slot->value, code, weight)
+			|| !glyph_slot_valid(size, slot->value, weight))
 		return NULL;
 	return slot->value;
 }
@@ -220,11 +393,57 @@ struct text_render_metrics {
 	struct font_size *font_size;
 };
 
+// glyphs are drawn in runs of up to this many characters
+#define MAX_GLYPH_RUN 256
+
+struct glyph_placement {
+	float x;
+	int y;
+	Texture *t;
+	Rectangle src;
+};
+
+static void render_glyph_run(Texture *dst, struct glyph_placement *run, int nr_glyphs,
+		struct text_render_metrics *tm)
+{
+	if (!nr_glyphs)
+		return;
+
+	if (tm->mode == RENDER_BLENDED) {
+		// one background fill for the whole run
+		int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+		for (int i = 0; i < nr_glyphs; i++) {
+			int x = roundf(run[i].x);
+			x0 = min(x0, x);
+			y0 = min(y0, run[i].y);
+			x1 = max(x1, x + (int)ceilf(run[i].src.w * config.text_x_scale));
+			y1 = max(y1, run[i].y + run[i].src.h);
+		}
+		gfx_draw_glyph_background(dst, x0, y0, x1 - x0, y1 - y0, tm->color);
+	}
+
+	for (int i = 0; i < nr_glyphs; i++) {
+		struct glyph_placement *g = &run[i];
+		if (tm->mode == RENDER_BLENDED) {
+			gfx_draw_glyph(dst, g->x, g->y, g->t, g->src, tm->color,
+					config.text_x_scale, tm->edge_width);
+		} else if (tm->mode == RENDER_PMAP) {
+			gfx_draw_glyph_to_pmap(dst, g->x, g->y, g->t, g->src, tm->color,
+					config.text_x_scale);
+		} else if (tm->mode == RENDER_AMAP) {
+			gfx_draw_glyph_to_amap(dst, g->x, g->y, g->t, g->src, config.text_x_scale);
+		}
+	}
+}
+
 static int render_text(Texture *dst, char *msg, struct text_render_metrics *tm)
 {
+	struct glyph_placement run[MAX_GLYPH_RUN];
+	int nr_glyphs = 0;
 	float pos_x = tm->x;
 	int pos_y = tm->y + tm->font_size->y_offset;
 
+	atlas_clock++;
 	while (*msg) {
 		pos_x += tm->edge_spacing;
 		// get glyph for character
@@ -235,22 +454,35 @@ static int render_text(Texture *dst, char *msg, struct text_render_metrics *tm)
 		if (!glyph)
 			continue;
 
-		// render glyph
-		Texture *t = &glyph->t[tm->weight];
+		// keep the glyph's atlas page from being evicted until the run is drawn
+		struct glyph_slot *slot = &glyph->slot[tm->weight];
+		struct glyph_atlas_page *page = &tm->font_size->atlas->pages[slot->page];
+		page->last_used = atlas_clock;
+
+		struct glyph_placement *g = &run[nr_glyphs++];
+		g->t = &page->t;
 		if (tm->mode == RENDER_BLENDED) {
-			float x = pos_x - glyph->rect.x;
-			int y = pos_y - glyph->rect.y;
-			gfx_draw_glyph(dst, x, y, t, tm->color, config.text_x_scale, tm->edge_width);
-		} else if (tm->mode == RENDER_PMAP) {
-			gfx_draw_glyph_to_pmap(dst, pos_x, pos_y, t, glyph->rect, tm->color, config.text_x_scale);
-		} else if (tm->mode == RENDER_AMAP) {
-			gfx_draw_glyph_to_amap(dst, pos_x, pos_y, t, glyph->rect, config.text_x_scale);
+			g->x = pos_x - glyph->rect.x;
+			g->y = pos_y - glyph->rect.y;
+			g->src = (Rectangle) { slot->x, slot->y, slot->w, slot->h };
+		} else {
+			g->x = pos_x;
+			g->y = pos_y;
+			g->src = glyph->rect;
+			g->src.x += slot->x;
+			g->src.y += slot->y;
+		}
+		if (nr_glyphs == MAX_GLYPH_RUN) {
+			render_glyph_run(dst, run, nr_glyphs, tm);
+			nr_glyphs = 0;
+			atlas_clock++;
 		}
 
 		// advance
 		pos_x += glyph->advance * scale_x * config.text_x_scale + tm->font_spacing;
 		pos_x += tm->edge_spacing;
 	}
+	render_glyph_run(dst, run, nr_glyphs, tm);
 	return roundf(pos_x - tm->x);
 }
 
@@ -231,7 +231,7 @@ int gfx_init(void)
 		ERROR("glewInit failed");
 #endif
 
-	SDL_GL_SetSwapInterval(0);
+	gfx_set_wait_vsync(false);
 	gl_initialize();
 	gfx_draw_init();
 	gfx_set_window_logical_size(config.view_width, config.view_height);
@@ -270,6 +270,7 @@ static void main_surface_init(int w, int h)
 	main_surface.has_alpha = true;
 	main_surface.alpha_mod = 255;
 	main_surface.draw_method = DRAW_METHOD_NORMAL;
+	gfx_texture_modified(&main_surface);
 
 	glGenFramebuffers(1, &main_surface_fb);
 	glBindFramebuffer(GL_FRAMEBUFFER, main_surface_fb);
@@ -317,9 +318,32 @@ void gfx_update_screen_scale(void)
 	}
 }
 
+static bool wait_vsync = false;
+
 void gfx_set_wait_vsync(bool wait)
 {
-	SDL_GL_SetSwapInterval(wait);
+	// the user's setting takes precedence over the game's
+	if (config.vsync == VSYNC_OFF)
+		wait = false;
+	else if (config.vsync != VSYNC_GAME)
+		wait = true;
+
+	// late swap tearing; not supported everywhere
+	if (wait && config.vsync == VSYNC_ADAPTIVE && !SDL_GL_SetSwapInterval(-1)) {
+		wait_vsync = true;
+		return;
+	}
+	if (SDL_GL_SetSwapInterval(wait)) {
+		WARNING("SDL_GL_SetSwapInterval failed: %s", SDL_GetError());
+		wait_vsync = false;
+		return;
+	}
+	wait_vsync = wait;
+}
+
+bool gfx_get_wait_vsync(void)
+{
+	return wait_vsync;
 }
 
 void gfx_set_clear_color(int r, int g, int b, int a)
@@ -333,11 +357,31 @@ void gfx_set_clear_color(int r, int g, int b, int a)
 
 void gfx_clear(void)
 {
+	gfx_draw_flush();
 	glClear(GL_COLOR_BUFFER_BIT);
+	// anything that composites onto the main surface starts here
+	gfx_texture_modified(&main_surface);
+}
+
+/*
+ * Restrict rendering (including gfx_clear) to R, or lift the restriction if
+ * R is NULL. R is in main surface coordinates.
+ */
+void gfx_set_scissor(Rectangle *r)
+{
+	gfx_draw_flush();
+	if (!r) {
+		glDisable(GL_SCISSOR_TEST);
+		return;
+	}
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(r->x, r->y, r->w, r->h);
 }
 
 void gfx_swap(void)
 {
+	// pending draws must land on the main surface before it is presented
+	gfx_draw_flush();
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glViewport(sdl.viewport.x, sdl.viewport.y, sdl.viewport.w, sdl.viewport.h);
 	glClear(GL_COLOR_BUFFER_BIT);
@@ -367,6 +411,8 @@ void gfx_swap(void)
  */
 void gfx_prepare_job(struct gfx_render_job *job)
 {
+	// batched draws must land before anything else is rendered
+	gfx_draw_flush();
 	glUseProgram(job->shader->program);
 
 	glUniformMatrix4fv(job->shader->world_transform, 1, GL_FALSE, job->world_transform);
@@ -454,9 +500,205 @@ void gfx_render_texture(struct texture *t, Rectangle *r)
 		glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO);
 }
 
-static void init_texture(struct texture *t, int w, int h)
+/*
+ * Framebuffer cache.
+ *
+ * Each texture that is drawn to gets one FBO, created (and checked for
+ * completeness) the first time it's used as a render target and kept until
+ * the texture itself is deleted.
+ */
+#define FBO_CACHE_BUCKETS 256
+
+struct fbo_cache_entry {
+	struct fbo_cache_entry *next;
+	GLuint texture;
+	GLuint fbo;
+};
+
+static struct fbo_cache_entry *fbo_cache[FBO_CACHE_BUCKETS];
+
+static struct fbo_cache_entry **fbo_cache_bucket(GLuint texture)
+{
+	return &fbo_cache[texture % FBO_CACHE_BUCKETS];
+}
+
+// Get the FBO for TEXTURE. Sets *CREATED if it has to be set up.
+static GLuint fbo_cache_get(GLuint texture, bool *created)
 {
-	glGenTextures(1, &t->handle);
+	struct fbo_cache_entry **bucket = fbo_cache_bucket(texture);
+	for (struct fbo_cache_entry *e = *bucket; e; e = e->next) {
+		if (e->texture == texture) {
+			*created = false;
+			return e->fbo;
+		}
+	}
+	struct fbo_cache_entry *e = xmalloc(sizeof(struct fbo_cache_entry));
+	e->texture = texture;
+	glGenFramebuffers(1, &e->fbo);
+	e->next = *bucket;
+	*bucket = e;
+	*created = true;
+	return e->fbo;
+}
+
+static void fbo_cache_invalidate(GLuint texture)
+{
+	for (struct fbo_cache_entry **p = fbo_cache_bucket(texture); *p; p = &(*p)->next) {
+		if ((*p)->texture == texture) {
+			struct fbo_cache_entry *e = *p;
+			*p = e->next;
+			glDeleteFramebuffers(1, &e->fbo);
+			free(e);
+			return;
+		}
+	}
+}
+
+// Texture names are reused by GL, so cached FBOs must go with the texture.
+static void delete_texture_handle(GLuint handle)
+{
+	fbo_cache_invalidate(handle);
+	glDeleteTextures(1, &handle);
+}
+
+/*
+ * Texture recycling.
+ *
+ * Deleted textures are kept in a pool keyed by size and internal format and
+ * handed out again to the next texture with the same dimensions, so that
+ * changing a sprite's CG doesn't make the driver free and reallocate the
+ * texture storage each time.
+ */
+#define TEXTURE_POOL_MAX 64
+#define TEXTURE_POOL_MAX_BYTES (64 * 1024 * 1024)
+
+struct pooled_texture {
+	GLuint handle;
+	int w, h;
+	GLenum internal_format;
+	size_t size;
+};
+
+// oldest first
+static struct pooled_texture texture_pool[TEXTURE_POOL_MAX];
+static int texture_pool_len;
+static size_t texture_pool_size;
+
+static size_t texture_size(int w, int h, GLenum internal_format)
+{
+	switch (internal_format) {
+	case GL_RGBA: return (size_t)w * h * 4;
+	case GL_RGB: return (size_t)w * h * 3;
+	default: return (size_t)w * h;
+	}
+}
+
+static void texture_pool_remove(int i)
+{
+	texture_pool_size -= texture_pool[i].size;
+	texture_pool_len--;
+	memmove(texture_pool + i, texture_pool + i + 1,
+			(texture_pool_len - i) * sizeof(struct pooled_texture));
+}
+
+static GLuint texture_pool_take(int w, int h, GLenum internal_format)
+{
+	for (int i = texture_pool_len - 1; i >= 0; i--) {
+		struct pooled_texture *p = &texture_pool[i];
+		if (p->w == w && p->h == h && p->internal_format == internal_format) {
+			GLuint handle = p->handle;
+			texture_pool_remove(i);
+			return handle;
+		}
+	}
+	return 0;
+}
+
+static void texture_pool_put(struct texture *t)
+{
+	size_t size = texture_size(t->w, t->h, t->internal_format);
+	if (!t->internal_format || size > TEXTURE_POOL_MAX_BYTES) {
+		delete_texture_handle(t->handle);
+		return;
+	}
+	for (int i = 0; i < texture_pool_len; i++) {
+		// already deleted through a copy of the texture struct
+		if (texture_pool[i].handle == t->handle)
+			return;
+	}
+	while (texture_pool_len == TEXTURE_POOL_MAX || texture_pool_size + size > TEXTURE_POOL_MAX_BYTES) {
+		delete_texture_handle(texture_pool[0].handle);
+		texture_pool_remove(0);
+	}
+	texture_pool[texture_pool_len++] = (struct pooled_texture) {
+		.handle = t->handle,
+		.w = t->w,
+		.h = t->h,
+		.internal_format = t->internal_format,
+		.size = size
+	};
+	texture_pool_size += size;
+}
+
+/*
+ * Pixel uploads larger than PBO_MIN_SIZE go through a ring of pixel buffer
+ * objects. The copy into the (orphaned) buffer is cheap, and the transfer to
+ * texture memory then happens asynchronously in the driver instead of
+ * blocking in glTexImage2D.
+ */
+#define NR_PBOS 4
+#define PBO_MIN_SIZE (64 * 1024)
+
+static GLuint pbos[NR_PBOS];
+static int pbo_next;
+
+static bool pbo_stage(const void *pixels, size_t size)
+{
+	if (!pbos[0])
+		glGenBuffers(NR_PBOS, pbos);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[pbo_next]);
+	pbo_next = (pbo_next + 1) % NR_PBOS;
+
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+	void *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (dst) {
+		memcpy(dst, pixels, size);
+		if (glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER))
+			return true;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return false;
+}
+
+// Upload pixel data to the currently bound texture.
+static void upload_texture(bool recycled, GLenum internal_format, int w, int h,
+		GLenum format, const void *pixels)
+{
+	bool pbo = false;
+	size_t size = texture_size(w, h, internal_format);
+	if (pixels && size >= PBO_MIN_SIZE && (pbo = pbo_stage(pixels, size)))
+		pixels = NULL;  // offset into the PBO
+
+	if (recycled)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, format, GL_UNSIGNED_BYTE, pixels);
+	else
+		glTexImage2D(GL_TEXTURE_2D, 0, internal_format, w, h, 0, format, GL_UNSIGNED_BYTE, pixels);
+
+	if (pbo)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+/*
+ * Create (or recycle, if RECYCLE is true) a texture and bind it. Returns
+ * true if a recycled texture was used, in which case its storage has
+ * already been allocated.
+ */
+static bool init_texture(struct texture *t, int w, int h, GLenum internal_format, bool recycle)
+{
+	bool recycled = recycle && (t->handle = texture_pool_take(w, h, internal_format));
+	if (!recycled)
+		glGenTextures(1, &t->handle);
 	glBindTexture(GL_TEXTURE_2D, t->handle);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -471,17 +713,20 @@ static void init_texture(struct texture *t, int w, int h)
 
 	t->w = w;
 	t->h = h;
+	t->internal_format = internal_format;
+	gfx_texture_modified(t);
 
 	t->has_alpha = true;
 	t->alpha_mod = 255;
 	t->draw_method = DRAW_METHOD_NORMAL;
-
+	return recycled;
 }
 
 void gfx_init_texture_with_pixels(struct texture *t, int w, int h, void *pixels)
 {
-	init_texture(t, w, h);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	// blank textures aren't recycled, since their contents would be stale
+	bool recycled = init_texture(t, w, h, GL_RGBA, pixels);
+	upload_texture(recycled, GL_RGBA, w, h, GL_RGBA, pixels);
 }
 
 void gfx_init_texture_with_cg(struct texture *t, struct cg *cg)
@@ -512,8 +757,8 @@ void gfx_init_texture_rgb(struct texture *t, int w, int h, SDL_Color color)
 		pixels[i*3+2] = color.b;
 	}
 
-	init_texture(t, w, h);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+	bool recycled = init_texture(t, w, h, GL_RGB, true);
+	upload_texture(recycled, GL_RGB, w, h, GL_RGB, pixels);
 	free(pixels);
 }
 
@@ -531,8 +776,18 @@ void gfx_init_texture_amap(struct texture *t, int w, int h, uint8_t *amap, SDL_C
 
 void gfx_init_texture_rmap(struct texture *t, int w, int h, uint8_t *rmap)
 {
-	init_texture(t, w, h);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, rmap);
+	bool recycled = init_texture(t, w, h, GL_R8, rmap);
+	upload_texture(recycled, GL_R8, w, h, GL_RED, rmap);
+}
+
+// Replace a region of an R8 texture. Pending draws don't need to be flushed
+// as long as they don't sample the replaced region.
+void gfx_update_texture_rmap(struct texture *t, int x, int y, int w, int h, uint8_t *rmap)
+{
+	glBindTexture(GL_TEXTURE_2D, t->handle);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RED, GL_UNSIGNED_BYTE, rmap);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	gfx_texture_modified(t);
 }
 
 void gfx_init_texture_blank(struct texture *t, int w, int h)
@@ -542,34 +797,43 @@ void gfx_init_texture_blank(struct texture *t, int w, int h)
 
 void gfx_copy_main_surface(struct texture *dst)
 {
-	init_texture(dst, main_surface.w, main_surface.h);
+	gfx_draw_flush();
+	init_texture(dst, main_surface.w, main_surface.h, GL_RGB, false);
 	glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 0, 0, main_surface.w, main_surface.h, 0);
 }
 
 void gfx_delete_texture(struct texture *t)
 {
+	// the handle may be referenced by a pending batch
+	gfx_draw_flush();
 	if (t->handle)
-		glDeleteTextures(1, &t->handle);
+		texture_pool_put(t);
 	t->handle = 0;
 }
 
 GLuint gfx_set_framebuffer(GLenum target, Texture *t, int x, int y, int w, int h)
 {
-	GLuint fbo;
-	glGenFramebuffers(1, &fbo);
+	gfx_draw_flush();
+	bool created;
+	GLuint fbo = fbo_cache_get(t->handle, &created);
+	if (target != GL_READ_FRAMEBUFFER)
+		gfx_texture_modified(t);
 	glBindFramebuffer(target, fbo);
-	glFramebufferTexture2D(target, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t->handle, 0);
 	glViewport(x, y, w, h);
 
-	if (glCheckFramebufferStatus(target) != GL_FRAMEBUFFER_COMPLETE)
-		ERROR("Incomplete framebuffer");
+	if (created) {
+		glFramebufferTexture2D(target, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t->handle, 0);
+		if (glCheckFramebufferStatus(target) != GL_FRAMEBUFFER_COMPLETE)
+			ERROR("Incomplete framebuffer");
+	}
 	return fbo;
 }
 
-void gfx_reset_framebuffer(GLenum target, GLuint fbo)
+// NOTE: FBO is owned by the framebuffer cache and stays alive.
+void gfx_reset_framebuffer(GLenum target, possibly_unused GLuint fbo)
 {
+	gfx_draw_flush();
 	glBindFramebuffer(target, main_surface_fb);
-	glDeleteFramebuffers(1, &fbo);
 	glViewport(0, 0, sdl.w, sdl.h);
 }
 
@@ -599,6 +863,83 @@ void *gfx_get_pixels(Texture *t)
 	return pixels;
 }
 
+void gfx_texture_modified(Texture *t)
+{
+	// globally unique, so that a recycled or re-initialized texture never
+	// matches a stale alpha shadow
+	static unsigned texture_version = 0;
+	t->version = ++texture_version;
+}
+
+static void alpha_shadow_resize(struct alpha_shadow *s, int w, int h)
+{
+	if (!s->alpha || s->w * s->h != w * h) {
+		free(s->alpha);
+		s->alpha = xmalloc(w * h);
+	}
+	s->w = w;
+	s->h = h;
+	s->uniform = -1;
+}
+
+void gfx_alpha_shadow_set_cg(struct alpha_shadow *s, Texture *t, struct cg *cg)
+{
+	alpha_shadow_resize(s, cg->metrics.w, cg->metrics.h);
+	uint8_t *pixels = cg->pixels;
+	for (int i = 0; i < s->w * s->h; i++) {
+		s->alpha[i] = pixels[i*4 + 3];
+	}
+	s->version = t->version;
+}
+
+void gfx_alpha_shadow_set_uniform(struct alpha_shadow *s, Texture *t, int alpha)
+{
+	free(s->alpha);
+	s->alpha = NULL;
+	s->w = t->w;
+	s->h = t->h;
+	s->uniform = alpha;
+	s->version = t->version;
+}
+
+// queries on an unchanged texture before its alpha shadow is refreshed
+#define ALPHA_SHADOW_REFRESH_QUERIES 4
+
+int gfx_alpha_shadow_get(struct alpha_shadow *s, Texture *t, int x, int y)
+{
+	if (!t->handle)
+		return 0;
+	if (s->version != t->version || s->w != t->w || s->h != t->h) {
+		if (s->stale_version != t->version) {
+			s->stale_version = t->version;
+			s->stale_queries = 0;
+		}
+		if (++s->stale_queries < ALPHA_SHADOW_REFRESH_QUERIES) {
+			if (x < 0 || y < 0 || x >= t->w || y >= t->h)
+				return 0;
+			return gfx_get_pixel(t, x, y).a;
+		}
+		uint8_t *pixels = gfx_get_pixels(t);
+		alpha_shadow_resize(s, t->w, t->h);
+		for (int i = 0; i < s->w * s->h; i++) {
+			s->alpha[i] = pixels[i*4 + 3];
+		}
+		free(pixels);
+		s->version = t->version;
+	}
+	if (x < 0 || y < 0 || x >= s->w || y >= s->h)
+		return 0;
+	if (s->uniform >= 0)
+		return s->uniform;
+	return s->alpha[y * s->w + x];
+}
+
+void gfx_alpha_shadow_free(struct alpha_shadow *s)
+{
+	free(s->alpha);
+	memset(s, 0, sizeof(struct alpha_shadow));
+}
+
 int gfx_save_texture(Texture *t, const char *path, enum cg_type format)
 {
 	void *pixels = gfx_get_pixels(t);
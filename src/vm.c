@@ -22,6 +22,11 @@
 #include <time.h>
 #include <setjmp.h>
 #include <assert.h>
+#if defined(__GLIBC__) || defined(_WIN32)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
 #include <SDL.h> // for system.MsgBox
 
 #include "system4.h"
@@ -35,9 +40,13 @@
 #include "little_endian.h"
 #include "input.h"
 #include "savedata.h"
+#include "save_writer.h"
 #include "vm.h"
 #include "vm/heap.h"
+#include "vm/intern.h"
+#include "vm/jit.h"
 #include "vm/page.h"
+#include "vm/profiler.h"
 #include "xsystem4.h"
 
 static inline int32_t lint_clamp(int64_t n)
@@ -51,9 +60,17 @@ static inline int32_t lint_clamp(int64_t n)
 
 #define INITIAL_STACK_SIZE 4096
 
+// Size of the arena used for local pages (see frame_alloc_page)
+#define FRAME_ARENA_SIZE (1024 * 1024)
+
 // When the IP is set to VM_RETURN, the VM halts
 #define VM_RETURN 0xFFFFFFFF
 
+// Threaded dispatch relies on the "labels as values" GNU C extension
+#ifdef __GNUC__
+#define VM_THREADED_DISPATCH
+#endif
+
 /*
  * NOTE: The current implementation is a simple bytecode interpreter.
  *       System40.exe uses a JIT compiler, and we should too.
@@ -68,6 +85,10 @@ static size_t stack_size;     // current size of the stack
 struct function_call call_stack[4096];
 int32_t call_stack_ptr = 0;
 
+// Arena for local pages
+static uint8_t *frame_arena = NULL;
+static size_t frame_arena_ptr = 0;
+
 struct ain *ain;
 size_t instr_ptr = 0;
 
@@ -85,22 +106,35 @@ static const char *current_instruction_name(void)
 	return "UNKNOWN OPCODE";
 }
 
+/*
+ * Get the heap slot for the local page of CALL, allocating one if needed.
+ * Local pages in the frame arena are only given a heap slot when something
+ * needs to refer to them by index (e.g. a reference to a local variable).
+ */
+int32_t call_frame_page_slot(struct function_call *call)
+{
+	if (call->page_slot < 0) {
+		call->page_slot = heap_alloc_slot(VM_PAGE);
+		heap_set_page(call->page_slot, call->page);
+	}
+	return call->page_slot;
+}
+
 static int local_page_slot(void)
 {
-	return call_stack[call_stack_ptr-1].page_slot;
+	return call_frame_page_slot(&call_stack[call_stack_ptr-1]);
 }
 
 struct page *local_page(void)
 {
-	return heap[local_page_slot()].page;
+	return call_stack[call_stack_ptr-1].page;
 }
 
 struct page *get_local_page(int frame_no)
 {
 	if (frame_no < 0 || frame_no >= call_stack_ptr)
 		return NULL;
-	int slot = call_stack[call_stack_ptr - (frame_no + 1)].page_slot;
-	return slot < 1 ? NULL : heap[slot].page;
+	return call_stack[call_stack_ptr - (frame_no + 1)].page;
 }
 
 union vm_value local_get(int varno)
@@ -225,6 +259,65 @@ static struct string *stack_peek_string(int n)
 	return heap[stack_peek(n).i].s;
 }
 
+/*
+ * Constant strings are shared with the ain file, so comparing a variable
+ * against a literal it was assigned from only needs a pointer comparison.
+ */
+static bool string_equal(struct string *a, struct string *b)
+{
+	if (a == b)
+		return true;
+	return a->size == b->size && !memcmp(a->text, b->text, a->size);
+}
+
+/*
+ * Size of the allocation backing a string. struct string (libsys4) has no
+ * capacity field, so the room past the terminator can only be known by
+ * asking the allocator. Not defined where the allocator can't tell us, in
+ * which case S_ADD always copies.
+ */
+#if defined(__GLIBC__)
+#define STRING_ALLOC_SIZE(s) malloc_usable_size(s)
+#elif defined(_WIN32)
+#define STRING_ALLOC_SIZE(s) _msize(s)
+#elif defined(__APPLE__)
+#define STRING_ALLOC_SIZE(s) malloc_size(s)
+#endif
+
+/*
+ * Concatenate the strings in heap slots A and B, consuming both operands.
+ *
+ * When A is a temporary (e.g. the result of a previous S_ADD) nothing else
+ * can observe it, so B is appended in place. Storage is grown to twice the
+ * required size, which makes chains like `a + b + c + ...` run in linear
+ * time instead of copying the whole prefix at every step.
+ */
+static int string_add(int a, int b)
+{
+	struct string *sa = heap_get_string(a);
+	struct string *sb = heap_get_string(b);
+
+#ifdef STRING_ALLOC_SIZE
+	if (heap_refs[a] == 1 && sa->ref == 1 && sa != &EMPTY_STRING && a != b) {
+		size_t need = sizeof(struct string) + (size_t)sa->size + sb->size + 1;
+		if (STRING_ALLOC_SIZE(sa) < need) {
+			sa = xrealloc(sa, need * 2);
+			heap[a].s = sa;
+		}
+		memcpy(sa->text + sa->size, sb->text, sb->size + 1);
+		sa->size += sb->size;
+		heap_unref(b);
+		return a;
+	}
+#endif
+
+	int slot = heap_alloc_slot(VM_STRING);
+	heap[slot].s = string_concatenate(sa, sb);
+	heap_unref(a);
+	heap_unref(b);
+	return slot;
+}
+
 int vm_string_ref(struct string *s)
 {
 	int slot = heap_alloc_slot(VM_STRING);
@@ -256,21 +349,12 @@ union vm_value vm_copy(union vm_value v, enum ain_data_type type)
 	}
 }
 
-static int get_function_by_name(const char *name)
-{
-	for (int i = 0; i < ain->nr_functions; i++) {
-		if (!strcmp(name, ain->functions[i].name))
-			return i;
-	}
-	return -1;
-}
-
 static int alloc_scenario_page(const char *fname)
 {
 	int fno, slot;
 	struct ain_function *f;
 
-	if ((fno = get_function_by_name(fname)) < 0)
+	if ((fno = intern_get_function(fname)) < 0)
 		VM_ERROR("Invalid scenario function: %s", display_sjis0(fname));
 	f = &ain->functions[fno];
 
@@ -282,22 +366,104 @@ static int alloc_scenario_page(const char *fname)
 	return slot;
 }
 
+/*
+ * Local pages are bump-allocated from the frame arena, and released in LIFO
+ * order when the function returns. If the arena is full, the page is
+ * allocated on the heap instead.
+ */
+static void frame_alloc_page(struct function_call *call, int fno, int nr_vars)
+{
+	size_t size = sizeof(struct page) + nr_vars * sizeof(union vm_value);
+	if (unlikely(frame_arena_ptr + size > FRAME_ARENA_SIZE)) {
+		call->page = alloc_page(LOCAL_PAGE, fno, nr_vars);
+		call->page_slot = heap_alloc_slot(VM_PAGE);
+		call->arena_ptr = FRAME_NOT_IN_ARENA;
+		heap_set_page(call->page_slot, call->page);
+		return;
+	}
+
+	struct page *page = (struct page*)(frame_arena + frame_arena_ptr);
+	page->type = LOCAL_PAGE;
+	page->index = fno;
+	page->array.struct_type = 0;
+	page->array.rank = 0;
+	page->nr_vars = nr_vars;
+	page->capacity = nr_vars;
+
+	call->page = page;
+	call->page_slot = -1;
+	call->arena_ptr = frame_arena_ptr;
+	frame_arena_ptr += size;
+}
+
+// Move a local page out of the frame arena.
+static struct page *frame_copy_page(struct page *src)
+{
+	struct page *dst = alloc_page(LOCAL_PAGE, src->index, src->nr_vars);
+	memcpy(dst->values, src->values, src->nr_vars * sizeof(union vm_value));
+	return dst;
+}
+
+// Release the local page of CALL.
+static void frame_free_page(struct function_call *call)
+{
+	if (call->arena_ptr == FRAME_NOT_IN_ARENA) {
+		heap_unref(call->page_slot);
+		return;
+	}
+
+	if (call->page_slot < 0) {
+		delete_page_vars(call->page);
+	} else if (heap_refs[call->page_slot] == 1) {
+		delete_page_vars(call->page);
+		heap_set_page(call->page_slot, NULL);
+		heap_unref(call->page_slot);
+	} else {
+		// page is still referenced; it must outlive the frame
+		heap_set_page(call->page_slot, frame_copy_page(call->page));
+		heap_unref(call->page_slot);
+	}
+	frame_arena_ptr = call->arena_ptr;
+}
+
+/*
+ * Detach local pages in the frame arena from the heap. This is used when the
+ * heap is discarded wholesale (i.e. when loading a VM image).
+ */
+void call_frames_detach(void)
+{
+	for (int i = 0; i < call_stack_ptr; i++) {
+		struct function_call *call = &call_stack[i];
+		if (call->arena_ptr != FRAME_NOT_IN_ARENA && call->page_slot >= 0)
+			heap_set_page(call->page_slot, NULL);
+	}
+	frame_arena_ptr = 0;
+}
+
 static void scenario_call(int slot)
 {
 	int fno = heap[slot].page->index;
 	// flush call stack
 	for (int i = call_stack_ptr - 1; i >= 0; i--) {
-		heap_unref(call_stack[i].page_slot);
+		frame_free_page(&call_stack[i]);
 	}
+	frame_arena_ptr = 0;
 	call_stack[0] = (struct function_call) {
 		.fno = fno,
 		.call_address = instr_ptr,
 		.return_address = VM_RETURN,
 		.page_slot = slot,
-		.struct_page = -1
+		.struct_page = -1,
+		.page = heap[slot].page,
+		.arena_ptr = FRAME_NOT_IN_ARENA
 	};
 	call_stack_ptr = 1;
 	instr_ptr = ain->functions[fno].address;
+
+	if (unlikely(profiler_enabled)) {
+		profiler_unwind();
+		profiler_function_enter(fno);
+	}
 }
 
 /*
@@ -307,40 +473,42 @@ static void scenario_call(int slot)
  *   - callee pushes return value on the stack
  *   - RETURN jumps to return address (saved in stack frame)
  */
-static int _function_call(int fno, int return_address)
+static struct page *_function_call(int fno, int return_address)
 {
 	struct ain_function *f = &ain->functions[fno];
-	int slot = heap_alloc_slot(VM_PAGE);
-	heap_set_page(slot, alloc_page(LOCAL_PAGE, fno, f->nr_vars));
+	struct function_call *call = &call_stack[call_stack_ptr++];
+	call->fno = fno;
+	call->call_address = instr_ptr;
+	call->return_address = return_address;
+	call->struct_page = -1;
+	frame_alloc_page(call, fno, f->nr_vars);
 
-	call_stack[call_stack_ptr++] = (struct function_call) {
-		.fno = fno,
-		.call_address = instr_ptr,
-		.return_address = return_address,
-		.page_slot = slot,
-		.struct_page = -1
-	};
 	// initialize local variables
 	for (int i = f->nr_args; i < f->nr_vars; i++) {
-		heap[slot].page->values[i] = variable_initval(f->vars[i].type.data);
+		call->page->values[i] = variable_initval(f->vars[i].type.data);
 	}
 	// jump to function start
 	instr_ptr = ain->functions[fno].address;
 
-	return slot;
+	if (jit_enabled)
+		jit_function_called(fno);
+	if (unlikely(profiler_enabled))
+		profiler_function_enter(fno);
+
+	return call->page;
 }
 
 static void function_call(int fno, int return_address)
 {
-	int slot = _function_call(fno, return_address);
+	struct page *page = _function_call(fno, return_address);
 
 	// pop arguments, store in local page
 	struct ain_function *f = &ain->functions[fno];
 	for (int i = f->nr_args - 1; i >= 0; i--) {
-		heap[slot].page->values[i] = stack_pop();
+		page->values[i] = stack_pop();
 		switch (f->vars[i].type.data) {
 		case AIN_REF_TYPE:
-			heap_ref(heap[slot].page->values[i].i);
+			heap_ref(page->values[i].i);
 			break;
 		default:
 			break;
@@ -367,13 +535,13 @@ static void delegate_call(int dg_no)
 	int obj, fun;
 	delegate_get(heap_get_delegate_page(dg_page), dg_index, &obj, &fun);
 
-	int slot = _function_call(fun, VM_RETURN);
+	struct page *page = _function_call(fun, VM_RETURN);
 
 	// copy arguments into local page
 	struct ain_function_type *dg = &ain->delegates[dg_no];
 	for (int i = 0; i < dg->nr_arguments; i++) {
 		union vm_value arg = stack_peek((dg->nr_arguments + 1) - i);
-		heap[slot].page->values[i] = vm_copy(arg, dg->variables[i].type.data);
+		page->values[i] = vm_copy(arg, dg->variables[i].type.data);
 	}
 
 	call_stack[call_stack_ptr-1].struct_page = obj;
@@ -394,9 +562,46 @@ void vm_call(int fno, int struct_page)
 	instr_ptr = saved_ip;
 }
 
+/*
+ * Call the comparator function FNO with arguments A and B, and return the
+ * result. This is equivalent to pushing A and B and calling vm_call(), but
+ * the arguments are written directly into the callee's local page. Since the
+ * frame comes from the top of the frame arena, repeated calls (e.g. from a
+ * sort) reuse the same frame memory.
+ */
+int vm_call_compare(int fno, union vm_value a, union vm_value b)
+{
+	struct ain_function *f = &ain->functions[fno];
+	if (unlikely(f->nr_args != 2)) {
+		stack_push(a);
+		stack_push(b);
+		vm_call(fno, -1);
+		return stack_pop().i;
+	}
+
+	size_t saved_ip = instr_ptr;
+	struct page *page = _function_call(fno, VM_RETURN);
+	page->values[0] = a;
+	page->values[1] = b;
+	for (int i = 0; i < 2; i++) {
+		switch (f->vars[i].type.data) {
+		case AIN_REF_TYPE:
+			heap_ref(page->values[i].i);
+			break;
+		default:
+			break;
+		}
+	}
+	vm_execute();
+	instr_ptr = saved_ip;
+	return stack_pop().i;
+}
+
 static void function_return(void)
 {
-	heap_unref(call_stack[call_stack_ptr-1].page_slot);
+	if (unlikely(profiler_enabled))
+		profiler_function_leave();
+	frame_free_page(&call_stack[call_stack_ptr-1]);
 	instr_ptr = call_stack[call_stack_ptr-1].return_address;
 	call_stack_ptr--;
 }
@@ -551,7 +756,8 @@ static void system_call(enum syscall_code code)
 	case SYS_EXISTS_SAVE_FILE: {
 		int slot = stack_pop().i;
 		char *path = savedir_path(heap_get_string(slot)->text);
-		stack_push(file_exists(path));
+		// a save whose write failed doesn't exist as far as the game is concerned
+		stack_push(save_writer_flush(path) && file_exists(path));
 		heap_unref(slot);
 		free(path);
 		break;
@@ -647,7 +853,12 @@ static void system_call(enum syscall_code code)
 		int dst = stack_pop().i;
 		char *u_src = savedir_path(heap_get_string(src)->text);
 		char *u_dst = savedir_path(heap_get_string(dst)->text);
-		stack_push(file_copy(u_src, u_dst));
+		if (!save_writer_flush(u_src)) {
+			WARNING("Last write to save file failed: %s", display_utf0(u_src));
+			stack_push(0);
+		} else {
+			stack_push(file_copy(u_src, u_dst));
+		}
 		free(u_src);
 		free(u_dst);
 		heap_unref(src);
@@ -659,32 +870,211 @@ static void system_call(enum syscall_code code)
 	}
 }
 
-uint32_t get_switch_address(int no, int val)
+/*
+ * Lookup tables for SWITCH/STRSWITCH.
+ *
+ * Each entry in ain->switches gets a table the first time it is executed.
+ * Integer switches over a compact range use a direct jump table, other
+ * integer switches use a sorted table (binary search). String switches use an
+ * open-addressed hash table keyed by a precomputed hash of each case string.
+ *
+ * In all cases the first case with a given value takes precedence, as with
+ * a linear scan over the cases.
+ */
+struct switch_case {
+	int32_t value;
+	uint32_t address;
+};
+
+struct strswitch_case {
+	uint32_t hash;
+	int32_t case_no; // -1 if the slot is empty
+};
+
+struct switch_table {
+	enum {
+		SWITCH_TABLE_NONE,
+		SWITCH_TABLE_DENSE,
+		SWITCH_TABLE_SORTED,
+		SWITCH_TABLE_STRING,
+	} type;
+	union {
+		// SWITCH_TABLE_DENSE: addresses[value - min] (0 = default)
+		struct {
+			int32_t min;
+			uint32_t size;
+			uint32_t *addresses;
+		} dense;
+		// SWITCH_TABLE_SORTED
+		struct {
+			int nr_cases;
+			struct switch_case *cases;
+		} sorted;
+		// SWITCH_TABLE_STRING (mask = table size - 1)
+		struct {
+			uint32_t mask;
+			struct strswitch_case *slots;
+		} string;
+	};
+};
+
+static struct switch_table *switch_tables = NULL;
+
+static int switch_case_compare(const void *_a, const void *_b)
 {
-	struct ain_switch *s = &ain->switches[no];
+	const struct switch_case *a = _a, *b = _b;
+	if (a->value != b->value)
+		return a->value < b->value ? -1 : 1;
+	return 0;
+}
+
+static struct switch_table *get_switch_table(int no)
+{
+	if (unlikely(!switch_tables))
+		switch_tables = xcalloc(ain->nr_switches, sizeof(struct switch_table));
+	return &switch_tables[no];
+}
+
+static void build_switch_table(struct switch_table *t, struct ain_switch *s)
+{
+	if (s->nr_cases == 0) {
+		t->type = SWITCH_TABLE_SORTED;
+		t->sorted.nr_cases = 0;
+		t->sorted.cases = NULL;
+		return;
+	}
+
+	int32_t min = s->cases[0].value, max = s->cases[0].value;
+	for (int i = 1; i < s->nr_cases; i++) {
+		min = min(min, s->cases[i].value);
+		max = max(max, s->cases[i].value);
+	}
+
+	// use a jump table if it's at most (roughly) 2x the number of cases
+	uint64_t range = (int64_t)max - (int64_t)min + 1;
+	if (range <= (uint64_t)s->nr_cases * 2 + 16) {
+		t->type = SWITCH_TABLE_DENSE;
+		t->dense.min = min;
+		t->dense.size = range;
+		t->dense.addresses = xcalloc(range, sizeof(uint32_t));
+		for (int i = s->nr_cases - 1; i >= 0; i--) {
+			t->dense.addresses[s->cases[i].value - min] = s->cases[i].address;
+		}
+		return;
+	}
+
+	// otherwise use a sorted table
+	// NOTE: qsort is not stable, so duplicate cases are removed (keeping the
+	//       first) before sorting
+	struct switch_case *cases = xmalloc(s->nr_cases * sizeof(struct switch_case));
+	int nr_cases = 0;
 	for (int i = 0; i < s->nr_cases; i++) {
-		if (s->cases[i].value == val) {
-			return s->cases[i].address;
+		bool dup = false;
+		for (int j = 0; j < i && !dup; j++) {
+			dup = s->cases[j].value == s->cases[i].value;
 		}
+		if (dup)
+			continue;
+		cases[nr_cases++] = (struct switch_case) {
+			.value = s->cases[i].value,
+			.address = s->cases[i].address
+		};
 	}
-	if (s->default_address > 0)
-		return s->default_address;
-	else
-		return instr_ptr + instruction_width(SWITCH);
+	qsort(cases, nr_cases, sizeof(struct switch_case), switch_case_compare);
+	t->type = SWITCH_TABLE_SORTED;
+	t->sorted.nr_cases = nr_cases;
+	t->sorted.cases = cases;
 }
 
-uint32_t get_strswitch_address(int no, struct string *str)
+static void build_strswitch_table(struct switch_table *t, struct ain_switch *s)
 {
-	struct ain_switch *s = &ain->switches[no];
+	uint32_t size = 8;
+	while (size < (uint32_t)s->nr_cases * 2)
+		size *= 2;
+
+	t->type = SWITCH_TABLE_STRING;
+	t->string.mask = size - 1;
+	t->string.slots = xmalloc(size * sizeof(struct strswitch_case));
+	for (uint32_t i = 0; i < size; i++) {
+		t->string.slots[i].case_no = -1;
+	}
+
 	for (int i = 0; i < s->nr_cases; i++) {
-		if (!strcmp(str->text, ain->strings[s->cases[i].value]->text)) {
-			return s->cases[i].address;
+		struct string *str = ain->strings[s->cases[i].value];
+		uint32_t hash = intern_string_hash(str);
+		uint32_t slot = hash & t->string.mask;
+		for (;; slot = (slot + 1) & t->string.mask) {
+			struct strswitch_case *c = &t->string.slots[slot];
+			if (c->case_no < 0) {
+				c->hash = hash;
+				c->case_no = i;
+				break;
+			}
+			// keep the first case for duplicate strings
+			struct string *other = ain->strings[s->cases[c->case_no].value];
+			if (c->hash == hash && other->size == str->size
+					&& !memcmp(other->text, str->text, str->size))
+				break;
 		}
 	}
+}
+
+static uint32_t switch_default_address(struct ain_switch *s, enum opcode op)
+{
 	if (s->default_address > 0)
 		return s->default_address;
-	else
-		return instr_ptr + instruction_width(STRSWITCH);
+	return instr_ptr + instruction_width(op);
+}
+
+uint32_t get_switch_address(int no, int val)
+{
+	struct ain_switch *s = &ain->switches[no];
+	struct switch_table *t = get_switch_table(no);
+	if (unlikely(t->type == SWITCH_TABLE_NONE))
+		build_switch_table(t, s);
+
+	if (t->type == SWITCH_TABLE_DENSE) {
+		uint32_t i = (uint32_t)((int64_t)val - t->dense.min);
+		if (i < t->dense.size && t->dense.addresses[i])
+			return t->dense.addresses[i];
+		return switch_default_address(s, SWITCH);
+	}
+
+	int lo = 0, hi = t->sorted.nr_cases - 1;
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		int32_t v = t->sorted.cases[mid].value;
+		if (v == val)
+			return t->sorted.cases[mid].address;
+		if (v < val)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return switch_default_address(s, SWITCH);
+}
+
+uint32_t get_strswitch_address(int no, struct string *str)
+{
+	struct ain_switch *s = &ain->switches[no];
+	struct switch_table *t = get_switch_table(no);
+	if (unlikely(t->type == SWITCH_TABLE_NONE))
+		build_strswitch_table(t, s);
+
+	uint32_t hash = intern_string_hash(str);
+	uint32_t slot = hash & t->string.mask;
+	for (;; slot = (slot + 1) & t->string.mask) {
+		struct strswitch_case *c = &t->string.slots[slot];
+		if (c->case_no < 0)
+			break;
+		if (c->hash != hash)
+			continue;
+		struct ain_switch_case *sc = &s->cases[c->case_no];
+		struct string *case_str = ain->strings[sc->value];
+		if (case_str->size == str->size && !memcmp(case_str->text, str->text, str->size))
+			return sc->address;
+	}
+	return switch_default_address(s, STRSWITCH);
 }
 
 static void echo_message(int i)
@@ -1392,49 +1782,54 @@ static enum opcode execute_instruction(enum opcode opcode)
 	case S_ADD: {
 		int b = stack_pop().i;
 		int a = stack_pop().i;
-		// TODO: can use string_append here?
-		stack_push_string(string_concatenate(heap_get_string(a), heap_get_string(b)));
-		heap_unref(a);
-		heap_unref(b);
+		stack_push(string_add(a, b));
 		break;
 	}
 	case S_LT: {
-		bool lt = strcmp(stack_peek_string(1)->text, stack_peek_string(0)->text) < 0;
+		struct string *a = stack_peek_string(1);
+		struct string *b = stack_peek_string(0);
+		bool lt = a == b ? false : strcmp(a->text, b->text) < 0;
 		heap_unref(stack_pop().i);
 		heap_unref(stack_pop().i);
 		stack_push(lt);
 		break;
 	}
 	case S_GT: {
-		bool gt = strcmp(stack_peek_string(1)->text, stack_peek_string(0)->text) > 0;
+		struct string *a = stack_peek_string(1);
+		struct string *b = stack_peek_string(0);
+		bool gt = a == b ? false : strcmp(a->text, b->text) > 0;
 		heap_unref(stack_pop().i);
 		heap_unref(stack_pop().i);
 		stack_push(gt);
 		break;
 	}
 	case S_LTE: {
-		bool lte = strcmp(stack_peek_string(1)->text, stack_peek_string(0)->text) <= 0;
+		struct string *a = stack_peek_string(1);
+		struct string *b = stack_peek_string(0);
+		bool lte = a == b ? true : strcmp(a->text, b->text) <= 0;
 		heap_unref(stack_pop().i);
 		heap_unref(stack_pop().i);
 		stack_push(lte);
 		break;
 	}
 	case S_GTE: {
-		bool gte = strcmp(stack_peek_string(1)->text, stack_peek_string(0)->text) >= 0;
+		struct string *a = stack_peek_string(1);
+		struct string *b = stack_peek_string(0);
+		bool gte = a == b ? true : strcmp(a->text, b->text) >= 0;
 		heap_unref(stack_pop().i);
 		heap_unref(stack_pop().i);
 		stack_push(gte);
 		break;
 	}
 	case S_NOTE: {
-		bool noteq = !!strcmp(stack_peek_string(1)->text, stack_peek_string(0)->text);
+		bool noteq = !string_equal(stack_peek_string(1), stack_peek_string(0));
 		heap_unref(stack_pop().i);
 		heap_unref(stack_pop().i);
 		stack_push(noteq);
 		break;
 	}
 	case S_EQUALE: {
-		bool eq = !strcmp(stack_peek_string(1)->text, stack_peek_string(0)->text);
+		bool eq = string_equal(stack_peek_string(1), stack_peek_string(0));
 		heap_unref(stack_pop().i);
 		heap_unref(stack_pop().i);
 		stack_push(eq);
@@ -1527,7 +1922,7 @@ static enum opcode execute_instruction(enum opcode opcode)
 		//int functype = stack_pop().i;
 		stack_pop();
 		int str = stack_pop().i;
-		int fno = get_function_by_name(heap_get_string(str)->text);
+		int fno = intern_get_function(heap_get_string(str)->text);
 		stack_pop_var()->i = fno > 0 ? fno : 0;
 		stack_push(str);
 		break;
@@ -1681,7 +2076,7 @@ static enum opcode execute_instruction(enum opcode opcode)
 	case A_SORT: {
 		int fno = stack_pop().i;
 		int array = stack_pop_var()->i;
-		array_sort(heap[array].page, fno);
+		array_sort(array, fno);
 		break;
 	}
 	case A_FIND: {
@@ -1909,7 +2304,7 @@ static enum opcode execute_instruction(enum opcode opcode)
 	case SH_IF_SREF_NE_STR0: {
 		struct string *a = heap_get_string(stack_pop_var()->i);
 		struct string *b = ain->strings[get_argument(0)];
-		if (strcmp(a->text, b->text))
+		if (!string_equal(a, b))
 			instr_ptr = get_argument(1);
 		else
 			instr_ptr += instruction_width(SH_IF_SREF_NE_STR0);
@@ -1936,25 +2331,25 @@ static enum opcode execute_instruction(enum opcode opcode)
 	case SH_STRUCTSREF_EQ_LOCALSREF: {
 		struct string *a = heap_get_string(member_get(get_argument(0)).i);
 		struct string *b = heap_get_string(local_get(get_argument(1)).i);
-		stack_push(!strcmp(a->text, b->text));
+		stack_push(string_equal(a, b));
 		break;
 	}
 	case SH_LOCALSREF_EQ_STR0: {
 		struct string *a = heap_get_string(local_get(get_argument(0)).i);
 		struct string *b = ain->strings[get_argument(1)];
-		stack_push(!strcmp(a->text, b->text));
+		stack_push(string_equal(a, b));
 		break;
 	}
 	case SH_STRUCTSREF_NE_LOCALSREF: {
 		struct string *a = heap_get_string(member_get(get_argument(0)).i);
 		struct string *b = heap_get_string(local_get(get_argument(1)).i);
-		stack_push(!!strcmp(a->text, b->text));
+		stack_push(!string_equal(a, b));
 		break;
 	}
 	case SH_LOCALSREF_NE_STR0: {
 		struct string *a = heap_get_string(local_get(get_argument(0)).i);
 		struct string *b = ain->strings[get_argument(1)];
-		stack_push(!!strcmp(a->text, b->text));
+		stack_push(!string_equal(a, b));
 		break;
 	}
 	case SH_STRUCT_SR_REF: {
@@ -2065,13 +2460,13 @@ static enum opcode execute_instruction(enum opcode opcode)
 	case SH_STRUCTSREF_NE_STR0: {
 		struct string *a = heap_get_string(member_get(get_argument(0)).i);
 		struct string *b = ain->strings[get_argument(1)];
-		stack_push(!!strcmp(a->text, b->text));
+		stack_push(!string_equal(a, b));
 		break;
 	}
 	case SH_GLOBALSREF_NE_STR0: {
 		struct string *a = heap_get_string(global_get(get_argument(0)).i);
 		struct string *b = ain->strings[get_argument(1)];
-		stack_push(!!strcmp(a->text, b->text));
+		stack_push(!string_equal(a, b));
 		break;
 	}
 	case SH_LOC_LT_IMM_OR_LOC_GE_IMM: {
@@ -2250,7 +2645,7 @@ static enum opcode execute_instruction(enum opcode opcode)
 	return opcode;
 }
 
-static void vm_execute(void)
+static void vm_execute_switch(void)
 {
 	for (;;) {
 		uint16_t opcode;
@@ -2259,10 +2654,516 @@ static void vm_execute(void)
 		if (unlikely(instr_ptr >= ain->code_size)) {
 			VM_ERROR("Illegal instruction pointer: 0x%08lX", instr_ptr);
 		}
+		if (jit_enabled && jit_execute())
+			continue;
 		opcode = get_opcode(instr_ptr);
+		if (unlikely(profiler_enabled))
+			profiler_count_opcode(opcode);
+		opcode = execute_instruction(opcode);
+		instr_ptr += instructions[opcode].ip_inc;
+	}
+}
+
+// Execute the instruction at instr_ptr and advance to the next instruction.
+void vm_execute_instruction(void)
+{
+	uint16_t opcode = get_opcode(instr_ptr);
+	opcode = execute_instruction(opcode);
+	instr_ptr += instructions[opcode].ip_inc;
+}
+
+#ifdef VM_THREADED_DISPATCH
+
+/*
+ * Pre-decoded instruction stream for threaded dispatch.
+ *
+ * The bytecode is translated once into an array of decoded instructions (in
+ * address order). Each entry holds the address of its handler in
+ * vm_execute_threaded() along with its decoded arguments, so that the common
+ * instructions can be dispatched without re-reading ain->code. Instructions
+ * without a dedicated handler (and breakpoints) fall back to
+ * execute_instruction().
+ */
+struct decoded_instruction {
+	const void *handler;
+	uint32_t addr;
+	int32_t args[3];
+};
+
+static struct decoded_instruction *decoded = NULL;
+static size_t nr_decoded = 0;
+// maps (address / 2) to an index into `decoded`
+static uint32_t *decoded_index = NULL;
+static const void * const *threaded_handlers = NULL;
+static const void *threaded_generic_handler = NULL;
+
+#define NO_DECODED_INDEX UINT32_MAX
+
+static void threaded_decode(struct decoded_instruction *d, uint32_t addr)
+{
+	uint16_t opcode = get_opcode(addr);
+	d->addr = addr;
+	d->handler = threaded_generic_handler;
+	if ((opcode & OPTYPE_MASK) == BREAKPOINT || opcode >= NR_OPCODES)
+		return;
+	for (int i = 0; i < instructions[opcode].nr_args && i < 3; i++) {
+		d->args[i] = LittleEndian_getDW(ain->code, addr + 2 + i*4);
+	}
+	if (threaded_handlers[opcode] && instructions[opcode].nr_args <= 3)
+		d->handler = threaded_handlers[opcode];
+}
+
+static void threaded_translate(const void * const *handlers, const void *generic)
+{
+	threaded_handlers = handlers;
+	threaded_generic_handler = generic;
+
+	// count instructions
+	nr_decoded = 0;
+	for (size_t addr = 0; addr < ain->code_size; nr_decoded++) {
+		uint16_t opcode = get_opcode(addr) & ~OPTYPE_MASK;
+		addr += opcode < NR_OPCODES ? instruction_width(opcode) : 2;
+	}
+
+	// NOTE: an extra entry at the end catches execution falling off the end
+	//       of the code section
+	decoded = xcalloc(nr_decoded + 1, sizeof(struct decoded_instruction));
+	decoded_index = xmalloc((ain->code_size / 2 + 1) * sizeof(uint32_t));
+	for (size_t i = 0; i < ain->code_size / 2 + 1; i++) {
+		decoded_index[i] = NO_DECODED_INDEX;
+	}
+
+	size_t addr = 0;
+	for (size_t i = 0; i < nr_decoded; i++) {
+		uint16_t opcode = get_opcode(addr) & ~OPTYPE_MASK;
+		threaded_decode(&decoded[i], addr);
+		decoded_index[addr / 2] = i;
+		addr += opcode < NR_OPCODES ? instruction_width(opcode) : 2;
+	}
+	decoded[nr_decoded].handler = generic;
+	decoded[nr_decoded].addr = ain->code_size;
+}
+
+/*
+ * Update the decoded instruction at ADDR after ain->code has been modified
+ * (e.g. when the debugger sets or clears a breakpoint).
+ */
+static void threaded_code_patched(uint32_t addr)
+{
+	if (!decoded || addr / 2 > ain->code_size / 2)
+		return;
+	uint32_t i = decoded_index[addr / 2];
+	if (i == NO_DECODED_INDEX)
+		return;
+	threaded_decode(&decoded[i], addr);
+}
+
+static struct decoded_instruction *threaded_lookup(size_t addr)
+{
+	if (unlikely(addr >= ain->code_size || addr & 1))
+		VM_ERROR("Illegal instruction pointer: 0x%08lX", addr);
+	uint32_t i = decoded_index[addr / 2];
+	if (unlikely(i == NO_DECODED_INDEX))
+		VM_ERROR("Illegal instruction pointer: 0x%08lX", addr);
+	return &decoded[i];
+}
+
+static void vm_execute_threaded(void)
+{
+	static const void * const handlers[NR_OPCODES] = {
+		[PUSH] = &&op_PUSH,
+		[POP] = &&op_POP,
+		[F_PUSH] = &&op_F_PUSH,
+		[REF] = &&op_REF,
+		[REFREF] = &&op_REFREF,
+		[DUP] = &&op_DUP,
+		[DUP2] = &&op_DUP2,
+		[DUP_U2] = &&op_DUP_U2,
+		[SWAP] = &&op_SWAP,
+		[PUSHGLOBALPAGE] = &&op_PUSHGLOBALPAGE,
+		[PUSHLOCALPAGE] = &&op_PUSHLOCALPAGE,
+		[PUSHSTRUCTPAGE] = &&op_PUSHSTRUCTPAGE,
+		[ASSIGN] = &&op_ASSIGN,
+		[F_ASSIGN] = &&op_ASSIGN,
+		[SH_GLOBALREF] = &&op_SH_GLOBALREF,
+		[SH_LOCALREF] = &&op_SH_LOCALREF,
+		[SH_STRUCTREF] = &&op_SH_STRUCTREF,
+		[SH_LOCALASSIGN] = &&op_SH_LOCALASSIGN,
+		[SH_LOCALINC] = &&op_SH_LOCALINC,
+		[SH_LOCALDEC] = &&op_SH_LOCALDEC,
+		[SH_LOCALREFREF] = &&op_SH_LOCALREFREF,
+		[SH_LOCALASSIGN_SUB_IMM] = &&op_SH_LOCALASSIGN_SUB_IMM,
+		[SH_MEM_ASSIGN_LOCAL] = &&op_SH_MEM_ASSIGN_LOCAL,
+		[SH_MEM_ASSIGN_IMM] = &&op_SH_MEM_ASSIGN_IMM,
+		[SH_LOCAL_ASSIGN_STRUCTREF] = &&op_SH_LOCAL_ASSIGN_STRUCTREF,
+		[SH_STRUCTREF_GT_IMM] = &&op_SH_STRUCTREF_GT_IMM,
+		[SH_STRUCTREF2] = &&op_SH_STRUCTREF2,
+		[PAGE_REF] = &&op_PAGE_REF,
+		[CALLFUNC] = &&op_CALLFUNC,
+		[CALLMETHOD] = &&op_CALLMETHOD,
+		[RETURN] = &&op_RETURN,
+		[JUMP] = &&op_JUMP,
+		[IFZ] = &&op_IFZ,
+		[IFNZ] = &&op_IFNZ,
+		[SH_IF_LOC_LT_IMM] = &&op_SH_IF_LOC_LT_IMM,
+		[SH_IF_LOC_GE_IMM] = &&op_SH_IF_LOC_GE_IMM,
+		[SH_IF_LOC_GT_IMM] = &&op_SH_IF_LOC_GT_IMM,
+		[SH_IF_LOC_NE_IMM] = &&op_SH_IF_LOC_NE_IMM,
+		[SH_IF_STRUCTREF_Z] = &&op_SH_IF_STRUCTREF_Z,
+		[SH_IF_STRUCTREF_EQ_IMM] = &&op_SH_IF_STRUCTREF_EQ_IMM,
+		[SH_IF_STRUCTREF_NE_IMM] = &&op_SH_IF_STRUCTREF_NE_IMM,
+		[SH_IF_STRUCTREF_GT_IMM] = &&op_SH_IF_STRUCTREF_GT_IMM,
+		[SH_IF_STRUCTREF_NE_LOCALREF] = &&op_SH_IF_STRUCTREF_NE_LOCALREF,
+		[INV] = &&op_INV,
+		[NOT] = &&op_NOT,
+		[ADD] = &&op_ADD,
+		[SUB] = &&op_SUB,
+		[MUL] = &&op_MUL,
+		[DIV] = &&op_DIV,
+		[MOD] = &&op_MOD,
+		[AND] = &&op_AND,
+		[OR] = &&op_OR,
+		[LT] = &&op_LT,
+		[GT] = &&op_GT,
+		[LTE] = &&op_LTE,
+		[GTE] = &&op_GTE,
+		[NOTE] = &&op_NOTE,
+		[EQUALE] = &&op_EQUALE,
+		[PLUSA] = &&op_PLUSA,
+		[MINUSA] = &&op_MINUSA,
+		[INC] = &&op_INC,
+		[DEC] = &&op_DEC,
+		[ITOB] = &&op_ITOB,
+		[FTOI] = &&op_FTOI,
+		[ITOF] = &&op_ITOF,
+		[F_ADD] = &&op_F_ADD,
+		[F_SUB] = &&op_F_SUB,
+		[F_MUL] = &&op_F_MUL,
+		[F_DIV] = &&op_F_DIV,
+		[F_LT] = &&op_F_LT,
+		[F_GT] = &&op_F_GT,
+		[F_LTE] = &&op_F_LTE,
+		[F_GTE] = &&op_F_GTE,
+		[S_POP] = &&op_S_POP,
+		[SR_POP] = &&op_S_POP,
+		[FUNC] = &&op_FUNC,
+	};
+	struct decoded_instruction *ip;
+
+	if (unlikely(!decoded))
+		threaded_translate(handlers, &&op_generic);
+
+// Dispatch the next instruction in the stream.
+#define NEXT() do { ip++; instr_ptr = ip->addr; goto *ip->handler; } while (0)
+// Dispatch the instruction at `instr_ptr`.
+#define DISPATCH() goto dispatch
+#define BRANCH(cond, target) do {						\
+	if (cond) {								\
+		instr_ptr = (target);						\
+		DISPATCH();							\
+	}									\
+	NEXT();									\
+} while (0)
+#define INT_BINOP(op) do {							\
+	stack[stack_ptr-2].i op stack[stack_ptr-1].i;				\
+	stack_ptr--;								\
+	NEXT();									\
+} while (0)
+#define INT_CMP(op) do {							\
+	stack[stack_ptr-2].i = stack[stack_ptr-2].i op stack[stack_ptr-1].i;	\
+	stack_ptr--;								\
+	NEXT();									\
+} while (0)
+#define FLOAT_BINOP(op) do {							\
+	float f = stack_pop().f;						\
+	stack_set(0, stack_peek(0).f op f);					\
+	NEXT();									\
+} while (0)
+#define FLOAT_CMP(op) do {							\
+	float f = stack_pop().f;						\
+	stack_set(0, stack_peek(0).f op f ? 1 : 0);				\
+	NEXT();									\
+} while (0)
+
+dispatch:
+	if (instr_ptr == VM_RETURN)
+		return;
+	ip = threaded_lookup(instr_ptr);
+	goto *ip->handler;
+
+op_generic: {
+		if (unlikely(instr_ptr >= ain->code_size))
+			VM_ERROR("Illegal instruction pointer: 0x%08lX", instr_ptr);
+		uint16_t opcode = get_opcode(instr_ptr);
 		opcode = execute_instruction(opcode);
 		instr_ptr += instructions[opcode].ip_inc;
+		DISPATCH();
+	}
+	//
+	// --- Stack Management ---
+	//
+op_PUSH:
+	stack_push(ip->args[0]);
+	NEXT();
+op_POP:
+	stack_ptr--;
+	NEXT();
+op_F_PUSH:
+	stack_push((union vm_value) { .i = ip->args[0] });
+	NEXT();
+op_REF:
+	stack_push(stack_pop_var()->i);
+	NEXT();
+op_REFREF: {
+		union vm_value *ref = stack_pop_var();
+		stack_push(ref[0].i);
+		stack_push(ref[1].i);
+		NEXT();
+	}
+op_DUP:
+	stack_push(stack_peek(0).i);
+	NEXT();
+op_DUP2: {
+		int a = stack_peek(1).i;
+		int b = stack_peek(0).i;
+		stack_push(a);
+		stack_push(b);
+		NEXT();
+	}
+op_DUP_U2:
+	stack_push(stack_peek(1).i);
+	NEXT();
+op_SWAP: {
+		int a = stack_peek(1).i;
+		stack_set(1, stack_peek(0));
+		stack_set(0, a);
+		NEXT();
+	}
+	//
+	// --- Variables ---
+	//
+op_PUSHGLOBALPAGE:
+	stack_push(0);
+	NEXT();
+op_PUSHLOCALPAGE:
+	stack_push(local_page_slot());
+	NEXT();
+op_PUSHSTRUCTPAGE:
+	stack_push(struct_page_slot());
+	NEXT();
+op_ASSIGN: {
+		union vm_value val = stack_pop();
+		stack_pop_var()[0] = val;
+		stack_push(val);
+		NEXT();
+	}
+op_SH_GLOBALREF:
+	stack_push(global_get(ip->args[0]).i);
+	NEXT();
+op_SH_LOCALREF:
+	stack_push(local_get(ip->args[0]).i);
+	NEXT();
+op_SH_STRUCTREF:
+	stack_push(member_get(ip->args[0]));
+	NEXT();
+op_SH_LOCALASSIGN:
+	local_set(ip->args[0], ip->args[1]);
+	NEXT();
+op_SH_LOCALINC:
+	local_ptr(ip->args[0])->i++;
+	NEXT();
+op_SH_LOCALDEC:
+	local_ptr(ip->args[0])->i--;
+	NEXT();
+op_SH_LOCALREFREF:
+	stack_push(local_get(ip->args[0]));
+	stack_push(local_get(ip->args[0]+1));
+	NEXT();
+op_SH_LOCALASSIGN_SUB_IMM:
+	local_ptr(ip->args[0])->i -= ip->args[1];
+	NEXT();
+op_SH_MEM_ASSIGN_LOCAL:
+	member_set(ip->args[0], local_get(ip->args[1]).i);
+	NEXT();
+op_SH_MEM_ASSIGN_IMM:
+	member_set(ip->args[0], ip->args[1]);
+	NEXT();
+op_SH_LOCAL_ASSIGN_STRUCTREF:
+	local_set(ip->args[0], member_get(ip->args[1]).i);
+	NEXT();
+op_SH_STRUCTREF_GT_IMM:
+	stack_push(member_get(ip->args[0]).i > ip->args[1] ? 1 : 0);
+	NEXT();
+op_SH_STRUCTREF2: {
+		int memb = member_get(ip->args[0]).i;
+		stack_push(page_get_var(heap_get_page(memb), ip->args[1]));
+		NEXT();
+	}
+op_PAGE_REF: {
+		struct page *page = heap_get_page(stack_pop().i);
+		stack_push(page_get_var(page, ip->args[0]));
+		NEXT();
+	}
+	//
+	// --- Control Flow ---
+	//
+op_CALLFUNC:
+	function_call(ip->args[0], ip->addr + instruction_width(CALLFUNC));
+	DISPATCH();
+op_CALLMETHOD:
+	method_call(ip->args[0], ip->addr + instruction_width(CALLMETHOD));
+	DISPATCH();
+op_RETURN:
+	function_return();
+	DISPATCH();
+op_JUMP:
+	instr_ptr = ip->args[0];
+	DISPATCH();
+op_IFZ:
+	BRANCH(!stack_pop().i, ip->args[0]);
+op_IFNZ:
+	BRANCH(stack_pop().i, ip->args[0]);
+op_SH_IF_LOC_LT_IMM:
+	BRANCH(local_get(ip->args[0]).i < ip->args[1], ip->args[2]);
+op_SH_IF_LOC_GE_IMM:
+	BRANCH(local_get(ip->args[0]).i >= ip->args[1], ip->args[2]);
+op_SH_IF_LOC_GT_IMM:
+	BRANCH(local_get(ip->args[0]).i > ip->args[1], ip->args[2]);
+op_SH_IF_LOC_NE_IMM:
+	BRANCH(local_get(ip->args[0]).i != ip->args[1], ip->args[2]);
+op_SH_IF_STRUCTREF_Z:
+	BRANCH(!member_get(ip->args[0]).i, ip->args[1]);
+op_SH_IF_STRUCTREF_EQ_IMM:
+	BRANCH(member_get(ip->args[0]).i == ip->args[1], ip->args[2]);
+op_SH_IF_STRUCTREF_NE_IMM:
+	BRANCH(member_get(ip->args[0]).i != ip->args[1], ip->args[2]);
+op_SH_IF_STRUCTREF_GT_IMM:
+	BRANCH(member_get(ip->args[0]).i > ip->args[1], ip->args[2]);
+op_SH_IF_STRUCTREF_NE_LOCALREF:
+	BRANCH(member_get(ip->args[0]).i != local_get(ip->args[1]).i, ip->args[2]);
+op_FUNC:
+	NEXT();
+	//
+	// --- Arithmetic ---
+	//
+op_INV:
+	stack[stack_ptr-1].i = -stack[stack_ptr-1].i;
+	NEXT();
+op_NOT:
+	stack[stack_ptr-1].i = !stack[stack_ptr-1].i;
+	NEXT();
+op_ADD:
+	INT_BINOP(+=);
+op_SUB:
+	INT_BINOP(-=);
+op_MUL:
+	INT_BINOP(*=);
+op_DIV:
+	if (!stack[stack_ptr-1].i) {
+		stack[stack_ptr-2].i = 0;
+		stack_ptr--;
+		NEXT();
+	}
+	INT_BINOP(/=);
+op_MOD:
+	if (!stack[stack_ptr-1].i) {
+		stack[stack_ptr-2].i = 0;
+		stack_ptr--;
+		NEXT();
+	}
+	INT_BINOP(%=);
+op_AND:
+	INT_BINOP(&=);
+op_OR:
+	INT_BINOP(|=);
+op_LT:
+	INT_CMP(<);
+op_GT:
+	INT_CMP(>);
+op_LTE:
+	INT_CMP(<=);
+op_GTE:
+	INT_CMP(>=);
+op_NOTE:
+	INT_CMP(!=);
+op_EQUALE:
+	INT_CMP(==);
+op_PLUSA: {
+		int32_t n = stack_pop().i;
+		stack_push(stack_pop_var()->i += n);
+		NEXT();
+	}
+op_MINUSA: {
+		int32_t n = stack_pop().i;
+		stack_push(stack_pop_var()->i -= n);
+		NEXT();
+	}
+op_INC:
+	stack_pop_var()[0].i++;
+	NEXT();
+op_DEC:
+	stack_pop_var()[0].i--;
+	NEXT();
+op_ITOB:
+	stack_set(0, !!stack_peek(0).i);
+	NEXT();
+op_FTOI:
+	stack_set(0, (int32_t)stack_peek(0).f);
+	NEXT();
+op_ITOF:
+	stack_set(0, (float)stack_peek(0).i);
+	NEXT();
+op_F_ADD:
+	FLOAT_BINOP(+);
+op_F_SUB:
+	FLOAT_BINOP(-);
+op_F_MUL:
+	FLOAT_BINOP(*);
+op_F_DIV:
+	FLOAT_BINOP(/);
+op_F_LT:
+	FLOAT_CMP(<);
+op_F_GT:
+	FLOAT_CMP(>);
+op_F_LTE:
+	FLOAT_CMP(<=);
+op_F_GTE:
+	FLOAT_CMP(>=);
+	//
+	// --- Strings/Structs ---
+	//
+op_S_POP:
+	heap_unref(stack_pop().i);
+	NEXT();
+
+#undef NEXT
+#undef DISPATCH
+#undef BRANCH
+#undef INT_BINOP
+#undef INT_CMP
+#undef FLOAT_BINOP
+#undef FLOAT_CMP
+}
+
+#endif /* VM_THREADED_DISPATCH */
+
+void vm_code_patched(uint32_t addr)
+{
+#ifdef VM_THREADED_DISPATCH
+	threaded_code_patched(addr);
+#endif
+	jit_invalidate(addr);
+}
+
+static void vm_execute(void)
+{
+#ifdef VM_THREADED_DISPATCH
+	if (config.threaded_dispatch && !jit_enabled && !profiler_enabled) {
+		vm_execute_threaded();
+		return;
 	}
+#endif
+	vm_execute_switch();
 }
 
 static void vm_free(void)
@@ -2271,8 +3172,15 @@ static void vm_free(void)
 	exit_libraries();
 	// flush call stack
 	for (int i = call_stack_ptr - 1; i >= 0; i--) {
-		exit_unref(call_stack[i].page_slot);
+		struct function_call *call = &call_stack[i];
+		if (call->arena_ptr != FRAME_NOT_IN_ARENA) {
+			// move to the heap so that exit_unref can clean it up
+			call_frame_page_slot(call);
+			heap_set_page(call->page_slot, frame_copy_page(call->page));
+		}
+		exit_unref(call->page_slot);
 	}
+	frame_arena_ptr = 0;
 	// free globals
 	exit_unref(0);
 }
@@ -2281,6 +3189,8 @@ static jmp_buf reset_buf;
 
 static _Noreturn void vm_reset(void)
 {
+	if (profiler_enabled)
+		profiler_unwind();
 	vm_free();
 	longjmp(reset_buf, 1);
 }
@@ -2295,14 +3205,25 @@ int vm_execute_ain(struct ain *program)
 		stack_size = INITIAL_STACK_SIZE;
 		stack = xmalloc(INITIAL_STACK_SIZE * sizeof(union vm_value));
 	}
+	if (!frame_arena) {
+		frame_arena = xmalloc(FRAME_ARENA_SIZE);
+	}
 	stack_ptr = 0;
 	call_stack_ptr = 0;
+	frame_arena_ptr = 0;
 
 	heap_init();
+	intern_ain(ain);
 	init_libraries();
+	// NOTE: the profiler counts instructions in the switch interpreter, so it
+	//       is incompatible with the JIT
+	if (config.profile && !profiler_enabled)
+		profiler_init(config.profile);
+	if (config.jit && !profiler_enabled)
+		jit_init();
 
 	// Initialize globals
-	heap[0].ref = 1;
+	heap_refs[0] = 1;
 	heap_set_page(0, alloc_page(GLOBAL_PAGE, 0, ain->nr_globals));
 	for (int i = 0; i < ain->nr_globals; i++) {
 		if (ain->globals[i].type.data == AIN_STRUCT) {
@@ -2376,13 +3297,20 @@ int vm_time(void)
 
 _Noreturn void vm_exit(int code)
 {
+	if (profiler_enabled) {
+		profiler_unwind();
+		profiler_write(NULL);
+	}
 	vm_free();
 #ifdef DEBUG_HEAP
+	size_t nr_leaked = 0;
 	for (size_t i = 0; i < heap_size; i++) {
-		if (heap[i].ref > 0)
+		if (heap_refs[i] > 0) {
 			heap_describe_slot(i);
+			nr_leaked++;
+		}
 	}
-	sys_message("Number of leaked objects: %d\n", heap_free_ptr);
+	sys_message("Number of leaked objects: %zu\n", nr_leaked);
 #endif
 	sys_exit(code);
 }
@@ -0,0 +1,132 @@
+/* Copyright (C) 2023 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Check that the stream writer produces the same text as cJSON_Print, so
+ * that save files don't change depending on which of the two wrote them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cJSON.h"
+
+#include "json_stream.h"
+
+static const double numbers[] = {
+	0.0, -0.0, 1.0, -1.0, 42.0, 0.5, -2.25, 0.1, 1.0 / 3.0,
+	2147483647.0, -2147483648.0, 2147483648.0, -2147483649.0,
+	1e15, 1e17, 123456789012345678.0, 1e20, -1e300, 1e-300,
+};
+#define NR_NUMBERS (sizeof(numbers) / sizeof(*numbers))
+
+static int failed = 0;
+
+static void compare(const char *what, cJSON *json, struct json_writer *w)
+{
+	char *expected = cJSON_Print(json);
+	char *actual = json_writer_finish(w, NULL);
+	if (strcmp(expected, actual)) {
+		printf("FAIL: %s\n--- cJSON_Print:\n%s\n--- json_writer:\n%s\n", what, expected, actual);
+		failed++;
+	}
+	free(expected);
+	free(actual);
+	cJSON_Delete(json);
+}
+
+static void test_numbers(void)
+{
+	for (unsigned i = 0; i < NR_NUMBERS; i++) {
+		struct json_writer w;
+		json_writer_init(&w);
+		json_write_number(&w, numbers[i]);
+		char what[64];
+		snprintf(what, sizeof(what), "number %.17g", numbers[i]);
+		compare(what, cJSON_CreateNumber(numbers[i]), &w);
+	}
+}
+
+static void test_nested(void)
+{
+	struct json_writer w;
+	json_writer_init(&w);
+	cJSON *root = cJSON_CreateObject();
+
+	json_begin_object(&w);
+	json_write_key(&w, "key");
+	json_write_string(&w, "a \"quoted\"\tstring\n");
+	cJSON_AddStringToObject(root, "key", "a \"quoted\"\tstring\n");
+
+	json_write_key(&w, "ints");
+	json_begin_array(&w);
+	cJSON *ints = cJSON_AddArrayToObject(root, "ints");
+	for (int i = -3; i <= 3; i++) {
+		json_write_int(&w, i * 1000);
+		cJSON_AddItemToArray(ints, cJSON_CreateNumber(i * 1000));
+	}
+	json_end_array(&w);
+
+	json_write_key(&w, "numbers");
+	json_begin_array(&w);
+	cJSON *nums = cJSON_AddArrayToObject(root, "numbers");
+	for (unsigned i = 0; i < NR_NUMBERS; i++) {
+		json_write_number(&w, numbers[i]);
+		cJSON_AddItemToArray(nums, cJSON_CreateNumber(numbers[i]));
+	}
+	json_end_array(&w);
+
+	json_write_key(&w, "objects");
+	json_begin_array(&w);
+	cJSON *objs = cJSON_AddArrayToObject(root, "objects");
+	for (int i = 0; i < 2; i++) {
+		cJSON *obj = cJSON_CreateObject();
+		json_begin_object(&w);
+		json_write_key(&w, "index");
+		json_write_int(&w, i);
+		cJSON_AddNumberToObject(obj, "index", i);
+		json_write_key(&w, "empty");
+		json_begin_array(&w);
+		json_end_array(&w);
+		cJSON_AddArrayToObject(obj, "empty");
+		json_write_key(&w, "null");
+		json_write_null(&w);
+		cJSON_AddNullToObject(obj, "null");
+		json_end_object(&w);
+		cJSON_AddItemToArray(objs, obj);
+	}
+	json_end_array(&w);
+
+	json_write_key(&w, "empty");
+	json_begin_object(&w);
+	json_end_object(&w);
+	cJSON_AddObjectToObject(root, "empty");
+	json_end_object(&w);
+
+	compare("nested", root, &w);
+}
+
+int main(void)
+{
+	test_numbers();
+	test_nested();
+	if (failed) {
+		printf("%d tests failed.\n", failed);
+		return 1;
+	}
+	printf("All tests passed\n");
+	return 0;
+}